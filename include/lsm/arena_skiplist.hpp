@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+#include "type.hpp"
+
+namespace lsm {
+
+// SkipList with nodes bump-allocated from reusable chunks and forward pointers stored inline after each node.
+// The level of a node is drawn from the bits of a single random word, so ProbDiv must be a power of 2.
+template <typename Key, typename Value, typename Compare = std::less<Key>, typename RandomGenerator = std::mt19937_64,
+          uint32_t Prob = 1u, uint32_t ProbDiv = 2u, uint32_t MaxLevel = 64, size_type ChunkSize = 64 * 1024>
+class ArenaSkipList {
+private:
+	static_assert(ProbDiv > 1 && (ProbDiv & (ProbDiv - 1)) == 0 && Prob < ProbDiv);
+
+	constexpr static uint32_t get_prob_bits() {
+		uint32_t bits = 0;
+		while ((1u << bits) != ProbDiv)
+			++bits;
+		return bits;
+	}
+	constexpr static uint32_t kProbBits = get_prob_bits();
+	constexpr static uint32_t kRandomBits = std::numeric_limits<typename RandomGenerator::result_type>::digits;
+	constexpr static level_type kMaxLevel = std::min<level_type>(MaxLevel, kRandomBits / kProbBits + 1);
+	constexpr static bool kTrivial = std::is_trivially_destructible_v<Key> && std::is_trivially_destructible_v<Value>;
+
+	struct Node {
+		Key key;
+		Value value;
+		// Followed by the remaining level - 1 pointers
+		Node *forward[1];
+
+		inline static size_type GetAllocSize(level_type level) {
+			return (sizeof(Node) + (level - 1) * sizeof(Node *) + alignof(Node) - 1) / alignof(Node) * alignof(Node);
+		}
+	};
+	static_assert(alignof(Node) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+	RandomGenerator m_rand_gen;
+	level_type m_level{0};
+	size_type m_size{0};
+	Node *m_head[kMaxLevel]{};
+
+	std::vector<std::unique_ptr<char[]>> m_chunks, m_large_chunks;
+	size_type m_chunk_id{0}, m_chunk_pos{0};
+
+	inline void *allocate(size_type size) {
+		if (size > ChunkSize)
+			return m_large_chunks.emplace_back(new char[size]).get();
+		if (m_chunk_pos + size > ChunkSize) {
+			++m_chunk_id;
+			m_chunk_pos = 0;
+		}
+		if (m_chunk_id == m_chunks.size())
+			m_chunks.emplace_back(new char[ChunkSize]);
+		void *ret = m_chunks[m_chunk_id].get() + m_chunk_pos;
+		m_chunk_pos += size;
+		return ret;
+	}
+	inline Node *new_node(Key &&key, Value &&value, level_type level) {
+		return new (allocate(Node::GetAllocSize(level))) Node{std::move(key), std::move(value), {}};
+	}
+	inline void destroy_nodes() {
+		if constexpr (!kTrivial)
+			for (Node *node = m_head[0], *next; node; node = next) {
+				next = node->forward[0];
+				node->~Node();
+			}
+	}
+
+	inline static bool forward_key_less(Node *const *forward, level_type l, const Key &key) {
+		return forward[l] && Compare{}(forward[l]->key, key);
+	}
+	inline static bool key_equal(const Key &l, const Key &r) { return !Compare{}(l, r) && !Compare{}(r, l); }
+
+	inline level_type random_level() {
+		auto word = m_rand_gen();
+		level_type level = 1;
+		while (level != kMaxLevel && (word & (ProbDiv - 1)) < Prob) {
+			word >>= kProbBits;
+			++level;
+		}
+		return level;
+	}
+
+	// Forward pointers of the last node before the key, on the lowest level
+	inline Node *const *find_prev(const Key &key) const {
+		Node *const *forward = m_head;
+		for (level_type l = m_level - 1; ~l; --l)
+			while (forward_key_less(forward, l, key))
+				forward = forward[l]->forward;
+		return forward;
+	}
+	// Same as above, records the forward pointers to update on each level
+	inline Node *find_prev(const Key &key, Node **prev_forward[]) {
+		Node **forward = m_head;
+		for (level_type l = m_level - 1; ~l; --l) {
+			while (forward_key_less(forward, l, key))
+				forward = forward[l]->forward;
+			prev_forward[l] = forward;
+		}
+		return forward[0];
+	}
+	inline void link(Node **prev_forward[], Key &&key, Value &&value) {
+		level_type ins_level = random_level();
+		for (; m_level < ins_level; ++m_level)
+			prev_forward[m_level] = m_head;
+
+		Node *ins_node = new_node(std::move(key), std::move(value), ins_level);
+		for (level_type l = 0; l != ins_level; ++l) {
+			ins_node->forward[l] = prev_forward[l][l];
+			prev_forward[l][l] = ins_node;
+		}
+		++m_size;
+	}
+
+	template <typename Replacer> inline bool replace_impl(Key &&key, Replacer &&replacer) {
+		Node **prev_forward[kMaxLevel];
+		Node *node = find_prev(key, prev_forward);
+		if (node && key_equal(node->key, key))
+			return replacer(&(node->value), true);
+
+		Value val{};
+		if (!replacer(&val, false))
+			return false;
+		link(prev_forward, std::move(key), std::move(val));
+		return true;
+	}
+	inline void insert_impl(Key &&key, Value &&value) {
+		Node **prev_forward[kMaxLevel];
+		Node *node = find_prev(key, prev_forward);
+		if (node && key_equal(node->key, key)) {
+			node->value = std::move(value);
+			return;
+		}
+		link(prev_forward, std::move(key), std::move(value));
+	}
+
+public:
+	constexpr static bool kConcurrent = false;
+
+	inline explicit ArenaSkipList(typename RandomGenerator::result_type seed = 0) : m_rand_gen{seed} {}
+	inline ArenaSkipList(const ArenaSkipList &) = delete;
+	inline ArenaSkipList &operator=(const ArenaSkipList &) = delete;
+	inline ~ArenaSkipList() { destroy_nodes(); }
+
+	// Chunks are kept for the next round, only node destructors (if any) walk the list
+	inline void Clear() {
+		destroy_nodes();
+		std::fill(m_head, m_head + kMaxLevel, nullptr);
+		m_large_chunks.clear();
+		m_chunk_id = m_chunk_pos = 0;
+		m_level = 0;
+		m_size = 0;
+	}
+
+	inline std::optional<Value> Search(const Key &key) const {
+		const Node *node = find_prev(key)[0];
+		return node && key_equal(node->key, key) ? node->value : std::optional<Value>{};
+	}
+	inline void Insert(Key &&key, Value &&value) { insert_impl(std::move(key), std::move(value)); }
+	inline void Insert(Key &&key, const Value &value) { insert_impl(std::move(key), Value(value)); }
+	inline void Insert(const Key &key, Value &&value) { insert_impl(Key(key), std::move(value)); }
+	inline void Insert(const Key &key, const Value &value) { insert_impl(Key(key), Value(value)); }
+	template <typename Replacer> inline bool Replace(Key &&key, Replacer &&replacer) {
+		return replace_impl(std::move(key), std::forward<Replacer>(replacer));
+	}
+	template <typename Replacer> inline bool Replace(const Key &key, Replacer &&replacer) {
+		return replace_impl(Key(key), std::forward<Replacer>(replacer));
+	}
+	inline size_type GetSize() const { return m_size; }
+	inline bool IsEmpty() const { return m_size == 0; }
+	inline level_type GetLevel() const { return m_level; }
+	template <typename Func> inline void ForEach(Func &&func) const {
+		for (const Node *node = m_head[0]; node; node = node->forward[0])
+			func(node->key, node->value);
+	}
+	template <typename Func> inline void Scan(const Key &min_key, const Key &max_key, Func &&func) const {
+		for (const Node *node = find_prev(min_key)[0]; node && !Compare{}(max_key, node->key);
+		     node = node->forward[0])
+			func(node->key, node->value);
+	}
+};
+
+} // namespace lsm
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <random>
+#include <type_traits>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "detail/io.hpp"
 #include "type.hpp"
@@ -11,24 +19,24 @@ namespace lsm {
 template <typename Key, size_type Hashes, typename InitialHash = std::hash<Key>,
           typename Transformer = std::default_random_engine>
 struct BloomDefaultHasher {
-	template <size_type Bits, typename Array> inline static void Insert(Array &array, const Key &key) {
+	template <typename Array> inline static void Insert(Array &array, size_type bits, const Key &key) {
 		size_type h = InitialHash{}(key);
-		array[h % Bits] = true;
+		array[h % bits] = true;
 
 		Transformer trans{~h};
-		std::uniform_int_distribution<size_type> distr{0, Bits - 1};
+		std::uniform_int_distribution<size_type> distr{0, bits - 1};
 		for (size_type i = 1; i != Hashes; ++i) {
 			h = distr(trans);
 			array[h] = true;
 		}
 	}
-	template <size_type Bits, typename Array> inline static bool Exist(const Array &array, const Key &key) {
+	template <typename Array> inline static bool Exist(const Array &array, size_type bits, const Key &key) {
 		size_type h = InitialHash{}(key);
-		if (array[h % Bits] == false)
+		if (array[h % bits] == false)
 			return false;
 
 		Transformer trans{~h};
-		std::uniform_int_distribution<size_type> distr{0, Bits - 1};
+		std::uniform_int_distribution<size_type> distr{0, bits - 1};
 		for (size_type i = 1; i != Hashes; ++i)
 			if (array[distr(trans)] == false)
 				return false;
@@ -36,10 +44,11 @@ struct BloomDefaultHasher {
 	}
 };
 
+// Bits is the filter size used unless the table's level sets a bits-per-key target
 template <typename Key, size_type Bits, typename Hasher = BloomDefaultHasher<Key, 3>> class Bloom {
 private:
-	static constexpr size_type kU64Count = (Bits >> 6u) + ((Bits & 63u) ? 1 : 0);
-	uint64_t m_bits[kU64Count]{};
+	std::vector<uint64_t> m_bits;
+	size_type m_bit_count;
 
 	class Wrapper {
 	private:
@@ -57,23 +66,164 @@ private:
 	template <typename> friend struct detail::IO;
 
 public:
+	constexpr static size_type kDefaultBits = Bits;
+
 	inline bool operator[](size_type idx) const { return m_bits[idx >> 6u] & (1ULL << (idx & 63ULL)); }
 	inline Wrapper operator[](size_type idx) { return {m_bits[idx >> 6u], idx & 63u}; }
 
-	inline Bloom() = default;
-	inline void Insert(const Key &key) { Hasher::template Insert<Bits>(*this, key); }
-	inline bool Exist(const Key &key) const { return Hasher::template Exist<Bits>(*this, key); }
+	inline Bloom() : Bloom(Bits) {}
+	inline explicit Bloom(size_type bits) : m_bits((bits + 63u) >> 6u), m_bit_count{bits} {}
+	inline size_type GetBitCount() const { return m_bit_count; }
+	inline void Insert(const Key &key) { Hasher::Insert(*this, m_bit_count, key); }
+	inline void InsertBatch(const Key *keys, size_type count) {
+		for (size_type i = 0; i < count; ++i)
+			Insert(keys[i]);
+	}
+	inline bool Exist(const Key &key) const { return Hasher::Exist(*this, m_bit_count, key); }
+};
+
+// xxHash-style 64-bit avalanche, integral keys are mixed directly instead of going through the identity std::hash
+template <typename Key, typename InitialHash = std::hash<Key>> struct BloomFastHasher {
+	inline uint64_t operator()(const Key &key) const {
+		uint64_t h;
+		if constexpr (std::is_integral_v<Key>)
+			h = (uint64_t)key;
+		else
+			h = InitialHash{}(key);
+		h ^= h >> 33u;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 29u;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 32u;
+		return h;
+	}
+};
+
+// Bloom filter with all probes of a key in one 64-byte block: one bit in each of the block's 8 words, positioned by
+// double hashing. A lookup touches a single cache line.
+template <typename Key, size_type Bits, typename Hash = BloomFastHasher<Key>> class BlockedBloom {
+private:
+	static constexpr size_type kBlockWords = 8;
+	struct alignas(64) Block {
+		uint64_t words[kBlockWords];
+	};
+	std::vector<Block> m_blocks;
+
+	template <typename> friend struct detail::IO;
+
+	struct Probe {
+		uint32_t block, h1, h2;
+	};
+
+	inline uint32_t get_block_index(uint64_t h) const { return (uint32_t)(((h >> 32u) * m_blocks.size()) >> 32u); }
+	inline static uint32_t get_h2(uint64_t h) { return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32u) | 1u; }
+	inline Probe get_probe(const Key &key) const {
+		uint64_t h = Hash{}(key);
+		return {get_block_index(h), (uint32_t)h, get_h2(h)};
+	}
+
+#ifdef __AVX2__
+	// Bit i of the mask sits in word i, at ((h1 + i * h2) mod 2^32) >> 26
+	inline static void get_masks(uint32_t h1, uint32_t h2, __m256i *p_lo, __m256i *p_hi) {
+		const __m256i ones = _mm256_set1_epi64x(1), shift_mask = _mm256_set1_epi64x(63);
+		const __m256i vh1 = _mm256_set1_epi64x(h1), vh2 = _mm256_set1_epi64x(h2);
+		__m256i lo = _mm256_add_epi64(vh1, _mm256_mul_epu32(vh2, _mm256_setr_epi64x(0, 1, 2, 3)));
+		__m256i hi = _mm256_add_epi64(vh1, _mm256_mul_epu32(vh2, _mm256_setr_epi64x(4, 5, 6, 7)));
+		lo = _mm256_and_si256(_mm256_srli_epi64(lo, 26), shift_mask);
+		hi = _mm256_and_si256(_mm256_srli_epi64(hi, 26), shift_mask);
+		*p_lo = _mm256_sllv_epi64(ones, lo);
+		*p_hi = _mm256_sllv_epi64(ones, hi);
+	}
+#endif
+
+	inline static void insert(uint64_t *block, uint32_t h1, uint32_t h2) {
+#ifdef __AVX2__
+		__m256i lo, hi;
+		get_masks(h1, h2, &lo, &hi);
+		auto p_lo = (__m256i *)block, p_hi = (__m256i *)(block + 4);
+		_mm256_store_si256(p_lo, _mm256_or_si256(_mm256_load_si256(p_lo), lo));
+		_mm256_store_si256(p_hi, _mm256_or_si256(_mm256_load_si256(p_hi), hi));
+#else
+		for (uint32_t i = 0; i < kBlockWords; ++i)
+			block[i] |= 1ULL << ((h1 + i * h2) >> 26u);
+#endif
+	}
+	inline static bool exist(const uint64_t *block, uint32_t h1, uint32_t h2) {
+#ifdef __AVX2__
+		__m256i lo, hi;
+		get_masks(h1, h2, &lo, &hi);
+		return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), lo) &&
+		       _mm256_testc_si256(_mm256_load_si256((const __m256i *)(block + 4)), hi);
+#else
+		// Branchless, a probe that fails at a random word would mispredict
+		uint64_t missing = 0;
+		for (uint32_t i = 0; i < kBlockWords; ++i)
+			missing |= ~block[i] & (1ULL << ((h1 + i * h2) >> 26u));
+		return missing == 0;
+#endif
+	}
+
+public:
+	constexpr static size_type kDefaultBits = Bits;
+
+	inline BlockedBloom() : BlockedBloom(Bits) {}
+	inline explicit BlockedBloom(size_type bits) : m_blocks(std::max((bits + 511u) >> 9u, 1u), Block{}) {}
+	inline size_type GetBitCount() const { return (size_type)m_blocks.size() << 9u; }
+	inline void Insert(const Key &key) {
+		Probe probe = get_probe(key);
+		insert(m_blocks[probe.block].words, probe.h1, probe.h2);
+	}
+	// Hash a group of keys first so their blocks can be fetched in parallel before any of them is written
+	inline void InsertBatch(const Key *keys, size_type count) {
+		constexpr size_type kGroup = 16;
+		Probe probes[kGroup];
+		for (size_type i = 0; i < count; i += kGroup) {
+			size_type group = std::min(kGroup, count - i);
+			for (size_type j = 0; j < group; ++j) {
+				probes[j] = get_probe(keys[i + j]);
+#if defined(__GNUC__) || defined(__clang__)
+				__builtin_prefetch(m_blocks[probes[j].block].words, 1);
+#endif
+			}
+			for (size_type j = 0; j < group; ++j)
+				insert(m_blocks[probes[j].block].words, probes[j].h1, probes[j].h2);
+		}
+	}
+	inline bool Exist(const Key &key) const {
+		Probe probe = get_probe(key);
+		return exist(m_blocks[probe.block].words, probe.h1, probe.h2);
+	}
 };
 
+// Filters are stored as their bit count followed by the bits
 namespace detail {
 template <typename Key, size_type Bits, typename Hasher> struct IO<Bloom<Key, Bits, Hasher>> {
-	inline static constexpr size_type GetSize(const Bloom<Key, Bits, Hasher> &bloom) { return sizeof(bloom.m_bits); }
+	inline static size_type GetSize(const Bloom<Key, Bits, Hasher> &bloom) {
+		return sizeof(size_type) + bloom.m_bits.size() * sizeof(uint64_t);
+	}
 	template <typename Stream> inline static void Write(Stream &ostr, const Bloom<Key, Bits, Hasher> &bloom) {
-		ostr.write((const char *)bloom.m_bits, sizeof(bloom.m_bits));
+		IO<size_type>::Write(ostr, bloom.m_bit_count);
+		ostr.write((const char *)bloom.m_bits.data(), bloom.m_bits.size() * sizeof(uint64_t));
 	}
 	template <typename Stream> inline static Bloom<Key, Bits, Hasher> Read(Stream &istr, size_type = 0) {
-		Bloom<Key, Bits, Hasher> bloom;
-		istr.read((char *)bloom.m_bits, sizeof(bloom.m_bits));
+		Bloom<Key, Bits, Hasher> bloom{IO<size_type>::Read(istr)};
+		istr.read((char *)bloom.m_bits.data(), bloom.m_bits.size() * sizeof(uint64_t));
+		return bloom;
+	}
+};
+template <typename Key, size_type Bits, typename Hash> struct IO<BlockedBloom<Key, Bits, Hash>> {
+	inline static size_type GetSize(const BlockedBloom<Key, Bits, Hash> &bloom) {
+		return sizeof(size_type) + bloom.m_blocks.size() * sizeof(typename BlockedBloom<Key, Bits, Hash>::Block);
+	}
+	template <typename Stream> inline static void Write(Stream &ostr, const BlockedBloom<Key, Bits, Hash> &bloom) {
+		IO<size_type>::Write(ostr, bloom.GetBitCount());
+		ostr.write((const char *)bloom.m_blocks.data(),
+		           bloom.m_blocks.size() * sizeof(typename BlockedBloom<Key, Bits, Hash>::Block));
+	}
+	template <typename Stream> inline static BlockedBloom<Key, Bits, Hash> Read(Stream &istr, size_type = 0) {
+		BlockedBloom<Key, Bits, Hash> bloom{IO<size_type>::Read(istr)};
+		istr.read((char *)bloom.m_blocks.data(),
+		          bloom.m_blocks.size() * sizeof(typename BlockedBloom<Key, Bits, Hash>::Block));
 		return bloom;
 	}
 };
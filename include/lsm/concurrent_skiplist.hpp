@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <functional>
+#include <limits>
+#include <new>
+#include <optional>
+#include <random>
+#include <thread>
+#include <utility>
+
+#include "type.hpp"
+
+namespace lsm {
+
+// Insert-only SkipList for concurrent writers, nodes are linked with CAS and readers never block.
+// Writing an existing key links a new node in front of the old ones, which stay hidden until Clear().
+// Nodes carry a sequence number, a node numbered below the newest one of its key is dropped instead.
+// Plain inserts are numbered 0.
+// Clear() and destruction need exclusive access.
+template <typename Key, typename Value, typename Compare = std::less<Key>, typename RandomGenerator = std::mt19937_64,
+          uint32_t Prob = 1u, uint32_t ProbDiv = 2u, uint32_t MaxLevel = 64>
+class ConcurrentSkipList {
+private:
+	static_assert(ProbDiv > 1 && (ProbDiv & (ProbDiv - 1)) == 0 && Prob < ProbDiv);
+
+	constexpr static uint32_t get_prob_bits() {
+		uint32_t bits = 0;
+		while ((1u << bits) != ProbDiv)
+			++bits;
+		return bits;
+	}
+	constexpr static uint32_t kProbBits = get_prob_bits();
+	constexpr static uint32_t kRandomBits = std::numeric_limits<typename RandomGenerator::result_type>::digits;
+	constexpr static level_type kMaxLevel = std::min<level_type>(MaxLevel, kRandomBits / kProbBits + 1);
+
+	struct Node {
+		Key key;
+		Value value;
+		uint64_t seq;
+		// Followed by the remaining level - 1 pointers
+		std::atomic<Node *> forward[1];
+
+		inline Node(Key &&key, Value &&value, uint64_t seq, level_type level)
+		    : key{std::move(key)}, value{std::move(value)}, seq{seq}, forward{} {
+			for (level_type l = 1; l < level; ++l)
+				new (forward + l) std::atomic<Node *>{nullptr};
+		}
+	};
+
+	std::atomic<level_type> m_level{0};
+	std::atomic<size_type> m_size{0};
+	std::atomic<Node *> m_head[kMaxLevel]{};
+
+	inline static Node *new_node(Key &&key, Value &&value, uint64_t seq, level_type level) {
+		void *mem = ::operator new(sizeof(Node) + (level - 1) * sizeof(std::atomic<Node *>));
+		return new (mem) Node{std::move(key), std::move(value), seq, level};
+	}
+	inline static void delete_node(Node *node) {
+		node->~Node();
+		::operator delete(node);
+	}
+
+	inline static bool key_equal(const Key &l, const Key &r) { return !Compare{}(l, r) && !Compare{}(r, l); }
+
+	inline static level_type random_level() {
+		thread_local RandomGenerator rand_gen{
+		    (typename RandomGenerator::result_type)std::hash<std::thread::id>{}(std::this_thread::get_id())};
+		auto word = rand_gen();
+		level_type level = 1;
+		while (level != kMaxLevel && (word & (ProbDiv - 1)) < Prob) {
+			word >>= kProbBits;
+			++level;
+		}
+		return level;
+	}
+
+	// Move along a level while the next key is less than the given one
+	inline static const std::atomic<Node *> *advance(const std::atomic<Node *> *forward, level_type l, const Key &key,
+	                                                 Node **p_next) {
+		Node *next;
+		while ((next = forward[l].load(std::memory_order_acquire)) && Compare{}(next->key, key))
+			forward = next->forward;
+		*p_next = next;
+		return forward;
+	}
+	// First node not less than the key, the newest one among equal keys
+	inline const Node *find_first(const Key &key) const {
+		// The level is raised before a node is linked, so the list is empty while it is 0
+		const std::atomic<Node *> *forward = m_head;
+		Node *next = nullptr;
+		for (level_type l = m_level.load(std::memory_order_relaxed) - 1; ~l; --l)
+			forward = advance(forward, l, key, &next);
+		return next;
+	}
+
+	// Returns false if the node was dropped, otherwise sets *p_hidden to the value it hides or nullptr
+	inline bool insert_impl(Key &&key, Value &&value, uint64_t seq, const Value **p_hidden) {
+		level_type level = random_level();
+		Node *node = new_node(std::move(key), std::move(value), seq, level);
+
+		level_type top = m_level.load(std::memory_order_relaxed);
+		while (top < level && !m_level.compare_exchange_weak(top, level, std::memory_order_relaxed))
+			;
+		top = std::max(top, level);
+
+		std::atomic<Node *> *prev_forward[kMaxLevel];
+		Node *next[kMaxLevel];
+		{
+			const std::atomic<Node *> *forward = m_head;
+			for (level_type l = top - 1; ~l; --l) {
+				forward = advance(forward, l, node->key, next + l);
+				prev_forward[l] = const_cast<std::atomic<Node *> *>(forward);
+			}
+		}
+
+		// The node is in the list once linked on level 0, the node it lands in front of is the value it hides
+		*p_hidden = nullptr;
+		for (level_type l = 0; l < level; ++l) {
+			while (true) {
+				// Level 0 is linked first, so a newer node of the key shows up here before the node is visible
+				if (l == 0 && next[0] && next[0]->seq > seq && key_equal(next[0]->key, node->key)) {
+					delete_node(node);
+					return false;
+				}
+				node->forward[l].store(next[l], std::memory_order_relaxed);
+				if (prev_forward[l][l].compare_exchange_strong(next[l], node, std::memory_order_release,
+				                                               std::memory_order_relaxed))
+					break;
+				// Predecessors only move forward since nodes are never removed
+				prev_forward[l] =
+				    const_cast<std::atomic<Node *> *>(advance(prev_forward[l], l, node->key, next + l));
+			}
+			if (l == 0) {
+				if (next[0] && key_equal(next[0]->key, node->key))
+					*p_hidden = &next[0]->value;
+				else
+					m_size.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		return true;
+	}
+
+	// Visit the newest node of each key from the given one
+	template <typename Func> inline static void for_each_from(const Node *node, Func &&func) {
+		const Node *prev = nullptr;
+		for (; node; node = node->forward[0].load(std::memory_order_acquire)) {
+			if (prev && key_equal(prev->key, node->key))
+				continue;
+			if (!func(node))
+				return;
+			prev = node;
+		}
+	}
+
+public:
+	constexpr static bool kConcurrent = true;
+
+	inline ConcurrentSkipList() = default;
+	inline ConcurrentSkipList(const ConcurrentSkipList &) = delete;
+	inline ConcurrentSkipList &operator=(const ConcurrentSkipList &) = delete;
+	inline ~ConcurrentSkipList() { Clear(); }
+
+	inline void Clear() {
+		for (Node *node = m_head[0].load(std::memory_order_relaxed), *next; node; node = next) {
+			next = node->forward[0].load(std::memory_order_relaxed);
+			delete_node(node);
+		}
+		for (auto &forward : m_head)
+			forward.store(nullptr, std::memory_order_relaxed);
+		m_level.store(0, std::memory_order_relaxed);
+		m_size.store(0, std::memory_order_relaxed);
+	}
+
+	inline std::optional<Value> Search(const Key &key) const {
+		const Node *node = find_first(key);
+		return node && key_equal(node->key, key) ? node->value : std::optional<Value>{};
+	}
+	// Returns the value now hidden by the new one, or nullptr if the key is new
+	inline const Value *Insert(Key &&key, Value &&value) {
+		const Value *p_hidden;
+		insert_impl(std::move(key), std::move(value), 0, &p_hidden);
+		return p_hidden;
+	}
+	inline const Value *Insert(const Key &key, Value &&value) { return Insert(Key(key), std::move(value)); }
+	inline const Value *Insert(const Key &key, const Value &value) { return Insert(Key(key), Value(value)); }
+	// Insert unless the key already has a node with a higher sequence number, returns false if the value was dropped.
+	// *p_hidden is set to the value now hidden by the new one, or nullptr if the key is new.
+	inline bool Insert(Key &&key, Value &&value, uint64_t seq, const Value **p_hidden) {
+		return insert_impl(std::move(key), std::move(value), seq, p_hidden);
+	}
+	inline bool Insert(const Key &key, Value &&value, uint64_t seq, const Value **p_hidden) {
+		return insert_impl(Key(key), std::move(value), seq, p_hidden);
+	}
+
+	// Number of distinct keys
+	inline size_type GetSize() const { return m_size.load(std::memory_order_relaxed); }
+	inline bool IsEmpty() const { return GetSize() == 0; }
+	inline level_type GetLevel() const { return m_level.load(std::memory_order_relaxed); }
+	template <typename Func> inline void ForEach(Func &&func) const {
+		for_each_from(m_head[0].load(std::memory_order_acquire), [&func](const Node *node) {
+			func(node->key, node->value);
+			return true;
+		});
+	}
+	template <typename Func> inline void Scan(const Key &min_key, const Key &max_key, Func &&func) const {
+		for_each_from(find_first(min_key), [&func, &max_key](const Node *node) {
+			if (Compare{}(max_key, node->key))
+				return false;
+			func(node->key, node->value);
+			return true;
+		});
+	}
+};
+
+} // namespace lsm
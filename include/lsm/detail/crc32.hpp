@@ -0,0 +1,30 @@
+#pragma once
+
+#include <array>
+#include <cinttypes>
+
+#include "../type.hpp"
+
+namespace lsm::detail {
+
+// CRC-32C (Castagnoli) of a byte range, one table lookup per byte
+constexpr std::array<uint32_t, 256> make_crc32c_table() {
+	std::array<uint32_t, 256> table{};
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc >> 1u) ^ (crc & 1u ? 0x82F63B78u : 0u);
+		table[i] = crc;
+	}
+	return table;
+}
+constexpr std::array<uint32_t, 256> kCRC32CTable = make_crc32c_table();
+
+inline uint32_t CRC32C(const char *data, size_type size) {
+	uint32_t crc = ~0u;
+	for (size_type i = 0; i < size; ++i)
+		crc = (crc >> 8u) ^ kCRC32CTable[(crc ^ (byte)data[i]) & 0xFFu];
+	return ~crc;
+}
+
+} // namespace lsm::detail
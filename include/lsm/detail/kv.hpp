@@ -1,13 +1,24 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
 #include <type_traits>
 
+#include "kv_log.hpp"
 #include "kv_mem.hpp"
 #include "kv_merge.hpp"
 #include "kv_table.hpp"
 
-#include "../kv_level.hpp"
+#include "../kv_options.hpp"
 
 namespace lsm::detail {
 
@@ -15,219 +26,996 @@ template <typename Key, typename Value, typename Trait> class KV {
 	static_assert(std::is_integral_v<Key>);
 
 private:
-	constexpr static level_type kLevels = sizeof(Trait::kLevelConfigs) / sizeof(KVLevelConfig);
-	constexpr static const KVLevelConfig *kLevelConfigs = Trait::kLevelConfigs;
+	static_assert(Trait::kLevelConfigs[0].type == KVLevelType::kTiering);
 
-	static_assert(kLevels == 0 || kLevelConfigs[0].type == KVLevelType::kTiering);
+	constexpr static bool kBackgroundCompaction = Trait::kBackgroundCompaction;
+	// Writers share the memtable lock, only the one that finds the memtable full takes it exclusively
+	constexpr static bool kConcurrentWrites = Trait::Container::kConcurrent;
+	constexpr static size_type kImmTableStallLimit = Trait::kImmTableStallLimit;
+	static_assert(kImmTableStallLimit > 0);
+	constexpr static bool kValueLog = Trait::kValueLogThreshold > 0;
 
 	using FileSystem = KVFileSystem<Trait>;
 
 	using FileTable = KVFileTable<Key, Value, Trait>;
 	using BufferTable = KVBufferTable<Key, Value, Trait>;
 	using MemContainer = KVMemContainer<Key, Value, Trait>;
+	using Log = KVLog<Key, Value, Trait>;
 	using Compare = typename Trait::Compare;
-
-	MemContainer m_mem_table;
-	std::vector<FileTable> m_levels[kLevels + 1];
+	using ValueIO = typename Trait::ValueIO;
+
+	using FileTablePtr = std::shared_ptr<const FileTable>;
+	// One more than the configured levels
+	using LevelArray = std::vector<std::vector<FileTablePtr>>;
+
+	struct ImmTable {
+		std::shared_ptr<const MemContainer> mem_table;
+		std::filesystem::path log_path;
+	};
+	// Immutable snapshot of everything but the memtable, replaced as a whole after each flush or compaction
+	struct Version {
+		// Full memtables waiting to enter level 0, oldest first
+		std::vector<std::shared_ptr<const ImmTable>> imm_tables;
+		LevelArray levels;
+	};
 
 	FileSystem m_file_system;
+	KVTableSizeBound<Key, Trait> m_size_bound;
+	Log m_log;
+
+	// Guards the memtable pointer and content, iterators pin the memtable through the shared pointer
+	mutable std::shared_mutex m_mem_mutex;
+	std::shared_ptr<MemContainer> m_mem_table;
+	// Counts memtable rotations, changed only under the exclusive memtable lock
+	uint64_t m_mem_generation{0};
+
+	// Guards m_version, m_stop and m_stop_collector
+	mutable std::mutex m_version_mutex;
+	std::shared_ptr<const Version> m_version;
+	std::atomic<size_type> m_imm_count{0};
+	std::condition_variable m_imm_cv, m_imm_pop_cv;
+	bool m_stop{false};
+
+	// Serializes flushes and compactions
+	std::mutex m_compaction_mutex;
+	std::thread m_worker;
+
+	// Serializes value log collections, the collector thread runs one each time a value log file is sealed
+	std::mutex m_collect_mutex;
+	std::condition_variable m_value_log_cv;
+	bool m_stop_collector{false};
+	std::thread m_collector;
+
+	// Tables of leveling levels never overlap and are kept sorted by key, other levels are sorted by time stamp
+	inline bool is_sorted_level(level_type level) const {
+		return level > 0 &&
+		       (level == m_file_system.GetLevelCount() || get_level_config(level).type == KVLevelType::kLeveling);
+	}
+
+	// Smallest range holding all the tables, empty until the first one is added
+	struct KeyRange {
+		bool is_empty{true};
+		Key min_key{}, max_key{};
+
+		template <typename Table> inline void Extend(const Table &table) {
+			min_key = is_empty ? table.GetMinKey() : std::min(min_key, table.GetMinKey(), Compare{});
+			max_key = is_empty ? table.GetMaxKey() : std::max(max_key, table.GetMaxKey(), Compare{});
+			is_empty = false;
+		}
+	};
+
+	// Take the source tables that overlap neither the other sources nor the next level, nor the range left to merge.
+	// They are linked into the next level as they are.
+	inline static std::vector<FileTablePtr> take_move_tables(std::vector<FileTablePtr> &src_file_tables,
+	                                                         const std::vector<BufferTable> &src_buffer_tables,
+	                                                         const std::vector<FileTablePtr> &next_level_vec) {
+		const auto is_movable = [&](size_type i) {
+			const FileTable &table = *src_file_tables[i];
+			auto it = std::lower_bound(next_level_vec.begin(), next_level_vec.end(), table.GetMinKey(),
+			                           [](const FileTablePtr &table, Key key) {
+				                           return Compare{}(table->GetMaxKey(), key);
+			                           });
+			if (it != next_level_vec.end() && table.IsOverlap(**it))
+				return false;
+			for (size_type j = 0; j < src_file_tables.size(); ++j)
+				if (j != i && table.IsOverlap(*src_file_tables[j]))
+					return false;
+			return std::none_of(src_buffer_tables.begin(), src_buffer_tables.end(),
+			                    [&table](const BufferTable &buffer_table) { return table.IsOverlap(buffer_table); });
+		};
+		std::vector<bool> moves(src_file_tables.size());
+		for (size_type i = 0; i < src_file_tables.size(); ++i)
+			moves[i] = is_movable(i);
+
+		KeyRange merge_range;
+		for (const auto &table : src_buffer_tables)
+			merge_range.Extend(table);
+		for (size_type i = 0; i < src_file_tables.size(); ++i)
+			if (!moves[i])
+				merge_range.Extend(*src_file_tables[i]);
+
+		std::vector<FileTablePtr> move_tables, merge_tables;
+		for (size_type i = 0; i < src_file_tables.size(); ++i) {
+			if (moves[i] && (merge_range.is_empty ||
+			                 !src_file_tables[i]->IsOverlap(merge_range.min_key, merge_range.max_key)))
+				move_tables.push_back(std::move(src_file_tables[i]));
+			else
+				merge_tables.push_back(std::move(src_file_tables[i]));
+		}
+		src_file_tables = std::move(merge_tables);
+		return move_tables;
+	}
 
-	template <level_type Level> void compaction(std::vector<BufferTable> &&src_buffer_tables) {
-		auto &level_vec = m_levels[Level];
+	inline const KVLevelConfig &get_level_config(level_type level) const {
+		return m_file_system.GetOptions().level_configs[level];
+	}
+	inline static uint64_t get_level_bytes(const std::vector<FileTablePtr> &tables) {
+		uint64_t bytes = 0;
+		for (const auto &table : tables)
+			bytes += table->GetFileSize();
+		return bytes;
+	}
+	// How full a level is against its target in files or bytes, it is due for compaction above 1
+	inline double get_level_score(const LevelArray &levels, level_type level) const {
+		const KVLevelConfig &config = get_level_config(level);
+		uint64_t size = config.max_bytes ? get_level_bytes(levels[level]) : levels[level].size();
+		uint64_t target = config.max_bytes ? config.max_bytes : config.max_files;
+		if (target == 0)
+			return size ? std::numeric_limits<double>::infinity() : 0.0;
+		return (double)size / (double)target;
+	}
 
-		if constexpr (Level < kLevels) {
-			if (src_buffer_tables.empty())
+	// Merge the buffers and the tables the level gives up into the next level, merged tables the next level has no
+	// room for are passed further down. Levels left over their targets are picked up by compact_levels().
+	void compaction(LevelArray &levels, level_type level, std::vector<BufferTable> &&src_buffer_tables,
+	                std::vector<FileTablePtr> &obsolete_tables) {
+		level_type level_count = m_file_system.GetLevelCount();
+		if (level >= level_count)
+			return;
+		auto &level_vec = levels[level];
+
+		std::vector<FileTablePtr> src_file_tables;
+		if (get_level_config(level).type == KVLevelType::kTiering) {
+			if (src_buffer_tables.empty() && get_level_score(levels, level) <= 1)
+				return;
+			for (auto &table : level_vec)
+				src_file_tables.push_back(std::move(table));
+			level_vec.clear();
+		} else { // Leveling, the newest tables are pushed down
+			while (get_level_score(levels, level) > 1) {
+				auto it = std::max_element(level_vec.begin(), level_vec.end(), [](const auto &l, const auto &r) {
+					return l->GetTimeStamp() < r->GetTimeStamp();
+				});
+				src_file_tables.push_back(std::move(*it));
+				level_vec.erase(it);
+			}
+			if (src_buffer_tables.empty() && src_file_tables.empty())
 				return;
+		}
+
+		auto &next_level_vec = levels[level + 1];
+		auto insert_it = next_level_vec.end();
+
+		// Tables moved down may leave the next level over its target
+		std::vector<FileTablePtr> move_tables;
+		// Find Overlapped Tables in Next Level
+		if (is_sorted_level(level + 1)) {
+			move_tables = take_move_tables(src_file_tables, src_buffer_tables, next_level_vec);
+
+			// Take every table within the whole source range, so that the merged tables fill the gap exactly
+			KeyRange range;
+			for (const auto &table : src_buffer_tables)
+				range.Extend(table);
+			for (const auto &table : src_file_tables)
+				range.Extend(*table);
+
+			if (!range.is_empty) {
+				auto first = std::lower_bound(next_level_vec.begin(), next_level_vec.end(), range.min_key,
+				                              [](const FileTablePtr &table, Key key) {
+					                              return Compare{}(table->GetMaxKey(), key);
+				                              });
+				auto last = std::upper_bound(first, next_level_vec.end(), range.max_key,
+				                             [](Key key, const FileTablePtr &table) {
+					                             return Compare{}(key, table->GetMinKey());
+				                             });
+				std::move(first, last, std::back_inserter(src_file_tables));
+				insert_it = next_level_vec.erase(first, last);
+			}
+		}
+
+		obsolete_tables.insert(obsolete_tables.end(), src_file_tables.begin(), src_file_tables.end());
+		obsolete_tables.insert(obsolete_tables.end(), move_tables.begin(), move_tables.end());
+
+		size_type max_append_files = 0;
+		if (level + 1 == level_count)
+			max_append_files = std::numeric_limits<size_type>::max();
+		else if (get_level_config(level + 1).type == KVLevelType::kLeveling) {
+			const KVLevelConfig &config = get_level_config(level + 1);
+			if (config.max_bytes) {
+				uint64_t next_level_bytes = get_level_bytes(next_level_vec) + get_level_bytes(move_tables);
+				if (next_level_bytes < config.max_bytes)
+					max_append_files = (config.max_bytes - next_level_bytes) / m_size_bound.max_file_size;
+			} else {
+				size_type next_level_files = next_level_vec.size() + move_tables.size();
+				max_append_files = std::max(config.max_files, next_level_files) - next_level_files;
+			}
+		}
 
-			std::vector<FileTable> src_file_tables;
-			if constexpr (kLevelConfigs[Level].type == KVLevelType::kTiering) {
-				for (auto &table : level_vec)
-					src_file_tables.push_back(std::move(table));
-				level_vec.clear();
-			} else { // Leveling
-				while (level_vec.size() > kLevelConfigs[Level].max_files) {
-					auto &table = level_vec.back();
-					src_file_tables.push_back(std::move(table));
-					level_vec.pop_back();
+		// Merged tables come out in key order
+		std::vector<BufferTable> dst_buffer_tables =
+		    KVMerger<Key, Value, Trait>{std::move(src_file_tables), std::move(src_buffer_tables), &m_file_system,
+		                                &m_size_bound, level + 1}
+		        .Run(max_append_files, [&next_level_vec, &insert_it](FileTable &&file_table) {
+			        insert_it =
+			            next_level_vec.insert(insert_it, std::make_shared<const FileTable>(std::move(file_table))) + 1;
+		        });
+		// Moved tables lie outside the merged range
+		for (const auto &table : move_tables) {
+			auto it = std::upper_bound(next_level_vec.begin(), next_level_vec.end(), table->GetMinKey(),
+			                           [](Key key, const FileTablePtr &table) {
+				                           return Compare{}(key, table->GetMinKey());
+			                           });
+			next_level_vec.insert(it, std::make_shared<const FileTable>(&m_file_system, *table, level + 1));
+		}
+
+		if (!dst_buffer_tables.empty())
+			compaction(levels, level + 1, std::move(dst_buffer_tables), obsolete_tables);
+	}
+	// Compact the level furthest over its target until all of them are within
+	inline void compact_levels(LevelArray &levels, std::vector<FileTablePtr> &obsolete_tables) {
+		while (true) {
+			level_type pick_level = 0;
+			double max_score = 1;
+			for (level_type level = 0; level < m_file_system.GetLevelCount(); ++level) {
+				double score = get_level_score(levels, level);
+				if (score > max_score) {
+					pick_level = level;
+					max_score = score;
 				}
 			}
+			if (max_score <= 1)
+				return;
+			compaction(levels, pick_level, {}, obsolete_tables);
+		}
+	}
 
-			auto &next_level_vec = m_levels[Level + 1];
-
-			// Find Overlapped Tables in Next Level
-			if constexpr (Level + 1 == kLevels || kLevelConfigs[Level + 1].type == KVLevelType::kLeveling) {
-				size_type src_file_table_size = src_file_tables.size();
-				next_level_vec.erase(
-				    std::remove_if(next_level_vec.begin(), next_level_vec.end(),
-				                   [this, &src_file_tables, &src_buffer_tables, src_file_table_size](auto &table) {
-					                   const auto check_overlap = [&table](const auto &src_table) {
-						                   return table.IsOverlap(src_table);
-					                   };
-					                   if (std::none_of(src_file_tables.begin(),
-					                                    src_file_tables.begin() + src_file_table_size, check_overlap) &&
-					                       std::none_of(src_buffer_tables.begin(), src_buffer_tables.end(),
-					                                    check_overlap))
-						                   return false;
-					                   src_file_tables.push_back(std::move(table));
-					                   return true;
-				                   }),
-				    next_level_vec.end());
-			}
-
-			std::vector<std::filesystem::path> deleted_file_paths;
-			deleted_file_paths.reserve(src_file_tables.size());
-			for (const auto &table : src_file_tables)
-				deleted_file_paths.push_back(table.GetFilePath());
+	inline bool is_level_0_full(const LevelArray &levels) const {
+		return m_file_system.GetLevelCount() > 0 && get_level_score(levels, 0) >= 1;
+	}
 
-			size_type max_append_files = 0;
-			if constexpr (Level + 1 == kLevels)
-				max_append_files = std::numeric_limits<size_type>::max();
-			else if constexpr (kLevelConfigs[Level + 1].type == KVLevelType::kLeveling)
-				max_append_files = std::max(kLevelConfigs[Level + 1].max_files, (size_type)next_level_vec.size()) -
-				                   (size_type)next_level_vec.size();
+	inline void flush(const MemContainer &mem_table, LevelArray &levels, std::vector<FileTablePtr> &obsolete_tables) {
+		if (is_level_0_full(levels)) {
+			std::vector<BufferTable> buffer_tables;
+			buffer_tables.push_back(mem_table.PopBuffer(&m_file_system));
+			compaction(levels, 0, std::move(buffer_tables), obsolete_tables);
+		} else
+			levels[0].push_back(std::make_shared<const FileTable>(mem_table.PopFile(&m_file_system, 0)));
+		compact_levels(levels, obsolete_tables);
+	}
 
-			std::vector<BufferTable> dst_buffer_tables =
-			    KVMerger<Key, Value, Trait, Level + 1>{std::move(src_file_tables), std::move(src_buffer_tables),
-			                                           &m_file_system}
-			        .Run(max_append_files,
-			             [this](FileTable &&file_table) { m_levels[Level + 1].push_back(std::move(file_table)); });
+	inline std::shared_ptr<const Version> get_version() const {
+		std::scoped_lock version_lock{m_version_mutex};
+		return m_version;
+	}
+	// Called with m_version_mutex held
+	inline void set_version(std::shared_ptr<const Version> &&version) {
+		m_version = std::move(version);
+		m_imm_count.store(m_version->imm_tables.size(), std::memory_order_relaxed);
+		// Each memtable waiting behind the one being flushed adds the configured rate once more
+		const KVRateLimitConfig &rate_limit = m_file_system.GetOptions().rate_limit;
+		if (rate_limit.auto_tune && rate_limit.bytes_per_sec) {
+			uint64_t bytes_per_sec = rate_limit.bytes_per_sec * std::max<size_type>(m_version->imm_tables.size(), 1);
+			if (m_file_system.GetRateLimiter().GetBytesPerSecond() != bytes_per_sec)
+				m_file_system.GetRateLimiter().SetBytesPerSecond(bytes_per_sec);
+		}
+	}
 
-			compaction<Level + 1>(std::move(dst_buffer_tables));
+	// Called with m_mem_mutex held
+	inline void push_imm_table(std::filesystem::path &&log_path) {
+		auto imm_table = std::make_shared<const ImmTable>(ImmTable{std::move(m_mem_table), std::move(log_path)});
+		m_mem_table = std::make_shared<MemContainer>(m_size_bound);
+		++m_mem_generation;
+		{
+			std::scoped_lock version_lock{m_version_mutex};
+			auto version = std::make_shared<Version>(*m_version);
+			version->imm_tables.push_back(std::move(imm_table));
+			set_version(std::move(version));
+		}
+		if constexpr (kBackgroundCompaction)
+			m_imm_cv.notify_one();
+	}
+	// Flush the oldest immutable table into level 0, returns false if there is none
+	inline bool flush_imm_table() {
+		std::scoped_lock compaction_lock{m_compaction_mutex};
 
-			for (const auto &file_path : deleted_file_paths)
-				std::filesystem::remove(file_path);
+		std::shared_ptr<const ImmTable> imm_table;
+		LevelArray levels;
+		{
+			std::scoped_lock version_lock{m_version_mutex};
+			if (m_version->imm_tables.empty())
+				return false;
+			imm_table = m_version->imm_tables.front();
+			levels = m_version->levels;
+		}
+
+		std::vector<FileTablePtr> obsolete_tables;
+		flush(*imm_table->mem_table, levels, obsolete_tables);
+
+		{
+			// Readers keep seeing the immutable table until its content is visible in the levels
+			std::scoped_lock version_lock{m_version_mutex};
+			auto version = std::make_shared<Version>();
+			version->imm_tables.assign(m_version->imm_tables.begin() + 1, m_version->imm_tables.end());
+			version->levels = std::move(levels);
+			set_version(std::move(version));
+		}
+		// Files are removed once the last reader releases them
+		for (const auto &table : obsolete_tables)
+			table->MarkObsolete();
+		m_file_system.SyncDirectories();
+		Log::Remove(imm_table->log_path);
+
+		m_imm_pop_cv.notify_all();
+		if constexpr (kValueLog)
+			m_value_log_cv.notify_one();
+		return true;
+	}
+
+	inline void worker_loop() {
+		while (true) {
+			{
+				std::unique_lock version_lock{m_version_mutex};
+				m_imm_cv.wait(version_lock, [this]() { return m_stop || !m_version->imm_tables.empty(); });
+				if (m_version->imm_tables.empty())
+					return;
+			}
+			flush_imm_table();
 		}
 	}
-	inline void compaction_0(BufferTable &&buffer_table) {
-		std::vector<BufferTable> table_table_vec;
-		table_table_vec.push_back(std::move(buffer_table));
-		compaction<0>(std::move(table_table_vec));
+	inline void collector_loop() {
+		uint64_t sealed_count = m_file_system.GetValueLog().GetSealedCount();
+		while (true) {
+			{
+				std::unique_lock version_lock{m_version_mutex};
+				m_value_log_cv.wait(version_lock, [this, sealed_count]() {
+					return m_stop_collector || m_file_system.GetValueLog().GetSealedCount() != sealed_count;
+				});
+				if (m_stop_collector)
+					return;
+			}
+			sealed_count = m_file_system.GetValueLog().GetSealedCount();
+			CollectValueLog();
+		}
+	}
+	inline void wait_imm_tables(size_type limit) {
+		std::unique_lock version_lock{m_version_mutex};
+		m_imm_pop_cv.wait(version_lock, [this, limit]() { return m_version->imm_tables.size() < limit; });
 	}
 
-	inline bool is_level_0_full() const {
-		if constexpr (kLevels > 0)
-			return m_levels[0].size() >= kLevelConfigs[0].max_files;
-		else
+	// Log a write and apply it to the memtable, rotating both when the memtable is full. Returns whether it rotated.
+	// log_func returns the number of the record, concurrent writers only serialize on the append and the memtable
+	// keeps the write of each key logged last.
+	template <bool Exclusive, typename LogFunc, typename MemFunc>
+	inline bool log_and_apply(LogFunc &&log_func, MemFunc &&mem_func) {
+		// Generation of the memtable whose log already holds the write
+		std::optional<uint64_t> logged_generation;
+		uint64_t record = 0;
+		if constexpr (kConcurrentWrites && !Exclusive) {
+			std::shared_lock mem_lock{m_mem_mutex};
+			record = log_func();
+			if (mem_func(*m_mem_table, record))
+				return false;
+			logged_generation = m_mem_generation;
+		}
+		std::unique_lock mem_lock{m_mem_mutex};
+		// With concurrent writers, another one may have rotated the memtable in the meantime, the write then has
+		// to reach the new log. Otherwise it is already logged.
+		if (logged_generation != m_mem_generation)
+			record = log_func();
+		if (mem_func(*m_mem_table, record))
 			return false;
+		push_imm_table(m_log.Rotate());
+		// The previous log only has to cover the previous memtable, so the write goes to the new log as well
+		mem_func(*m_mem_table, log_func());
+		return true;
+	}
+	template <bool Exclusive = false, typename LogFunc, typename MemFunc>
+	inline void write(LogFunc &&log_func, MemFunc &&mem_func) {
+		// Level 0 is within its target whenever a flush is published, see kImmTableStallLimit
+		if constexpr (kBackgroundCompaction) {
+			if (m_imm_count.load(std::memory_order_relaxed) >= kImmTableStallLimit)
+				wait_imm_tables(kImmTableStallLimit);
+		}
+		bool rotated = log_and_apply<Exclusive>(std::forward<LogFunc>(log_func), std::forward<MemFunc>(mem_func));
+		// Group commit waits for the log sync with the memtable unlocked, so that other writers join the group
+		m_log.SyncGroup();
+		if constexpr (!kBackgroundCompaction) {
+			if (rotated)
+				flush_imm_table();
+		}
+	}
+	template <typename MemFunc> inline void recover(MemFunc &&mem_func, LevelArray &levels) {
+		if (mem_func(*m_mem_table))
+			return;
+		std::vector<FileTablePtr> obsolete_tables;
+		flush(*m_mem_table, levels, obsolete_tables);
+		for (const auto &table : obsolete_tables)
+			table->MarkObsolete();
+		m_mem_table->Reset();
+		mem_func(*m_mem_table);
+	}
+
+	// Visit the tables that may contain the key, newest first, until func returns false
+	template <typename TableFunc> inline void for_each_table(const Version &version, Key key, TableFunc &&func) const {
+		for (level_type level = 0; level < version.levels.size(); ++level) {
+			const auto &level_vec = version.levels[level];
+			if (is_sorted_level(level)) {
+				auto it = std::lower_bound(level_vec.begin(), level_vec.end(), key,
+				                           [](const FileTablePtr &table, Key key) {
+					                           return Compare{}(table->GetMaxKey(), key);
+				                           });
+				if (it != level_vec.end() && !func(**it))
+					return;
+			} else {
+				for (size_type i = level_vec.size() - 1; ~i; --i)
+					if (!func(*level_vec[i]))
+						return;
+			}
+		}
+	}
+	inline static std::optional<KVMemValue<Value>> get_imm_value(const Version &version, Key key) {
+		for (auto it = version.imm_tables.rbegin(); it != version.imm_tables.rend(); ++it) {
+			auto opt_sl_value = (*it)->mem_table->Get(key);
+			if (opt_sl_value.has_value())
+				return opt_sl_value;
+		}
+		return std::nullopt;
+	}
+
+	// Whether the newest entry of the key still points at the value, called with m_mem_mutex held
+	inline bool is_value_live(Key key, const KVValuePointer &pointer) const {
+		if (m_mem_table->Get(key).has_value())
+			return false;
+		auto version = get_version();
+		if (get_imm_value(*version, key).has_value())
+			return false;
+		bool live = false;
+		for_each_table(*version, key, [key, &pointer, &live](const FileTable &table) {
+			auto it = table.Find(key);
+			if (!it.IsValid())
+				return true;
+			if (!it.IsKeyDeleted() && it.GetValueSize() == kValuePointerStoredSize) {
+				char data[kValuePointerStoredSize];
+				it.CopyValueData(data, KVCacheAccess::kPoint);
+				live = get_value_pointer(data, kValuePointerStoredSize) == pointer;
+			}
+			return false;
+		});
+		return live;
+	}
+
+	// The last key in Compare order
+	inline static Key get_last_key() {
+		return std::max(std::numeric_limits<Key>::min(), std::numeric_limits<Key>::max(), Compare{});
 	}
 
 public:
+	using WriteBatch = KVWriteBatch<Key, Value, Trait>;
+
+	// Merging iterator over the keys of a snapshot taken at each Seek(), values are only read by ReadValue(). Without
+	// concurrent writers the memtable is updated in place, its values are the ones found when the iterator gets there.
+	// Each sorted level has one leaf in the tree, the next table of the level takes it over once a table runs out.
+	class Iterator {
+	private:
+		using TableIterator = typename FileTable::Iterator;
+
+		const KV *m_p_kv;
+		Key m_max_key;
+
+		struct MemEntry {
+			Key key;
+			const KVMemValue<Value> *p_sl_value;
+			// Writers replace the values of the memtable in place, unless they are concurrent
+			bool is_mutable;
+		};
+
+		std::shared_ptr<const Version> m_version;
+		// Pinned like the immutable tables, so that the entries outlive a rotation
+		std::shared_ptr<const MemContainer> m_mem_table;
+		// Memtable and immutable table entries, the newest of each key
+		std::vector<MemEntry> m_mem_entries;
+		size_type m_mem_pos{};
+		// The current entry if it is mutable, copied under the memtable lock once reached
+		std::optional<KVMemValue<Value>> m_mem_value;
+		KVTableIteratorTree<TableIterator> m_table_tree;
+		// Level of each leaf of the tree, and the next table of each sorted level to take over its leaf
+		std::vector<level_type> m_leaf_levels;
+		std::vector<size_type> m_next_tables;
+
+		bool m_valid{false}, m_from_mem{};
+
+		friend class KV;
+
+		inline Iterator(const KV *p_kv, Key max_key) : m_p_kv{p_kv}, m_max_key{max_key} {}
+
+		inline bool is_mem_valid() const { return m_mem_pos < m_mem_entries.size(); }
+		inline Key get_mem_key() const { return m_mem_entries[m_mem_pos].key; }
+		inline const KVMemValue<Value> &get_mem_value() const {
+			const MemEntry &entry = m_mem_entries[m_mem_pos];
+			return entry.is_mutable ? m_mem_value.value() : *entry.p_sl_value;
+		}
+
+		// Continue a sorted level with its next table, unless it lies past the end of the iteration
+		inline bool next_table(size_type leaf, TableIterator *p_it) {
+			level_type level = m_leaf_levels[leaf];
+			if (!m_p_kv->is_sorted_level(level))
+				return false;
+			const auto &level_vec = m_version->levels[level];
+			size_type &next = m_next_tables[level];
+			if (next == level_vec.size() || Compare{}(m_max_key, level_vec[next]->GetMinKey()))
+				return false;
+			*p_it = level_vec[next++]->GetBegin();
+			return true;
+		}
+		// Move to the first live entry from the current position
+		inline void settle() {
+			while (true) {
+				bool mem_valid = is_mem_valid(), table_valid = !m_table_tree.IsEmpty();
+				m_from_mem = mem_valid && (!table_valid || !Compare{}(m_table_tree.GetTop().GetKey(), get_mem_key()));
+				if (m_from_mem && m_mem_entries[m_mem_pos].is_mutable) {
+					std::shared_lock mem_lock{m_p_kv->m_mem_mutex};
+					m_mem_value = *m_mem_entries[m_mem_pos].p_sl_value;
+				}
+				m_valid = m_from_mem || (table_valid && !Compare{}(m_max_key, m_table_tree.GetTop().GetKey()));
+				if (!m_valid)
+					return;
+				if (!(m_from_mem ? get_mem_value().IsDeleted() : m_table_tree.GetTop().IsKeyDeleted()))
+					return;
+				advance();
+			}
+		}
+		// Skip the current key in every source
+		inline void advance() {
+			Key key = GetKey();
+			if (is_mem_valid() && !Compare{}(key, get_mem_key()))
+				++m_mem_pos;
+			if (!m_table_tree.IsEmpty() && !Compare{}(key, m_table_tree.GetTop().GetKey()))
+				m_table_tree.Proceed([this](size_type leaf, TableIterator *p_it) { return next_table(leaf, p_it); });
+		}
+
+	public:
+		inline Iterator(Iterator &&) noexcept = default;
+		inline Iterator &operator=(Iterator &&) noexcept = default;
+
+		inline void Seek(Key min_key) {
+			m_mem_entries.clear();
+			m_mem_pos = 0;
+			{
+				// Only the keys and the places of the values are taken, nodes stay put until their table is freed
+				std::shared_lock mem_lock{m_p_kv->m_mem_mutex};
+				m_mem_table = m_p_kv->m_mem_table;
+				m_mem_table->Scan(min_key, m_max_key, [this](Key key, const KVMemValue<Value> &sl_value) {
+					m_mem_entries.push_back({key, &sl_value, !kConcurrentWrites});
+				});
+				m_version = m_p_kv->get_version();
+			}
+			if (!m_version->imm_tables.empty()) {
+				// Newer tables come first among equal keys
+				for (auto it = m_version->imm_tables.rbegin(); it != m_version->imm_tables.rend(); ++it)
+					(*it)->mem_table->Scan(min_key, m_max_key, [this](Key key, const KVMemValue<Value> &sl_value) {
+						m_mem_entries.push_back({key, &sl_value, false});
+					});
+				std::stable_sort(m_mem_entries.begin(), m_mem_entries.end(),
+				                 [](const MemEntry &l, const MemEntry &r) { return Compare{}(l.key, r.key); });
+				m_mem_entries.erase(std::unique(m_mem_entries.begin(), m_mem_entries.end(),
+				                                [](const MemEntry &l, const MemEntry &r) {
+					                                return !Compare{}(l.key, r.key);
+				                                }),
+				                    m_mem_entries.end());
+			}
+
+			std::vector<TableIterator> iterators;
+			m_leaf_levels.clear();
+			m_next_tables.assign(m_version->levels.size(), 0);
+			for (level_type level = 0; level < m_version->levels.size(); ++level) {
+				const auto &level_vec = m_version->levels[level];
+				if (m_p_kv->is_sorted_level(level)) {
+					auto it = std::lower_bound(level_vec.begin(), level_vec.end(), min_key,
+					                           [](const FileTablePtr &table, Key key) {
+						                           return Compare{}(table->GetMaxKey(), key);
+					                           });
+					if (it != level_vec.end() && !Compare{}(m_max_key, (*it)->GetMinKey())) {
+						iterators.push_back((*it++)->GetLowerBound(min_key));
+						m_leaf_levels.push_back(level);
+					}
+					m_next_tables[level] = it - level_vec.begin();
+				} else {
+					for (const FileTablePtr &table : level_vec)
+						if (table->IsOverlap(min_key, m_max_key)) {
+							iterators.push_back(table->GetLowerBound(min_key));
+							m_leaf_levels.push_back(level);
+						}
+				}
+			}
+			m_table_tree = KVTableIteratorTree<TableIterator>{std::move(iterators)};
+			settle();
+		}
+		inline void SeekToFirst() {
+			Seek(std::min(std::numeric_limits<Key>::min(), std::numeric_limits<Key>::max(), Compare{}));
+		}
+		inline bool IsValid() const { return m_valid; }
+		inline Key GetKey() const { return m_from_mem ? get_mem_key() : m_table_tree.GetTop().GetKey(); }
+		inline Value ReadValue() const {
+			return m_from_mem ? get_mem_value().GetValue() : m_table_tree.GetTop().ReadValue(KVCacheAccess::kScan);
+		}
+		inline void Proceed() {
+			advance();
+			settle();
+		}
+	};
+
 	inline explicit KV(std::string_view directory, size_type stream_capacity = 32)
-	    : m_file_system{directory, stream_capacity} {
-		m_file_system.ForEachFile([this](const std::filesystem::path &file_path, level_type level) {
-			auto file_table = FileTable{&m_file_system, file_path, level};
-			m_levels[level].push_back(std::move(file_table));
+	    : KV(directory, KVOptions::FromTrait<Trait>(), stream_capacity) {}
+	// The options replace the trait's file size and levels, they may differ from the last run
+	inline KV(std::string_view directory, KVOptions options, size_type stream_capacity = 32)
+	    : m_file_system{directory, std::move(options), stream_capacity},
+	      m_size_bound{m_file_system.GetOptions()}, m_log{m_file_system.GetDirectory()},
+	      m_mem_table{std::make_shared<MemContainer>(m_size_bound)} {
+		LevelArray levels(m_file_system.GetLevelCount() + 1);
+		m_file_system.ForEachFile([this, &levels](const std::filesystem::path &file_path, level_type level) {
+			// Tables of levels dropped from the options join the last level, they still rank by their old one
+			levels[std::min(level, m_file_system.GetLevelCount())].push_back(
+			    std::make_shared<const FileTable>(&m_file_system, file_path, level));
 		});
+		// Directory iteration order is unspecified, restore the order of each level
+		for (level_type level = 0; level < levels.size(); ++level) {
+			auto &level_vec = levels[level];
+			if (is_sorted_level(level)) {
+				std::sort(level_vec.begin(), level_vec.end(), [](const FileTablePtr &l, const FileTablePtr &r) {
+					return Compare{}(l->GetMinKey(), r->GetMinKey());
+				});
+				// Tables may overlap if the level was configured otherwise before, merge them back into order
+				for (size_type i = 1; i < level_vec.size(); ++i) {
+					if (Compare{}(level_vec[i - 1]->GetMaxKey(), level_vec[i]->GetMinKey()))
+						continue;
+					std::vector<FileTablePtr> tables = std::move(level_vec);
+					level_vec.clear();
+					KVMerger<Key, Value, Trait>{std::vector<FileTablePtr>{tables}, {}, &m_file_system, &m_size_bound,
+					                            level}
+					    .Run(std::numeric_limits<size_type>::max(), [&level_vec](FileTable &&file_table) {
+						    level_vec.push_back(std::make_shared<const FileTable>(std::move(file_table)));
+					    });
+					for (const auto &table : tables)
+						table->MarkObsolete();
+					break;
+				}
+			} else
+				std::sort(level_vec.begin(), level_vec.end(), [](const FileTablePtr &l, const FileTablePtr &r) {
+					return l->GetTimeStamp() < r->GetTimeStamp();
+				});
+		}
+
+		std::vector<std::filesystem::path> log_paths = m_log.Recover(
+		    [this, &levels](Key key, Value &&value) {
+			    size_type value_size = ValueIO::GetSize(value);
+			    recover(
+			        [key, &value, value_size](MemContainer &mem_table) {
+				        return mem_table.TryPut(key, std::move(value), value_size);
+			        },
+			        levels);
+		    },
+		    [this, &levels](Key key) {
+			    recover([key](MemContainer &mem_table) { return mem_table.TryDelete(key); }, levels);
+		    },
+		    [this, &levels](WriteBatch &&batch) {
+			    recover([&batch](MemContainer &mem_table) { return mem_table.TryWrite(std::move(batch)); }, levels);
+		    });
+		if (!m_mem_table->IsEmpty()) {
+			std::vector<FileTablePtr> obsolete_tables;
+			flush(*m_mem_table, levels, obsolete_tables);
+			for (const auto &table : obsolete_tables)
+				table->MarkObsolete();
+			m_mem_table->Reset();
+		}
+		m_file_system.SyncDirectories();
+		for (const auto &log_path : log_paths)
+			Log::Remove(log_path);
+
+		m_version = std::make_shared<const Version>(Version{{}, std::move(levels)});
+
+		if constexpr (kBackgroundCompaction) {
+			m_worker = std::thread{&KV::worker_loop, this};
+			if constexpr (kValueLog)
+				m_collector = std::thread{&KV::collector_loop, this};
+		}
 	}
 
 	inline ~KV() {
-		if (!m_mem_table.IsEmpty()) {
-			if (is_level_0_full())
-				compaction_0(m_mem_table.PopBuffer());
-			else
-				m_mem_table.PopFile(&m_file_system, 0);
+		if constexpr (kBackgroundCompaction) {
+			// The collector writes, so it stops while the worker still flushes
+			if constexpr (kValueLog) {
+				{
+					std::scoped_lock version_lock{m_version_mutex};
+					m_stop_collector = true;
+				}
+				m_value_log_cv.notify_one();
+				m_collector.join();
+			}
+			{
+				std::scoped_lock version_lock{m_version_mutex};
+				m_stop = true;
+			}
+			m_imm_cv.notify_one();
+			m_worker.join();
 		}
+		if (!m_mem_table->IsEmpty()) {
+			push_imm_table(m_log.Close());
+			flush_imm_table();
+		} else
+			Log::Remove(m_log.Close());
 	}
 
 	inline void Put(Key key, Value &&value) {
-		if (is_level_0_full()) {
-			std::optional<BufferTable> opt_buffer_table = m_mem_table.Put(key, std::move(value));
-			if (opt_buffer_table.has_value())
-				compaction_0(std::move(opt_buffer_table.value()));
-		} else {
-			std::optional<FileTable> opt_file_table = m_mem_table.Put(key, std::move(value), &m_file_system, 0);
-			if (opt_file_table.has_value())
-				m_levels[0].push_back(std::move(opt_file_table.value()));
-		}
+		size_type value_size = ValueIO::GetSize(value);
+		write([this, key, &value, value_size]() { return m_log.AppendPut(key, value, value_size); },
+		      [key, &value, value_size](MemContainer &mem_table, uint64_t record) {
+			      return mem_table.TryPut(key, std::move(value), value_size, record);
+		      });
 	}
 
 	inline void Put(Key key, const Value &value) { Put(key, Value{value}); }
 
+	// Apply the batch atomically, it is logged as one record and never split across two tables.
+	// Concurrent writers are held off so that readers never see part of a batch.
+	inline void Write(WriteBatch &&batch) {
+		if (batch.IsEmpty())
+			return;
+		write<true>([this, &batch]() { return m_log.AppendBatch(batch); },
+		            [&batch](MemContainer &mem_table, uint64_t record) {
+			            return mem_table.TryWrite(std::move(batch), record);
+		            });
+	}
+	inline void Write(const WriteBatch &batch) { Write(WriteBatch{batch}); }
+
 	inline std::optional<Value> Get(Key key) const {
-		auto opt_sl_value = m_mem_table.Get(key);
+		std::shared_ptr<const Version> version;
+		{
+			std::shared_lock mem_lock{m_mem_mutex};
+			auto opt_sl_value = m_mem_table->Get(key);
+			if (opt_sl_value.has_value())
+				return opt_sl_value.value().GetOptValue();
+			version = get_version();
+		}
+		auto opt_sl_value = get_imm_value(*version, key);
 		if (opt_sl_value.has_value())
 			return opt_sl_value.value().GetOptValue();
 
-		for (const auto &level_vec : m_levels) {
-			for (size_type i = level_vec.size() - 1; ~i; --i) {
-				auto it = level_vec[i].Find(key);
+		std::optional<Value> opt_value;
+		for_each_table(*version, key, [key, &opt_value](const FileTable &table) {
+			auto it = table.Find(key);
+			if (!it.IsValid())
+				return true;
+			if (!it.IsKeyDeleted())
+				opt_value = it.ReadValue(KVCacheAccess::kPoint);
+			return false;
+		});
+		return opt_value;
+	}
+
+	// Look up a batch of keys, each table is visited once with all the keys it may contain
+	inline std::vector<std::optional<Value>> MultiGet(const Key *keys, size_type count) const {
+		constexpr static size_type kResolved = -1;
+
+		std::vector<std::optional<Value>> values(count);
+		// Indices of the unresolved keys in key order
+		std::vector<size_type> pending(count);
+		std::iota(pending.begin(), pending.end(), 0);
+		std::sort(pending.begin(), pending.end(),
+		          [keys](size_type l, size_type r) { return Compare{}(keys[l], keys[r]); });
+
+		const auto erase_resolved = [&pending]() {
+			pending.erase(std::remove(pending.begin(), pending.end(), kResolved), pending.end());
+		};
+		const auto get_mem_values = [keys, &values, &pending, &erase_resolved](auto &&get_func) {
+			for (size_type &i : pending) {
+				auto opt_sl_value = get_func(keys[i]);
+				if (opt_sl_value.has_value()) {
+					values[i] = opt_sl_value.value().GetOptValue();
+					i = kResolved;
+				}
+			}
+			erase_resolved();
+		};
+		// Probe a table with the pending keys in [first, last), values found are read in offset order
+		const auto get_table_values = [keys, &values](const FileTable &table, size_type *first, size_type *last) {
+			std::vector<typename FileTable::Iterator> its;
+			std::vector<size_type> indices;
+			for (size_type *p = first; p != last; ++p) {
+				auto it = table.Find(keys[*p]);
 				if (!it.IsValid())
 					continue;
-				if (it.IsKeyDeleted())
-					return std::nullopt;
-				return it.ReadValue();
+				if (!it.IsKeyDeleted()) {
+					its.push_back(it);
+					indices.push_back(*p);
+				}
+				*p = kResolved;
 			}
+			table.ReadValues(its, [&values, &indices](size_type j, Value &&value) {
+				values[indices[j]] = std::move(value);
+			});
+		};
+
+		std::shared_ptr<const Version> version;
+		{
+			std::shared_lock mem_lock{m_mem_mutex};
+			get_mem_values([this](Key key) { return m_mem_table->Get(key); });
+			version = get_version();
 		}
-		return std::nullopt;
+		get_mem_values([&version](Key key) { return get_imm_value(*version, key); });
+
+		for (level_type level = 0; level < version->levels.size() && !pending.empty(); ++level) {
+			const auto &level_vec = version->levels[level];
+			if (is_sorted_level(level)) {
+				// Walk the keys and the tables together
+				auto table_it = level_vec.begin();
+				for (size_type i = 0, j; i < pending.size(); i = j) {
+					table_it = std::lower_bound(table_it, level_vec.end(), keys[pending[i]],
+					                            [](const FileTablePtr &table, Key key) {
+						                            return Compare{}(table->GetMaxKey(), key);
+					                            });
+					if (table_it == level_vec.end())
+						break;
+					for (j = i + 1; j < pending.size() && !Compare{}((*table_it)->GetMaxKey(), keys[pending[j]]); ++j)
+						;
+					get_table_values(**table_it, pending.data() + i, pending.data() + j);
+				}
+				erase_resolved();
+			} else {
+				for (size_type t = level_vec.size() - 1; ~t && !pending.empty(); --t) {
+					const FileTable &table = *level_vec[t];
+					size_type *first = std::lower_bound(
+					    pending.data(), pending.data() + pending.size(), table.GetMinKey(),
+					    [keys](size_type i, Key key) { return Compare{}(keys[i], key); });
+					size_type *last =
+					    std::upper_bound(first, pending.data() + pending.size(), table.GetMaxKey(),
+					                     [keys](Key key, size_type i) { return Compare{}(key, keys[i]); });
+					get_table_values(table, first, last);
+					erase_resolved();
+				}
+			}
+		}
+		return values;
 	}
 
+	// Unpositioned until Seek() or SeekToFirst(), the KV must outlive it
+	inline Iterator GetIterator() const { return Iterator{this, get_last_key()}; }
+
 	template <typename Func> inline void Scan(Key min_key, Key max_key, Func &&func) const {
-		KVTableIteratorHeap<typename FileTable::Iterator> iterator_heap;
-		{
-			std::vector<typename FileTable::Iterator> iterators;
-			for (const auto &level_vec : m_levels)
-				for (const FileTable &table : level_vec)
-					if (table.IsOverlap(min_key, max_key))
-						iterators.push_back(table.GetLowerBound(min_key));
-			iterator_heap = KVTableIteratorHeap<typename FileTable::Iterator>{std::move(iterators)};
-		}
-		m_mem_table.Scan(min_key, max_key, [&iterator_heap, &func](Key key, const KVMemValue<Value> &sl_value) {
-			while (!iterator_heap.IsEmpty() && Compare{}(iterator_heap.GetTop().GetKey(), key)) {
-				const auto &it = iterator_heap.GetTop();
-				if (!it.IsKeyDeleted())
-					func(it.GetKey(), it.ReadValue());
-				iterator_heap.Proceed();
-			}
-			if (!iterator_heap.IsEmpty() && !Compare{}(key, iterator_heap.GetTop().GetKey()))
-				iterator_heap.Proceed();
-			if (!sl_value.IsDeleted())
-				func(key, sl_value.GetValue());
-		});
-		while (!iterator_heap.IsEmpty() && !Compare{}(max_key, iterator_heap.GetTop().GetKey())) {
-			const auto &it = iterator_heap.GetTop();
-			if (!it.IsKeyDeleted())
-				func(it.GetKey(), it.ReadValue());
-			iterator_heap.Proceed();
-		}
+		Iterator it{this, max_key};
+		for (it.Seek(min_key); it.IsValid(); it.Proceed())
+			func(it.GetKey(), it.ReadValue());
 	}
 
 	inline bool Delete(Key key) {
 		// Check whether the key is already deleted
-		auto opt_opt_value = m_mem_table.Get(key);
-		if (opt_opt_value.has_value()) {
-			if (opt_opt_value.value().IsDeleted())
+		std::shared_ptr<const Version> version;
+		{
+			std::shared_lock mem_lock{m_mem_mutex};
+			auto opt_sl_value = m_mem_table->Get(key);
+			if (opt_sl_value.has_value() && opt_sl_value.value().IsDeleted())
 				return false;
-		} else {
-			for (const auto &level_vec : m_levels) {
-				for (size_type i = level_vec.size() - 1; ~i; --i) {
-					auto it = level_vec[i].Find(key);
+			if (!opt_sl_value.has_value())
+				version = get_version();
+		}
+		if (version) {
+			auto opt_sl_value = get_imm_value(*version, key);
+			if (opt_sl_value.has_value()) {
+				if (opt_sl_value.value().IsDeleted())
+					return false;
+			} else {
+				bool exists = false;
+				for_each_table(*version, key, [key, &exists](const FileTable &table) {
+					auto it = table.Find(key);
 					if (!it.IsValid())
-						continue;
-					if (it.IsKeyDeleted())
-						return false;
-					goto End_Check;
-				}
+						return true;
+					exists = !it.IsKeyDeleted();
+					return false;
+				});
+				if (!exists)
+					return false;
 			}
-			return false;
 		}
-	End_Check:
-		if (is_level_0_full()) {
-			std::optional<BufferTable> opt_buffer_table = m_mem_table.Delete(key);
-			if (opt_buffer_table.has_value())
-				compaction_0(std::move(opt_buffer_table.value()));
-		} else {
-			std::optional<FileTable> opt_file_table = m_mem_table.Delete(key, &m_file_system, 0);
-			if (opt_file_table.has_value())
-				m_levels[0].push_back(std::move(opt_file_table.value()));
+
+		BlindDelete(key);
+		return true;
+	}
+	// Write a tombstone without checking whether the key exists
+	inline void BlindDelete(Key key) {
+		write([this, key]() { return m_log.AppendDelete(key); },
+		      [key](MemContainer &mem_table, uint64_t record) { return mem_table.TryDelete(key, record); });
+	}
+
+	// Put the live values of the next sealed value log file again if at least kValueLogGCPercent of the file is dead,
+	// returns whether it was collected. The file is removed once no table points into it any more. A background thread
+	// calls this with kBackgroundCompaction, otherwise it is up to the user.
+	inline bool CollectValueLog() {
+		if constexpr (!kValueLog)
+			return false;
+		std::scoped_lock collect_lock{m_collect_mutex};
+		KVValueLogFilePtr file = m_file_system.GetValueLog().PickFileToCollect();
+		if (!file)
+			return false;
+
+		std::vector<std::pair<Key, KVValuePointer>> live_records;
+		uint64_t total_bytes = 0, live_bytes = 0;
+		m_file_system.GetRateLimiter().Request(std::filesystem::file_size(file->GetFilePath()), KVIOPriority::kLow);
+		file->template ForEachRecord<Key>([this, &live_records, &total_bytes, &live_bytes](
+		                                      Key key, const KVValuePointer &pointer, const char *) {
+			total_bytes += pointer.size;
+			std::shared_lock mem_lock{m_mem_mutex};
+			if (is_value_live(key, pointer)) {
+				live_bytes += pointer.size;
+				live_records.emplace_back(key, pointer);
+			}
+		});
+		if (live_bytes * 100 > total_bytes * (100 - Trait::kValueLogGCPercent))
+			return false;
+
+		// The value may have been overwritten since, so liveness is checked again by the write itself
+		std::vector<char> data;
+		for (const auto &[key, pointer] : live_records) {
+			data.resize(pointer.size);
+			file->Read(pointer.offset, data.data(), pointer.size);
+			IBufStream bin{data.data(), 0};
+			Value value = ValueIO::Read(bin, pointer.size);
+			size_type value_size = ValueIO::GetSize(value);
+			bool live = false;
+			write<true>(
+			    [this, key = key, pointer = pointer, &value, value_size, &live]() -> uint64_t {
+				    live = is_value_live(key, pointer);
+				    return live ? m_log.AppendPut(key, value, value_size) : 0;
+			    },
+			    [key = key, &value, value_size, &live](MemContainer &mem_table, uint64_t record) {
+				    return !live || mem_table.TryPut(key, std::move(value), value_size, record);
+			    });
 		}
+		m_file_system.GetValueLog().Retire(file->GetID());
 		return true;
 	}
 
+	// Bytes that flushes, compactions and value log collections read or wrote since the KV was opened, as charged to
+	// the rate limiter
+	inline uint64_t GetBackgroundIOBytes() const { return m_file_system.GetRateLimiter().GetRequestedBytes(); }
+	// Hits and misses of the block cache since the KV was opened
+	inline KVCacheStats GetBlockCacheStats() const { return m_file_system.GetBlockCacheStats(); }
+	// Value bytes of the tables of each level, raw_bytes / stored_bytes is the compression ratio of the level. Levels
+	// without a codec store their values as they are, so both are equal there.
+	inline std::vector<KVCompressionStats> GetCompressionStats() const {
+		auto version = get_version();
+		std::vector<KVCompressionStats> stats(version->levels.size());
+		for (level_type level = 0; level < version->levels.size(); ++level)
+			for (const auto &table : version->levels[level]) {
+				stats[level].raw_bytes += table->GetValueDataSize();
+				stats[level].stored_bytes += table->GetStoredValueDataSize();
+			}
+		return stats;
+	}
+
+	// Not safe to call concurrently with other operations
 	inline void Reset() {
-		m_mem_table.Reset();
-		for (auto &level_vec : m_levels)
-			level_vec.clear();
+		if constexpr (kBackgroundCompaction)
+			wait_imm_tables(1);
+		std::scoped_lock lock{m_collect_mutex, m_compaction_mutex, m_mem_mutex};
+		// Iterators may still pin the old memtable
+		m_mem_table = std::make_shared<MemContainer>(m_size_bound);
+		{
+			std::scoped_lock version_lock{m_version_mutex};
+			set_version(
+			    std::make_shared<const Version>(Version{{}, LevelArray(m_file_system.GetLevelCount() + 1)}));
+		}
+		m_log.Close();
 		m_file_system.Reset();
+		m_log.Reset();
 	}
 };
 
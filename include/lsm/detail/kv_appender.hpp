@@ -1,34 +1,47 @@
 #pragma once
 
-#include <optional>
-#include <vector>
+#include <algorithm>
+#include <memory>
 
-#include "kv_filesystem.hpp"
 #include "kv_table.hpp"
 
 namespace lsm::detail {
 
 template <typename Key, typename Value, typename Trait> class KVAppender {
 private:
-	using FileSystem = KVFileSystem<Trait>;
 	using BufferTable = KVBufferTable<Key, Value, Trait>;
-	using FileTable = KVFileTable<Key, Value, Trait>;
 	using KeyOffset = KVKeyOffset<Key>;
 
-	constexpr static size_type kMaxFileSize = Trait::kMaxFileSize;
-	constexpr static size_type kInitialFileSize = sizeof(time_type) + Trait::KeyFile::GetHeaderSize();
+	constexpr static size_type kInitialKeyCap = 64;
 
-	std::vector<KeyOffset> m_key_offset_vec;
+	KVTableSizeBound<Key, Trait> m_bound;
+	// Value log files of the input, the table in the making references those it points into
+	const KVValueLogRefs<Trait> *m_p_input_log_refs;
+	KVValueLogRefs<Trait> m_log_refs;
+
+	// Both buffers are handed over to the popped table as they are
+	std::unique_ptr<KeyOffset[]> m_key_buffer;
+	size_type m_key_count{}, m_key_cap{};
 	std::unique_ptr<byte[]> m_value_buffer;
 	size_type m_value_buffer_size{}, m_value_buffer_cap{};
 
-	size_type m_file_size{kInitialFileSize};
+	size_type m_file_size;
 
 	inline void reset_value_buffer() {
 		m_value_buffer_size = 0;
-		m_value_buffer_cap = kMaxFileSize - kInitialFileSize;
+		m_value_buffer_cap = m_bound.max_file_size - m_bound.initial_file_size;
 		if (!m_value_buffer)
-			m_value_buffer = std::unique_ptr<byte[]>(new byte[kMaxFileSize - kInitialFileSize]);
+			m_value_buffer = std::unique_ptr<byte[]>(new byte[m_value_buffer_cap]);
+	}
+	inline void push_key_offset(const KeyOffset &key_offset) {
+		if (m_key_count == m_key_cap) {
+			size_type new_cap = std::max(m_key_cap * 2, (size_type)kInitialKeyCap);
+			auto new_buffer = std::unique_ptr<KeyOffset[]>(new KeyOffset[new_cap]);
+			std::copy(m_key_buffer.get(), m_key_buffer.get() + m_key_count, new_buffer.get());
+			m_key_buffer = std::move(new_buffer);
+			m_key_cap = new_cap;
+		}
+		m_key_buffer[m_key_count++] = key_offset;
 	}
 	inline void ensure_value_buffer_cap(size_type size) {
 		if (size <= m_value_buffer_cap)
@@ -36,69 +49,55 @@ private:
 		auto new_buffer = std::unique_ptr<byte[]>(new byte[size]);
 		std::copy(m_value_buffer.get(), m_value_buffer.get() + m_value_buffer_size, new_buffer.get());
 		m_value_buffer = std::move(new_buffer);
-	}
-
-	template <typename Table, bool Delete, typename Iterator, typename PopFunc>
-	inline std::optional<Table> append(const Iterator &it, PopFunc &&pop_func) {
-		if constexpr (Delete) {
-			if (it.IsKeyDeleted())
-				return std::nullopt;
-		}
-		size_type value_size = it.GetValueSize();
-		size_type new_size = m_file_size + sizeof(KeyOffset) + value_size;
-		if (m_file_size == kInitialFileSize || new_size <= kMaxFileSize) {
-			m_file_size = new_size;
-			m_key_offset_vec.emplace_back(it.GetKey(), m_value_buffer_size, it.IsKeyDeleted());
-			if (value_size) {
-				ensure_value_buffer_cap(m_value_buffer_size + value_size);
-				it.CopyValueData((char *)m_value_buffer.get() + m_value_buffer_size);
-				m_value_buffer_size += value_size;
-			}
-			return std::nullopt;
-		}
-		Table ret = pop_func();
-		Reset();
-		m_file_size += sizeof(KeyOffset) + value_size;
-		m_key_offset_vec.emplace_back(it.GetKey(), m_value_buffer_size, it.IsKeyDeleted());
-		if (value_size) {
-			ensure_value_buffer_cap(value_size);
-			it.CopyValueData((char *)m_value_buffer.get());
-			m_value_buffer_size = value_size;
-		}
-		return std::optional<Table>{std::move(ret)};
+		m_value_buffer_cap = size;
 	}
 
 public:
-	inline KVAppender() { reset_value_buffer(); }
+	inline explicit KVAppender(const KVTableSizeBound<Key, Trait> &bound,
+	                           const KVValueLogRefs<Trait> *p_input_log_refs = nullptr)
+	    : m_bound{bound}, m_p_input_log_refs{p_input_log_refs}, m_file_size{bound.initial_file_size} {
+		reset_value_buffer();
+	}
 	inline void Reset() {
-		m_file_size = kInitialFileSize;
-		m_key_offset_vec.clear();
+		m_file_size = m_bound.initial_file_size;
+		m_key_count = 0;
 		reset_value_buffer();
 	}
 	inline BufferTable PopBuffer() {
-		auto key_buffer = std::unique_ptr<KeyOffset[]>(new KeyOffset[m_key_offset_vec.size()]);
-		std::copy(m_key_offset_vec.begin(), m_key_offset_vec.end(), key_buffer.get());
-		auto ret = BufferTable{KVKeyBuffer<Key, Trait>{std::move(key_buffer), (size_type)m_key_offset_vec.size()},
-		                       KVValueBuffer<Value, Trait>{std::move(m_value_buffer), m_value_buffer_size}};
-		m_value_buffer = nullptr;
+		auto ret = BufferTable{KVKeyBuffer<Key, Trait>{std::move(m_key_buffer), m_key_count},
+		                       KVValueBuffer<Value, Trait>{std::move(m_value_buffer), m_value_buffer_size,
+		                                                   std::move(m_log_refs)}};
+		m_key_cap = 0;
+		m_log_refs = {};
 		return ret;
 	}
-	inline FileTable PopFile(FileSystem *p_file_system, level_type level) {
-		auto key_buffer = std::unique_ptr<KeyOffset[]>(new KeyOffset[m_key_offset_vec.size()]);
-		std::copy(m_key_offset_vec.begin(), m_key_offset_vec.end(), key_buffer.get());
-		return FileTable{
-			p_file_system, KVKeyBuffer<Key, Trait>{std::move(key_buffer), (size_type)m_key_offset_vec.size()},
-			[this](std::ofstream &fout) { fout.write((const char *)m_value_buffer.get(), m_value_buffer_size); },
-			m_value_buffer_size, level};
-	}
-	template <bool Delete, typename Iterator> inline std::optional<BufferTable> Append(const Iterator &it) {
-		return append<BufferTable, Delete>(it, [this]() { return PopBuffer(); });
-	}
-	template <bool Delete, typename Iterator>
-	inline std::optional<FileTable> Append(const Iterator &it, FileSystem *p_file_system, level_type level) {
-		return append<FileTable, Delete>(it, [this, p_file_system, level]() { return PopFile(p_file_system, level); });
+	// Bytes allocated for the table in the making, PopBuffer() hands all of them over
+	inline size_type GetBufferSize() const { return m_key_cap * sizeof(KeyOffset) + m_value_buffer_cap; }
+	// The appender is handed to pop_func first if the entry would not fit in the current table
+	template <bool Delete, typename Iterator, typename PopFunc>
+	inline void Append(const Iterator &it, PopFunc &&pop_func) {
+		if constexpr (Delete) {
+			if (it.IsKeyDeleted())
+				return;
+		}
+		size_type value_size = it.GetValueSize();
+		if (m_file_size != m_bound.initial_file_size &&
+		    m_file_size + m_bound.key_size + value_size > m_bound.max_file_size) {
+			pop_func(*this);
+			Reset();
+		}
+		m_file_size += m_bound.key_size + value_size;
+		push_key_offset(KeyOffset{it.GetKey(), m_value_buffer_size, it.IsKeyDeleted()});
+		if (value_size) {
+			ensure_value_buffer_cap(m_value_buffer_size + value_size);
+			it.CopyValueData((char *)m_value_buffer.get() + m_value_buffer_size, KVCacheAccess::kScan);
+			if constexpr (Trait::kValueLogThreshold > 0)
+				m_log_refs.AddStored((const char *)m_value_buffer.get() + m_value_buffer_size, value_size,
+				                     *m_p_input_log_refs);
+			m_value_buffer_size += value_size;
+		}
 	}
-	inline bool IsEmpty() const { return m_key_offset_vec.empty(); }
+	inline bool IsEmpty() const { return m_key_count == 0; }
 };
 
 }
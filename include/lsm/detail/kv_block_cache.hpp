@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "../kv_file.hpp"
+#include "../type.hpp"
+
+namespace lsm::detail {
+
+// Point reads count a hit as a second use of the block. Scans and compactions read neighbouring values from the same
+// blocks, so their hits leave the blocks where they are.
+enum class KVCacheAccess { kPoint, kScan };
+
+// Sharded cache of fixed-size file blocks with a byte budget. Each shard is a segmented LRU: new blocks enter a
+// probationary segment and are only promoted to the protected one on a second hit, so a long scan cannot evict the
+// working set.
+class KVBlockCache {
+private:
+	constexpr static size_type kShards = 16;
+	// Share of a shard's budget kept for blocks hit more than once
+	constexpr static size_type kProtectedPercent = 80;
+
+	struct BlockKey {
+		uint64_t file_id, block;
+		inline bool operator==(const BlockKey &r) const { return file_id == r.file_id && block == r.block; }
+	};
+	struct block_key_hasher {
+		inline std::size_t operator()(const BlockKey &key) const {
+			return std::hash<uint64_t>{}(key.file_id * 0x9e3779b97f4a7c15ull ^ key.block);
+		}
+	};
+	struct Block {
+		BlockKey key;
+		std::unique_ptr<char[]> data;
+		size_type size;
+		bool is_protected;
+	};
+	using Iterator = std::list<Block>::iterator;
+
+	struct Shard {
+		std::mutex mutex;
+		std::list<Block> probation, protect;
+		std::unordered_map<BlockKey, Iterator, block_key_hasher> map;
+		size_type probation_bytes{}, protect_bytes{};
+	};
+
+	size_type m_block_size, m_shard_capacity;
+	std::array<Shard, kShards> m_shards;
+	std::atomic<uint64_t> m_hits{0}, m_misses{0};
+
+	inline void evict(Shard &shard) {
+		while (shard.probation_bytes + shard.protect_bytes > m_shard_capacity) {
+			auto &list = shard.probation.empty() ? shard.protect : shard.probation;
+			auto &bytes = shard.probation.empty() ? shard.protect_bytes : shard.probation_bytes;
+			bytes -= list.back().size;
+			shard.map.erase(list.back().key);
+			list.pop_back();
+		}
+	}
+	inline void promote(Shard &shard, Iterator it) {
+		if (it->is_protected) {
+			shard.protect.splice(shard.protect.begin(), shard.protect, it);
+			return;
+		}
+		it->is_protected = true;
+		shard.probation_bytes -= it->size;
+		shard.protect_bytes += it->size;
+		shard.protect.splice(shard.protect.begin(), shard.probation, it);
+		// Demoted blocks get another chance in the probationary segment
+		while (shard.protect_bytes > m_shard_capacity * kProtectedPercent / 100) {
+			auto last = std::prev(shard.protect.end());
+			last->is_protected = false;
+			shard.protect_bytes -= last->size;
+			shard.probation_bytes += last->size;
+			shard.probation.splice(shard.probation.begin(), shard.protect, last);
+		}
+	}
+
+public:
+	inline KVBlockCache(size_type capacity, size_type block_size)
+	    : m_block_size{block_size}, m_shard_capacity{capacity / kShards} {}
+
+	inline size_type GetBlockSize() const { return m_block_size; }
+
+	// Copy [begin, begin + len) of a block into dst, loader(char *block_data) fills the block on a miss and returns
+	// its size
+	template <typename Loader>
+	inline void Read(uint64_t file_id, uint64_t block, size_type begin, size_type len, char *dst, KVCacheAccess access,
+	                 Loader &&loader) {
+		BlockKey key{file_id, block};
+		Shard &shard = m_shards[block_key_hasher{}(key) % kShards];
+		{
+			std::scoped_lock lock{shard.mutex};
+			auto it = shard.map.find(key);
+			if (it != shard.map.end()) {
+				m_hits.fetch_add(1, std::memory_order_relaxed);
+				if (access == KVCacheAccess::kPoint)
+					promote(shard, it->second);
+				std::copy(it->second->data.get() + begin, it->second->data.get() + begin + len, dst);
+				return;
+			}
+		}
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+		std::unique_ptr<char[]> data{new char[m_block_size]};
+		size_type size = loader(data.get());
+		std::copy(data.get() + begin, data.get() + begin + len, dst);
+
+		std::scoped_lock lock{shard.mutex};
+		if (shard.map.count(key))
+			return;
+		shard.probation.push_front(Block{key, std::move(data), size, false});
+		shard.map.emplace(key, shard.probation.begin());
+		shard.probation_bytes += size;
+		evict(shard);
+	}
+
+	inline KVCacheStats GetStats() const {
+		return {m_hits.load(std::memory_order_relaxed), m_misses.load(std::memory_order_relaxed)};
+	}
+	inline void Clear() {
+		for (auto &shard : m_shards) {
+			std::scoped_lock lock{shard.mutex};
+			shard.map.clear();
+			shard.probation.clear();
+			shard.protect.clear();
+			shard.probation_bytes = shard.protect_bytes = 0;
+		}
+	}
+};
+
+} // namespace lsm::detail
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+#include "../kv_file.hpp"
+#include "../type.hpp"
+#include "buf_stream.hpp"
+#include "kv_block_cache.hpp"
+#include "lru_cache.hpp"
+#include "sys_io.hpp"
+
+namespace lsm::detail {
+
+// LRU of opened std::ifstream shared by all tables, locked while a stream is in use
+class KVStreamCache {
+private:
+	struct fs_path_hasher {
+		std::size_t operator()(const std::filesystem::path &path) const { return hash_value(path); }
+	};
+
+	std::mutex m_mutex;
+	LRUCache<std::filesystem::path, std::ifstream, fs_path_hasher> m_cache;
+
+public:
+	class InputStream {
+	private:
+		std::unique_lock<std::mutex> m_lock;
+		std::ifstream *m_p_stream;
+
+	public:
+		inline InputStream(std::unique_lock<std::mutex> &&lock, std::ifstream *p_stream)
+		    : m_lock{std::move(lock)}, m_p_stream{p_stream} {}
+		inline InputStream &read(char *dst, size_type len) {
+			m_p_stream->read(dst, len);
+			return *this;
+		}
+	};
+
+	inline explicit KVStreamCache(size_type capacity) : m_cache{capacity} {}
+
+	inline InputStream Get(const std::filesystem::path &file_path, size_type pos) {
+		std::unique_lock lock{m_mutex};
+		std::ifstream &ret = m_cache.Push(
+		    file_path, [](const std::filesystem::path &path) { return std::ifstream{path, std::ios::binary}; });
+		ret.seekg(pos);
+		return InputStream{std::move(lock), &ret};
+	}
+	inline void Clear() {
+		std::scoped_lock lock{m_mutex};
+		m_cache.Clear();
+	}
+};
+
+class KVStreamFileReader {
+private:
+	KVStreamCache *m_p_cache;
+	std::filesystem::path m_file_path;
+
+public:
+	using InputStream = KVStreamCache::InputStream;
+	constexpr static bool kMapped = false;
+
+	inline KVStreamFileReader(KVStreamCache *p_cache, std::filesystem::path file_path)
+	    : m_p_cache{p_cache}, m_file_path{std::move(file_path)} {}
+
+	// Called once the file is completely written
+	inline void Open() {}
+
+	inline const std::filesystem::path &GetFilePath() const { return m_file_path; }
+	inline InputStream GetStream(size_type pos) const { return m_p_cache->Get(m_file_path, pos); }
+	inline void Read(size_type pos, char *dst, size_type len) const { GetStream(pos).read(dst, len); }
+};
+
+// Keeps a descriptor open for the table's lifetime, reads never share a file position so no lock is needed
+class KVPReadFileReader {
+private:
+	std::filesystem::path m_file_path;
+	FileDescriptor m_fd{kInvalidFileDescriptor};
+
+public:
+	class InputStream {
+	private:
+		const KVPReadFileReader *m_p_reader;
+		size_type m_pos;
+
+	public:
+		inline InputStream(const KVPReadFileReader *p_reader, size_type pos) : m_p_reader{p_reader}, m_pos{pos} {}
+		inline InputStream &read(char *dst, size_type len) {
+			m_p_reader->Read(m_pos, dst, len);
+			m_pos += len;
+			return *this;
+		}
+	};
+	constexpr static bool kMapped = false;
+
+	inline KVPReadFileReader(KVStreamCache *, std::filesystem::path file_path) : m_file_path{std::move(file_path)} {}
+	inline ~KVPReadFileReader() {
+		if (m_fd != kInvalidFileDescriptor)
+			CloseFile(m_fd);
+	}
+	KVPReadFileReader(const KVPReadFileReader &) = delete;
+	KVPReadFileReader &operator=(const KVPReadFileReader &) = delete;
+
+	// Open() and Read() throw std::filesystem::filesystem_error on failure
+	inline void Open() {
+		m_fd = OpenReadOnlyFile(m_file_path);
+		if (m_fd == kInvalidFileDescriptor)
+			throw std::filesystem::filesystem_error{"open", m_file_path, GetLastFileError()};
+	}
+
+	inline const std::filesystem::path &GetFilePath() const { return m_file_path; }
+	inline InputStream GetStream(size_type pos) const { return InputStream{this, pos}; }
+	inline void Read(size_type pos, char *dst, size_type len) const {
+		if (!PReadFile(m_fd, dst, len, pos))
+			throw std::filesystem::filesystem_error{"pread", m_file_path, GetLastFileError()};
+	}
+};
+
+// Maps the file once it is written, reads are plain copies out of the page cache
+class KVMMapFileReader {
+private:
+	std::filesystem::path m_file_path;
+	const char *m_data{};
+	size_type m_size{};
+
+public:
+	using InputStream = IBufStream;
+	constexpr static bool kMapped = true;
+
+	inline KVMMapFileReader(KVStreamCache *, std::filesystem::path file_path) : m_file_path{std::move(file_path)} {}
+	inline ~KVMMapFileReader() {
+		if (m_data)
+			UnmapFile(m_data, m_size);
+	}
+	KVMMapFileReader(const KVMMapFileReader &) = delete;
+	KVMMapFileReader &operator=(const KVMMapFileReader &) = delete;
+
+	// Throws std::filesystem::filesystem_error if the file cannot be mapped
+	inline void Open() {
+		FileDescriptor fd = OpenReadOnlyFile(m_file_path);
+		if (fd == kInvalidFileDescriptor)
+			throw std::filesystem::filesystem_error{"open", m_file_path, GetLastFileError()};
+		m_data = MapFile(fd, &m_size);
+		std::error_code error = m_data ? std::error_code{} : GetLastFileError();
+		CloseFile(fd);
+		if (!m_data)
+			throw std::filesystem::filesystem_error{"mmap", m_file_path, error};
+	}
+
+	inline const std::filesystem::path &GetFilePath() const { return m_file_path; }
+	inline const char *GetData() const { return m_data; }
+	inline InputStream GetStream(size_type pos) const { return InputStream{m_data, pos}; }
+	inline void Read(size_type pos, char *dst, size_type len) const { std::copy(m_data + pos, m_data + pos + len, dst); }
+};
+
+// Serves reads of the wrapped reader block by block through the shared block cache
+template <typename Reader> class KVBlockCachedFileReader {
+private:
+	Reader m_reader;
+	KVBlockCache *m_p_block_cache;
+	uint64_t m_file_id;
+	size_type m_file_size{};
+
+public:
+	class InputStream {
+	private:
+		const KVBlockCachedFileReader *m_p_reader;
+		size_type m_pos;
+		KVCacheAccess m_access;
+
+	public:
+		inline InputStream(const KVBlockCachedFileReader *p_reader, size_type pos, KVCacheAccess access)
+		    : m_p_reader{p_reader}, m_pos{pos}, m_access{access} {}
+		inline InputStream &read(char *dst, size_type len) {
+			m_p_reader->Read(m_pos, dst, len, m_access);
+			m_pos += len;
+			return *this;
+		}
+	};
+	constexpr static bool kMapped = false;
+
+	// Blocks are keyed by file_id, which must be unique for the cache's lifetime
+	inline KVBlockCachedFileReader(KVBlockCache *p_block_cache, uint64_t file_id, KVStreamCache *p_stream_cache,
+	                               std::filesystem::path file_path)
+	    : m_reader{p_stream_cache, std::move(file_path)}, m_p_block_cache{p_block_cache}, m_file_id{file_id} {}
+
+	inline void Open() {
+		m_reader.Open();
+		m_file_size = std::filesystem::file_size(m_reader.GetFilePath());
+	}
+
+	inline const std::filesystem::path &GetFilePath() const { return m_reader.GetFilePath(); }
+	inline InputStream GetStream(size_type pos) const { return InputStream{this, pos, KVCacheAccess::kPoint}; }
+	inline InputStream GetStream(size_type pos, KVCacheAccess access) const { return InputStream{this, pos, access}; }
+	// For data the caller caches in another form
+	inline void ReadUncached(size_type pos, char *dst, size_type len) const { m_reader.Read(pos, dst, len); }
+	inline void Read(size_type pos, char *dst, size_type len) const { Read(pos, dst, len, KVCacheAccess::kPoint); }
+	inline void Read(size_type pos, char *dst, size_type len, KVCacheAccess access) const {
+		const size_type block_size = m_p_block_cache->GetBlockSize();
+		while (len) {
+			uint64_t block = pos / block_size;
+			size_type begin = pos % block_size, count = std::min(len, block_size - begin);
+			m_p_block_cache->Read(m_file_id, block, begin, count, dst, access, [this, block, block_size](char *data) {
+				size_type size = std::min(block_size, m_file_size - (size_type)(block * block_size));
+				m_reader.Read(block * block_size, data, size);
+				return size;
+			});
+			pos += count, dst += count, len -= count;
+		}
+	}
+};
+
+template <typename Trait>
+using KVUncachedFileReader = std::conditional_t<Trait::kFileBackend == KVFileBackend::kPRead, KVPReadFileReader,
+                                                KVStreamFileReader>;
+// Mapped files are already served from the page cache, so they bypass the block cache
+template <typename Trait>
+constexpr bool kKVBlockCached = Trait::kFileBackend != KVFileBackend::kMMap && Trait::kBlockCacheSize != 0;
+template <typename Trait>
+using KVFileReader =
+    std::conditional_t<Trait::kFileBackend == KVFileBackend::kMMap, KVMMapFileReader,
+                       std::conditional_t<kKVBlockCached<Trait>, KVBlockCachedFileReader<KVUncachedFileReader<Trait>>,
+                                          KVUncachedFileReader<Trait>>>;
+template <typename Trait> using KVFileReaderPtr = std::shared_ptr<const KVFileReader<Trait>>;
+
+} // namespace lsm::detail
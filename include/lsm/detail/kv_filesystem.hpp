@@ -1,25 +1,37 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
+#include <memory>
+#include <type_traits>
 
 #include "io.hpp"
-#include "lru_cache.hpp"
+#include "kv_file_reader.hpp"
+#include "kv_rate_limiter.hpp"
+#include "kv_value_log.hpp"
+#include "sys_io.hpp"
 
-#include "../kv_level.hpp"
+#include "../kv_log.hpp"
+#include "../kv_options.hpp"
 
 namespace lsm::detail {
 
 template <typename Trait> class KVFileSystem {
 private:
-	constexpr static level_type kLevels = sizeof(Trait::kLevelConfigs) / sizeof(KVLevelConfig);
+	// Tables must be durable before the logs covering them are removed
+	constexpr static bool kSyncFiles =
+	    Trait::kLogConfig.mode == KVLogMode::kGroupCommit || Trait::kLogConfig.mode == KVLogMode::kSync;
 
-	struct fs_path_hasher {
-		std::size_t operator()(const std::filesystem::path &path) const { return hash_value(path); }
-	};
-
-	mutable LRUCache<std::filesystem::path, std::ifstream, fs_path_hasher> m_input_stream_cache;
+	mutable KVStreamCache m_stream_cache;
+	mutable KVBlockCache m_block_cache;
+	mutable std::atomic<uint64_t> m_next_file_id{0};
 	std::filesystem::path m_directory;
-	time_type m_time_stamp;
+	KVOptions m_options;
+	KVRateLimiter m_rate_limiter;
+	KVValueLog<Trait> m_value_log;
+	// Files may be created by several merging threads at once
+	std::atomic<time_type> m_time_stamp;
 
 	inline std::filesystem::path get_level_dir(level_type level) const {
 		return m_directory / (std::string{"level-"} + std::to_string(level));
@@ -27,16 +39,35 @@ private:
 	inline void init_directory() {
 		if (!std::filesystem::exists(m_directory))
 			std::filesystem::create_directory(m_directory);
-		for (level_type level = 0; level <= kLevels; ++level) {
+		for (level_type level = 0; level <= GetLevelCount(); ++level) {
 			if (!std::filesystem::exists(get_level_dir(level)))
 				std::filesystem::create_directory(get_level_dir(level));
 		}
 	}
 
 public:
-	inline KVFileSystem(std::filesystem::path directory, size_type stream_capacity)
-	    : m_directory{std::move(directory)}, m_input_stream_cache{stream_capacity}, m_time_stamp{0} {
+	using FileReader = KVFileReader<Trait>;
+
+	inline KVFileSystem(std::filesystem::path directory, KVOptions options, size_type stream_capacity)
+	    : m_stream_cache{stream_capacity}, m_block_cache{Trait::kBlockCacheSize, Trait::kBlockSize},
+	      m_directory{std::move(directory)}, m_options{std::move(options)},
+	      m_rate_limiter{m_options.rate_limit.bytes_per_sec}, m_value_log{m_directory / "vlog"}, m_time_stamp{0} {
 		init_directory();
+		m_value_log.Init();
+	}
+
+	inline const KVOptions &GetOptions() const { return m_options; }
+	// Levels with a config, the last level comes after them
+	inline level_type GetLevelCount() const { return m_options.level_configs.size(); }
+	// Levels past the configured ones share the last config
+	inline size_type GetBloomBitsPerKey(level_type level) const {
+		const auto &configs = m_options.level_configs;
+		return configs.empty() ? 0 : configs[std::min(level, (level_type)configs.size() - 1)].bloom_bits_per_key;
+	}
+	inline KVCompression GetCompression(level_type level) const {
+		const auto &configs = m_options.level_configs;
+		return configs.empty() ? KVCompression::kNone
+		                       : configs[std::min(level, (level_type)configs.size() - 1)].compression;
 	}
 
 	template <typename Func> inline void ForEachFile(Func &&func) const {
@@ -46,8 +77,6 @@ public:
 			auto level_dir_name = level_dir.path().filename().string();
 			if (level_dir_name.size() > 6 && level_dir_name.substr(0, 6) == "level-") {
 				level_type level = std::stoull(level_dir_name.substr(6));
-				if (level > kLevels)
-					continue;
 				for (const auto &file : std::filesystem::directory_iterator(level_dir)) {
 					if (!file.is_regular_file())
 						continue;
@@ -59,30 +88,68 @@ public:
 		}
 	}
 
-	inline time_type GetTimeStamp() const { return m_time_stamp; }
+	inline const std::filesystem::path &GetDirectory() const { return m_directory; }
+
+	inline void MaintainTimeStamp(time_type time_stamp) {
+		time_type cur = m_time_stamp.load(std::memory_order_relaxed);
+		while (cur <= time_stamp && !m_time_stamp.compare_exchange_weak(cur, time_stamp + 1, std::memory_order_relaxed))
+			;
+	}
 
-	inline void MaintainTimeStamp(time_type time_stamp) { m_time_stamp = std::max(time_stamp + 1, m_time_stamp); }
+	inline std::shared_ptr<FileReader> NewFileReader(std::filesystem::path file_path) const {
+		if constexpr (kKVBlockCached<Trait>)
+			return std::make_shared<FileReader>(&m_block_cache, m_next_file_id++, &m_stream_cache,
+			                                    std::move(file_path));
+		else
+			return std::make_shared<FileReader>(&m_stream_cache, std::move(file_path));
+	}
+	inline KVCacheStats GetBlockCacheStats() const { return m_block_cache.GetStats(); }
+	// Uncompressed value blocks are cached under ids of their own
+	inline KVBlockCache *GetBlockCache() const { return kKVBlockCached<Trait> ? &m_block_cache : nullptr; }
+	inline uint64_t NewBlockCacheID() const { return m_next_file_id++; }
+	inline KVRateLimiter &GetRateLimiter() { return m_rate_limiter; }
+	inline const KVRateLimiter &GetRateLimiter() const { return m_rate_limiter; }
+	inline KVValueLog<Trait> &GetValueLog() { return m_value_log; }
+	// Returns the time stamp of the new file, writes to level 0 come from flushes and go first
+	template <typename Writer> inline time_type CreateFile(level_type level, Writer &&writer) {
+		time_type time_stamp = m_time_stamp.fetch_add(1, std::memory_order_relaxed);
+		std::filesystem::path file_path = get_level_dir(level) / (std::to_string(time_stamp) + ".sst");
+		{
+			KVRateLimitedOStream fout{file_path, &m_rate_limiter,
+			                          level == 0 ? KVIOPriority::kHigh : KVIOPriority::kLow};
+			IO<time_type>::Write(fout, time_stamp);
+			writer(fout, file_path);
+		}
+		if constexpr (kSyncFiles)
+			SyncFile(file_path);
+		return time_stamp;
+	}
 
-	inline std::ifstream &GetFileStream(const std::filesystem::path &file_path, size_type pos) const {
-		std::ifstream &ret = m_input_stream_cache.Push(file_path, [](const std::filesystem::path &path) {
-			return std::ifstream{path, std::ios::binary};
-		});
-		return ret.seekg(pos), ret;
+	// Sync the entries of the level directories, so that new tables survive a crash once the logs covering them are
+	// removed
+	inline void SyncDirectories() const {
+		if constexpr (kSyncFiles) {
+			for (level_type level = 0; level <= GetLevelCount(); ++level)
+				SyncDirectory(get_level_dir(level));
+		}
 	}
-	template <typename Writer> inline void CreateFile(level_type level, Writer &&writer) {
-		std::filesystem::path file_path = get_level_dir(level) / (std::to_string(m_time_stamp) + ".sst");
-		std::ofstream fout{file_path, std::ios::binary};
-		IO<time_type>::Write(fout, m_time_stamp);
-		writer(fout, std::move(file_path));
-		++m_time_stamp;
+
+	// Another name for a table file in the given level, its data is not copied
+	inline std::filesystem::path LinkFile(const std::filesystem::path &file_path, level_type level) {
+		std::filesystem::path link_path = get_level_dir(level) / file_path.filename();
+		std::filesystem::create_hard_link(file_path, link_path);
+		return link_path;
 	}
 
 	inline void Reset() {
-		m_input_stream_cache.Clear();
+		m_stream_cache.Clear();
+		m_block_cache.Clear();
+		m_value_log.Reset();
 		if (std::filesystem::exists(m_directory))
 			std::filesystem::remove_all(m_directory);
 		m_time_stamp = 0;
 		init_directory();
+		m_value_log.Init();
 	}
 };
 
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <algorithm>
 #include <utility>
+#include <vector>
 
 #include "../bloom.hpp"
+#include "../kv_options.hpp"
 #include "../type.hpp"
 #include "io.hpp"
-#include "kv_filesystem.hpp"
+#include "kv_file_reader.hpp"
 
 namespace lsm::detail {
 
@@ -25,6 +28,40 @@ public:
 };
 #pragma pack(pop)
 
+// Filter size of a table with count keys, 0 bits per key keeps the filter's fixed size
+template <typename Bloom> inline size_type get_bloom_bits(size_type bits_per_key, size_type count) {
+	return bits_per_key ? std::max(count * bits_per_key, (size_type)64) : Bloom::kDefaultBits;
+}
+
+// Bounds of a table's serialized filter, base + count * per_key bytes, for sizing tables before their level is known
+template <typename Bloom> struct KVBloomSizeBound {
+	size_type base, per_key;
+
+	inline explicit KVBloomSizeBound(const std::vector<KVLevelConfig> &level_configs) {
+		size_type max_bits_per_key = 0;
+		bool has_fixed_size = level_configs.empty();
+		for (const auto &config : level_configs) {
+			max_bits_per_key = std::max(max_bits_per_key, config.bloom_bits_per_key);
+			has_fixed_size |= config.bloom_bits_per_key == 0;
+		}
+		// Bit count, rounding to a whole block, and the fixed-size filter if some level keeps it
+		base = sizeof(size_type) + 64 + (has_fixed_size ? Bloom::kDefaultBits / 8 : 0);
+		per_key = (max_bits_per_key + 7) / 8;
+	}
+};
+
+template <typename Bloom, typename Key>
+inline void insert_bloom(Bloom &bloom, const KVKeyOffset<Key> *key_offsets, size_type count) {
+	constexpr size_type kBatch = 64;
+	Key keys[kBatch];
+	for (size_type i = 0; i < count; i += kBatch) {
+		size_type batch = std::min(kBatch, count - i);
+		for (size_type j = 0; j < batch; ++j)
+			keys[j] = key_offsets[i + j].GetKey();
+		bloom.InsertBatch(keys, batch);
+	}
+}
+
 template <typename Key, typename Trait> class KVKeyTableBase {
 private:
 	using Compare = typename Trait::Compare;
@@ -89,58 +126,110 @@ public:
 	inline static KeyOffset GetKeyOffset(Index index) { return *index; }
 };
 
-template <typename Derived, typename Key, typename Trait>
+// With a non-zero FenceInterval every FenceInterval-th key is kept in memory, so a lookup reads a single run of keys
+template <typename Derived, typename Key, typename Trait, size_type FenceInterval>
 class KVUncachedKeyTableBase : public KVKeyTableBase<Key, Trait> {
 protected:
 	using Compare = typename Trait::Compare;
 	using KeyOffset = KVKeyOffset<Key>;
 
-	KVFileSystem<Trait> *m_p_file_system{};
-	std::filesystem::path m_file_path;
+	constexpr static size_type kReadChunk = 256;
+	// Mapped files are searched in place
+	constexpr static bool kFenced = FenceInterval != 0 && !KVFileReader<Trait>::kMapped;
+
+	KVFileReaderPtr<Trait> m_file;
+	std::vector<Key> m_fences;
+
+	inline void build_fences(const KeyOffset *key_offsets) {
+		if constexpr (kFenced) {
+			m_fences.reserve((this->m_count + FenceInterval - 1) / FenceInterval);
+			for (size_type i = 0; i < this->m_count; i += FenceInterval)
+				m_fences.push_back(key_offsets[i].GetKey());
+		}
+	}
+	// Stream must be at the first key offset
+	template <typename Stream> inline void load_fences(Stream &istr) {
+		if constexpr (kFenced) {
+			m_fences.reserve((this->m_count + FenceInterval - 1) / FenceInterval);
+			KeyOffset chunk[FenceInterval];
+			for (size_type i = 0; i < this->m_count; i += FenceInterval) {
+				istr.read((char *)chunk, std::min(FenceInterval, this->m_count - i) * sizeof(KeyOffset));
+				m_fences.push_back(chunk[0].GetKey());
+			}
+		}
+	}
 
-	mutable KeyOffset m_cached_key_offset;
-	mutable size_type m_cached_index = -1;
+	inline size_type get_key_offset_pos(size_type index) const {
+		return sizeof(time_type) + static_cast<const Derived *>(this)->GetHeaderSize() + index * sizeof(KeyOffset);
+	}
+	// Index of the first key not less than the given one, key offsets are read in chunks
+	inline size_type find_lower_bound(Key key, KeyOffset *p_key_offset) const {
+		if constexpr (KVFileReader<Trait>::kMapped) {
+			// Binary search the mapped key array in place
+			auto first = (const KeyOffset *)(m_file->GetData() + get_key_offset_pos(0)), last = first + this->m_count;
+			auto it = std::lower_bound(first, last, key, [](const KeyOffset &key_offset, Key key) {
+				return Compare{}(key_offset.GetKey(), key);
+			});
+			if (it != last)
+				*p_key_offset = *it;
+			return it - first;
+		} else if constexpr (kFenced) {
+			// Keys before the first fence not less than the key are all less than it
+			size_type fence = std::lower_bound(m_fences.begin(), m_fences.end(), key, Compare{}) - m_fences.begin();
+			if (fence == 0) {
+				if (this->m_count)
+					*p_key_offset = GetKeyOffset(0);
+				return 0;
+			}
+			size_type first = (fence - 1) * FenceInterval, count = std::min(FenceInterval + 1, this->m_count - first);
+			KeyOffset chunk[FenceInterval + 1];
+			m_file->Read(get_key_offset_pos(first), (char *)chunk, count * sizeof(KeyOffset));
+			for (size_type j = 1; j < count; ++j)
+				if (!Compare{}(chunk[j].GetKey(), key)) {
+					*p_key_offset = chunk[j];
+					return first + j;
+				}
+			return this->m_count;
+		} else {
+			KeyOffset chunk[kReadChunk];
+			for (size_type i = 0; i < this->m_count; i += kReadChunk) {
+				size_type count = std::min(kReadChunk, this->m_count - i);
+				m_file->Read(get_key_offset_pos(i), (char *)chunk, count * sizeof(KeyOffset));
+				for (size_type j = 0; j < count; ++j)
+					if (!Compare{}(chunk[j].GetKey(), key)) {
+						*p_key_offset = chunk[j];
+						return i + j;
+					}
+			}
+			return this->m_count;
+		}
+	}
 
 public:
 	using Index = size_type;
 
 	inline KVUncachedKeyTableBase() = default;
-	inline KVUncachedKeyTableBase(KVFileSystem<Trait> *p_file_system, std::filesystem::path file_path)
-	    : m_p_file_system{p_file_system}, m_file_path{std::move(file_path)} {}
-	inline KVUncachedKeyTableBase(KVFileSystem<Trait> *p_file_system, std::filesystem::path file_path, Key min, Key max,
-	                              size_type count)
-	    : KVKeyTableBase<Key, Trait>(min, max, count), m_p_file_system{p_file_system},
-	      m_file_path{std::move(file_path)} {}
+	inline explicit KVUncachedKeyTableBase(KVFileReaderPtr<Trait> file) : m_file{std::move(file)} {}
+	inline KVUncachedKeyTableBase(KVFileReaderPtr<Trait> file, Key min, Key max, size_type count)
+	    : KVKeyTableBase<Key, Trait>(min, max, count), m_file{std::move(file)} {}
 
 	inline Index GetBegin() const { return 0; }
 	inline Index GetEnd() const { return this->m_count; }
 	inline Index GetLowerBound(Key key) const {
-		std::ifstream &fin = m_p_file_system->GetFileStream(m_file_path, sizeof(time_type) + Derived::GetHeaderSize());
-		for (Index i = 0; i < this->m_count; ++i) {
-			KeyOffset key_offset = IO<KeyOffset>::Read(fin);
-			if (!Compare{}(key_offset.GetKey(), key))
-				return i;
-		}
-		return this->m_count;
+		KeyOffset key_offset;
+		return find_lower_bound(key, &key_offset);
 	}
 	inline Index Find(Key key) const {
 		if (this->IsMinMaxExcluded(key) || static_cast<const Derived *>(this)->IsExtraExcluded(key))
 			return GetEnd();
-		std::ifstream &fin = m_p_file_system->GetFileStream(m_file_path, sizeof(time_type) + Derived::GetHeaderSize());
-		for (Index i = 0; i < this->m_count; ++i) {
-			KeyOffset key_offset = IO<KeyOffset>::Read(fin);
-			if (!Compare{}(key_offset.GetKey(), key))
-				return Compare{}(key, key_offset.GetKey()) ? this->m_count : i;
-		}
-		return this->m_count;
+		KeyOffset key_offset;
+		Index index = find_lower_bound(key, &key_offset);
+		return index == this->m_count || Compare{}(key, key_offset.GetKey()) ? this->m_count : index;
 	}
 	inline KeyOffset GetKeyOffset(Index index) const {
-		if (m_cached_index == index)
-			return m_cached_key_offset;
-		m_cached_index = index;
-		m_cached_key_offset = IO<KeyOffset>::Read(m_p_file_system->GetFileStream(
-		    m_file_path, sizeof(time_type) + Derived::GetHeaderSize() + index * (sizeof(KeyOffset))));
-		return m_cached_key_offset;
+		KeyOffset key_offset;
+		m_file->Read(get_key_offset_pos(index), (char *)&key_offset, sizeof(KeyOffset));
+		return key_offset;
 	}
 };
 
@@ -153,8 +242,8 @@ private:
 
 	template <typename, typename, typename> friend class KVCachedBloomKeyFile;
 	template <typename, typename> friend class KVCachedKeyFile;
-	template <typename, typename, typename> friend class KVUncachedBloomKeyFile;
-	template <typename, typename> friend class KVUncachedKeyFile;
+	template <typename, typename, typename, size_type> friend class KVUncachedBloomKeyFile;
+	template <typename, typename, size_type> friend class KVUncachedKeyFile;
 
 public:
 	inline KVKeyBuffer() = default;
@@ -164,47 +253,54 @@ public:
 template <typename Derived, typename Key> class KVKeyFileBase {
 protected:
 public:
-	inline constexpr size_type GetSize() const {
-		return Derived::GetHeaderSize() + sizeof(KVKeyOffset<Key>) * static_cast<const Derived *>(this)->GetCount();
+	inline size_type GetSize() const {
+		return static_cast<const Derived *>(this)->GetHeaderSize() +
+		       sizeof(KVKeyOffset<Key>) * static_cast<const Derived *>(this)->GetCount();
 	}
 };
 
-template <typename Key, typename Trait>
-class KVUncachedKeyFile final : public KVUncachedKeyTableBase<KVUncachedKeyFile<Key, Trait>, Key, Trait>,
-                                public KVKeyFileBase<KVUncachedKeyFile<Key, Trait>, Key> {
+template <typename Key, typename Trait, size_type FenceInterval>
+class KVUncachedKeyFile final
+    : public KVUncachedKeyTableBase<KVUncachedKeyFile<Key, Trait, FenceInterval>, Key, Trait, FenceInterval>,
+      public KVKeyFileBase<KVUncachedKeyFile<Key, Trait, FenceInterval>, Key> {
 private:
 	using Compare = typename Trait::Compare;
+	using Base = KVUncachedKeyTableBase<KVUncachedKeyFile, Key, Trait, FenceInterval>;
 
 public:
 	inline KVUncachedKeyFile() = default;
 	template <typename Stream>
-	inline KVUncachedKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer, KVFileSystem<Trait> *p_file_system,
-	                         const std::filesystem::path &file_path)
-	    : KVUncachedKeyTableBase<KVUncachedKeyFile, Key, Trait>(p_file_system, file_path, key_buffer.GetMin(),
-	                                                            key_buffer.GetMax(), key_buffer.GetCount()) {
+	inline KVUncachedKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer, const KVFileReaderPtr<Trait> &file,
+	                         size_type)
+	    : Base(file, key_buffer.GetMin(), key_buffer.GetMax(), key_buffer.GetCount()) {
 		IO<size_type>::Write(ostr, this->m_count);
 		IO<Key>::Write(ostr, this->m_min);
 		IO<Key>::Write(ostr, this->m_max);
 		ostr.write((const char *)key_buffer.m_keys.get(), this->m_count * sizeof(KVKeyOffset<Key>));
+		this->build_fences(key_buffer.m_keys.get());
 	}
 
 	template <typename Stream>
-	inline KVUncachedKeyFile(Stream &istr, KVFileSystem<Trait> *p_file_system, const std::filesystem::path &file_path)
-	    : KVUncachedKeyTableBase<KVUncachedKeyFile, Key, Trait>(p_file_system, file_path) {
+	inline KVUncachedKeyFile(Stream &istr, const KVFileReaderPtr<Trait> &file) : Base(file) {
 		this->m_count = IO<size_type>::Read(istr);
 		this->m_min = IO<Key>::Read(istr);
 		this->m_max = IO<Key>::Read(istr);
+		this->load_fences(istr);
 	}
 
 	inline static constexpr size_type GetHeaderSize() { return sizeof(size_type) + sizeof(Key) * 2; }
+	inline static constexpr size_type GetBaseHeaderSize(const KVOptions &) { return GetHeaderSize(); }
+	inline static constexpr size_type GetHeaderSizePerKey(const KVOptions &) { return 0; }
 };
 
-template <typename Key, typename Trait, typename Bloom>
+template <typename Key, typename Trait, typename Bloom, size_type FenceInterval>
 class KVUncachedBloomKeyFile final
-    : public KVUncachedKeyTableBase<KVUncachedBloomKeyFile<Key, Trait, Bloom>, Key, Trait>,
-      public KVKeyFileBase<KVUncachedBloomKeyFile<Key, Trait, Bloom>, Key> {
+    : public KVUncachedKeyTableBase<KVUncachedBloomKeyFile<Key, Trait, Bloom, FenceInterval>, Key, Trait,
+                                    FenceInterval>,
+      public KVKeyFileBase<KVUncachedBloomKeyFile<Key, Trait, Bloom, FenceInterval>, Key> {
 private:
 	using Compare = typename Trait::Compare;
+	using Base = KVUncachedKeyTableBase<KVUncachedBloomKeyFile, Key, Trait, FenceInterval>;
 
 	Bloom m_bloom;
 
@@ -212,31 +308,34 @@ public:
 	inline KVUncachedBloomKeyFile() = default;
 	template <typename Stream>
 	inline KVUncachedBloomKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer,
-	                              KVFileSystem<Trait> *p_file_system, const std::filesystem::path &file_path)
-	    : KVUncachedKeyTableBase<KVUncachedBloomKeyFile, Key, Trait>(p_file_system, file_path, key_buffer.GetMin(),
-	                                                                 key_buffer.GetMax(), key_buffer.GetCount()) {
-		for (size_type i = 0; i < this->m_count; ++i)
-			m_bloom.Insert(key_buffer.m_keys[i].GetKey());
+	                              const KVFileReaderPtr<Trait> &file, size_type bloom_bits_per_key)
+	    : Base(file, key_buffer.GetMin(), key_buffer.GetMax(), key_buffer.GetCount()),
+	      m_bloom{get_bloom_bits<Bloom>(bloom_bits_per_key, key_buffer.GetCount())} {
+		insert_bloom(m_bloom, key_buffer.m_keys.get(), this->m_count);
 		IO<size_type>::Write(ostr, this->m_count);
 		IO<Key>::Write(ostr, this->m_min);
 		IO<Key>::Write(ostr, this->m_max);
 		IO<Bloom>::Write(ostr, m_bloom);
 		ostr.write((const char *)key_buffer.m_keys.get(), this->m_count * sizeof(KVKeyOffset<Key>));
+		this->build_fences(key_buffer.m_keys.get());
 	}
 
 	template <typename Stream>
-	inline KVUncachedBloomKeyFile(Stream &istr, KVFileSystem<Trait> *p_file_system,
-	                              const std::filesystem::path &file_path)
-	    : KVUncachedKeyTableBase<KVUncachedBloomKeyFile, Key, Trait>(p_file_system, file_path) {
+	inline KVUncachedBloomKeyFile(Stream &istr, const KVFileReaderPtr<Trait> &file) : Base(file) {
 		this->m_count = IO<size_type>::Read(istr);
 		this->m_min = IO<Key>::Read(istr);
 		this->m_max = IO<Key>::Read(istr);
 		this->m_bloom = IO<Bloom>::Read(istr);
+		this->load_fences(istr);
 	}
 
 	inline bool IsExtraExcluded(Key key) const { return !m_bloom.Exist(key); }
-	inline static constexpr size_type GetHeaderSize() {
-		return sizeof(size_type) + sizeof(Key) * 2 + IO<Bloom>::GetSize({});
+	inline size_type GetHeaderSize() const { return sizeof(size_type) + sizeof(Key) * 2 + IO<Bloom>::GetSize(m_bloom); }
+	inline static size_type GetBaseHeaderSize(const KVOptions &options) {
+		return sizeof(size_type) + sizeof(Key) * 2 + KVBloomSizeBound<Bloom>{options.level_configs}.base;
+	}
+	inline static size_type GetHeaderSizePerKey(const KVOptions &options) {
+		return KVBloomSizeBound<Bloom>{options.level_configs}.per_key;
 	}
 };
 
@@ -252,11 +351,11 @@ public:
 	inline KVCachedBloomKeyFile() = default;
 
 	template <typename Stream>
-	inline KVCachedBloomKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer, KVFileSystem<Trait> *,
-	                            const std::filesystem::path &)
-	    : KVCachedKeyTableBase<KVCachedBloomKeyFile, Key, Trait>(std::move(key_buffer.m_keys), key_buffer.GetCount()) {
-		for (size_type i = 0; i < this->m_count; ++i)
-			m_bloom.Insert(this->m_keys[i].GetKey());
+	inline KVCachedBloomKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer,
+	                            const KVFileReaderPtr<Trait> &, size_type bloom_bits_per_key)
+	    : KVCachedKeyTableBase<KVCachedBloomKeyFile, Key, Trait>(std::move(key_buffer.m_keys), key_buffer.GetCount()),
+	      m_bloom{get_bloom_bits<Bloom>(bloom_bits_per_key, this->m_count)} {
+		insert_bloom(m_bloom, this->m_keys.get(), this->m_count);
 		IO<size_type>::Write(ostr, this->m_count);
 		IO<Key>::Write(ostr, this->m_min);
 		IO<Key>::Write(ostr, this->m_max);
@@ -264,7 +363,7 @@ public:
 		ostr.write((const char *)this->m_keys.get(), this->m_count * sizeof(KVKeyOffset<Key>));
 	}
 	template <typename Stream>
-	inline KVCachedBloomKeyFile(Stream &istr, KVFileSystem<Trait> *, const std::filesystem::path &) {
+	inline KVCachedBloomKeyFile(Stream &istr, const KVFileReaderPtr<Trait> &) {
 		this->m_count = IO<size_type>::Read(istr);
 		this->m_min = IO<Key>::Read(istr);
 		this->m_max = IO<Key>::Read(istr);
@@ -273,8 +372,12 @@ public:
 		istr.read((char *)this->m_keys.get(), this->m_count * sizeof(KVKeyOffset<Key>));
 	}
 	inline bool IsExtraExcluded(Key key) const { return !m_bloom.Exist(key); }
-	inline static constexpr size_type GetHeaderSize() {
-		return sizeof(size_type) + sizeof(Key) * 2 + IO<Bloom>::GetSize({});
+	inline size_type GetHeaderSize() const { return sizeof(size_type) + sizeof(Key) * 2 + IO<Bloom>::GetSize(m_bloom); }
+	inline static size_type GetBaseHeaderSize(const KVOptions &options) {
+		return sizeof(size_type) + sizeof(Key) * 2 + KVBloomSizeBound<Bloom>{options.level_configs}.base;
+	}
+	inline static size_type GetHeaderSizePerKey(const KVOptions &options) {
+		return KVBloomSizeBound<Bloom>{options.level_configs}.per_key;
 	}
 };
 
@@ -288,8 +391,8 @@ public:
 	inline KVCachedKeyFile() = default;
 
 	template <typename Stream>
-	inline KVCachedKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer, KVFileSystem<Trait> *,
-	                       const std::filesystem::path &)
+	inline KVCachedKeyFile(Stream &ostr, KVKeyBuffer<Key, Trait> &&key_buffer, const KVFileReaderPtr<Trait> &,
+	                       size_type)
 	    : KVCachedKeyTableBase<KVCachedKeyFile, Key, Trait>(std::move(key_buffer.m_keys), key_buffer.GetCount()) {
 		IO<size_type>::Write(ostr, this->m_count);
 		IO<Key>::Write(ostr, this->m_min);
@@ -298,7 +401,7 @@ public:
 	}
 
 	template <typename Stream>
-	inline KVCachedKeyFile(Stream &istr, KVFileSystem<Trait> *, const std::filesystem::path &) {
+	inline KVCachedKeyFile(Stream &istr, const KVFileReaderPtr<Trait> &) {
 		this->m_count = IO<size_type>::Read(istr);
 		this->m_min = IO<Key>::Read(istr);
 		this->m_max = IO<Key>::Read(istr);
@@ -307,6 +410,8 @@ public:
 	}
 
 	inline static constexpr size_type GetHeaderSize() { return sizeof(size_type) + sizeof(Key) * 2; }
+	inline static constexpr size_type GetBaseHeaderSize(const KVOptions &) { return GetHeaderSize(); }
+	inline static constexpr size_type GetHeaderSizePerKey(const KVOptions &) { return 0; }
 };
 
 } // namespace lsm::detail
\ No newline at end of file
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "../kv_log.hpp"
+#include "buf_stream.hpp"
+#include "crc32.hpp"
+#include "io.hpp"
+#include "kv_write_batch.hpp"
+#include "sys_io.hpp"
+
+namespace lsm::detail {
+
+// Write-ahead log, one file per memtable, removed once the memtable is persisted.
+// Each record body is preceded by its length and CRC-32C.
+template <typename Key, typename Value, typename Trait> class KVLog {
+private:
+	using ValueIO = typename Trait::ValueIO;
+	using WriteBatch = KVWriteBatch<Key, Value, Trait>;
+
+	constexpr static KVLogConfig kConfig = Trait::kLogConfig;
+
+	enum : byte { kPutRecord = 0, kDeleteRecord = 1, kBatchRecord = 2 };
+
+	struct FileOStream {
+		std::FILE *file;
+		bool failed;
+		inline void write(const char *src, size_type len) { failed |= std::fwrite(src, 1, len, file) != len; }
+	};
+	struct StringOStream {
+		std::string *p_str;
+		inline void write(const char *src, size_type len) { p_str->append(src, len); }
+	};
+
+	std::filesystem::path m_directory;
+	std::FILE *m_file{};
+	uint64_t m_seq{};
+
+	std::mutex m_mutex;
+	// Body of the record being appended, kept to reuse its buffer
+	std::string m_body;
+
+	// Records appended and synced since the log was opened, a record is numbered by the count after its append.
+	// kSync and group commit sync in SyncGroup(), one writer at a time.
+	std::condition_variable m_sync_cv;
+	uint64_t m_appended_count{}, m_synced_count{};
+	size_type m_pending_bytes{};
+	bool m_syncing{false};
+	// First failed open, write or sync, every later write fails as well since replay would stop at it
+	std::error_code m_error;
+
+	inline std::filesystem::path get_log_path(uint64_t seq) const {
+		return m_directory / (std::to_string(seq) + ".log");
+	}
+	inline std::vector<std::pair<uint64_t, std::filesystem::path>> list_logs() const {
+		std::vector<std::pair<uint64_t, std::filesystem::path>> logs;
+		for (const auto &file : std::filesystem::directory_iterator(m_directory)) {
+			if (!file.is_regular_file() || file.path().extension() != ".log")
+				continue;
+			logs.emplace_back(std::stoull(file.path().stem().string()), file.path());
+		}
+		std::sort(logs.begin(), logs.end());
+		return logs;
+	}
+
+	// Called with m_mutex held, right after the failed call
+	inline void set_error() {
+		if (!m_error)
+			m_error = GetLastFileError();
+	}
+	inline void throw_if_error() const {
+		if (m_error)
+			throw std::filesystem::filesystem_error{"write", get_log_path(m_seq), m_error};
+	}
+
+	// Throws std::filesystem::filesystem_error if the file cannot be created
+	inline void open() {
+		m_file = std::fopen(get_log_path(m_seq).string().c_str(), "wb");
+		if (!m_file) {
+			set_error();
+			throw_if_error();
+		}
+	}
+	// Called with m_mutex held, a group sync in flight is waited for since it still uses the file
+	inline void close(std::unique_lock<std::mutex> &lock) {
+		m_sync_cv.wait(lock, [this]() { return !m_syncing; });
+		if (m_file) {
+			bool flushed = kConfig.mode == KVLogMode::kNoSync ? std::fflush(m_file) == 0 : SyncFile(m_file);
+			if (!flushed)
+				set_error();
+			std::fclose(m_file);
+			m_file = nullptr;
+		}
+		m_pending_bytes = 0;
+		m_synced_count = m_appended_count;
+		m_sync_cv.notify_all();
+	}
+
+	// Called with m_mutex held after m_body is written, returns the number of the record. Throws
+	// std::filesystem::filesystem_error if the record does not reach the OS.
+	inline uint64_t append_record() {
+		throw_if_error();
+		FileOStream fout{m_file, false};
+		IO<size_type>::Write(fout, (size_type)m_body.size());
+		IO<uint32_t>::Write(fout, CRC32C(m_body.data(), m_body.size()));
+		fout.write(m_body.data(), m_body.size());
+		// Records always reach the OS, the sync is left to SyncGroup() so that appends never wait for one
+		if (fout.failed || std::fflush(m_file)) {
+			set_error();
+			throw_if_error();
+		}
+		if constexpr (kConfig.mode == KVLogMode::kGroupCommit) {
+			m_pending_bytes += sizeof(size_type) + sizeof(uint32_t) + m_body.size();
+			if (m_pending_bytes >= kConfig.group_commit_bytes)
+				m_sync_cv.notify_all();
+		}
+		return ++m_appended_count;
+	}
+	template <typename Stream> inline static void write_entry(Stream &ostr, Key key, const Value *p_value,
+	                                                          size_type value_size) {
+		if (p_value) {
+			IO<byte>::Write(ostr, kPutRecord);
+			IO<Key>::Write(ostr, key);
+			IO<size_type>::Write(ostr, value_size);
+			ValueIO::Write(ostr, *p_value);
+		} else {
+			IO<byte>::Write(ostr, kDeleteRecord);
+			IO<Key>::Write(ostr, key);
+		}
+	}
+
+public:
+	constexpr static bool kEnabled = kConfig.mode != KVLogMode::kDisabled;
+
+	inline explicit KVLog(std::filesystem::path directory) : m_directory{std::move(directory)} {
+		if constexpr (kEnabled) {
+			for (const auto &log : list_logs())
+				m_seq = std::max(m_seq, log.first + 1);
+			open();
+		}
+	}
+	inline ~KVLog() {
+		if constexpr (kEnabled) {
+			std::unique_lock lock{m_mutex};
+			close(lock);
+		}
+	}
+
+	// Replay logs left by a previous run (oldest first), returns their paths.
+	// Replay stops at the first record that is torn or fails its CRC, none of the later records were acknowledged.
+	template <typename PutFunc, typename DeleteFunc, typename BatchFunc>
+	inline std::vector<std::filesystem::path> Recover(PutFunc &&put_func, DeleteFunc &&delete_func,
+	                                                  BatchFunc &&batch_func) const {
+		std::vector<std::filesystem::path> log_paths;
+		if constexpr (kEnabled) {
+			// Reads a put or delete entry ending before end, returns false if it does not
+			const auto read_entry = [](IBufStream &bin, uint64_t end, auto &&on_put, auto &&on_delete) -> bool {
+				if (bin.pos + sizeof(byte) + sizeof(Key) > end)
+					return false;
+				auto type = IO<byte>::Read(bin);
+				auto key = IO<Key>::Read(bin);
+				if (type == kDeleteRecord) {
+					on_delete(key);
+					return true;
+				}
+				if (type != kPutRecord || bin.pos + sizeof(size_type) > end)
+					return false;
+				auto value_size = IO<size_type>::Read(bin);
+				if (bin.pos + (uint64_t)value_size > end)
+					return false;
+				on_put(key, ValueIO::Read(bin, value_size), value_size);
+				return true;
+			};
+			// Replays a record body that passed its CRC, returns false if it is malformed
+			const auto replay = [&read_entry, &put_func, &delete_func, &batch_func](const char *body,
+			                                                                      size_type size) -> bool {
+				IBufStream bin{body, 0};
+				if (size == 0)
+					return false;
+				if ((byte)body[0] != kBatchRecord)
+					return read_entry(
+					           bin, size,
+					           [&put_func](Key key, Value &&value, size_type) { put_func(key, std::move(value)); },
+					           delete_func) &&
+					       bin.pos == size;
+				bin.pos = sizeof(byte);
+				if (bin.pos + sizeof(size_type) > size)
+					return false;
+				auto count = IO<size_type>::Read(bin);
+				WriteBatch batch;
+				for (size_type i = 0; i < count; ++i)
+					if (!read_entry(
+					        bin, size,
+					        [&batch](Key key, Value &&value, size_type value_size) {
+						        batch.put(key, std::move(value), value_size);
+					        },
+					        [&batch](Key key) { batch.Delete(key); }))
+						return false;
+				if (bin.pos != size)
+					return false;
+				batch_func(std::move(batch));
+				return true;
+			};
+
+			constexpr size_type kHeaderSize = sizeof(size_type) + sizeof(uint32_t);
+			std::string data;
+			bool intact = true;
+			for (const auto &log : list_logs()) {
+				if (log.first >= m_seq)
+					continue;
+				log_paths.push_back(log.second);
+				if (!intact)
+					continue;
+
+				data.resize(std::filesystem::file_size(log.second));
+				std::ifstream{log.second, std::ios::binary}.read(data.data(), (std::streamsize)data.size());
+				for (uint64_t pos = 0; intact && pos < data.size();) {
+					IBufStream bin{data.data(), (size_type)pos};
+					if (pos + kHeaderSize > data.size()) {
+						intact = false;
+						break;
+					}
+					auto size = IO<size_type>::Read(bin);
+					auto crc = IO<uint32_t>::Read(bin);
+					pos += kHeaderSize;
+					intact = pos + size <= data.size() && CRC32C(data.data() + pos, size) == crc &&
+					         replay(data.data() + pos, size);
+					pos += size;
+				}
+			}
+		}
+		return log_paths;
+	}
+
+	inline uint64_t AppendPut(Key key, const Value &value, size_type value_size) {
+		if constexpr (kEnabled) {
+			std::scoped_lock lock{m_mutex};
+			m_body.clear();
+			StringOStream sout{&m_body};
+			write_entry(sout, key, &value, value_size);
+			return append_record();
+		} else
+			return 0;
+	}
+	inline uint64_t AppendDelete(Key key) {
+		if constexpr (kEnabled) {
+			std::scoped_lock lock{m_mutex};
+			m_body.clear();
+			StringOStream sout{&m_body};
+			write_entry(sout, key, nullptr, 0);
+			return append_record();
+		} else
+			return 0;
+	}
+
+	inline uint64_t AppendBatch(const WriteBatch &batch) {
+		if constexpr (kEnabled) {
+			std::scoped_lock lock{m_mutex};
+			m_body.clear();
+			StringOStream sout{&m_body};
+			IO<byte>::Write(sout, kBatchRecord);
+			IO<size_type>::Write(sout, batch.GetCount());
+			for (const auto &entry : batch.m_entries)
+				write_entry(sout, entry.key, entry.opt_value.has_value() ? &entry.opt_value.value() : nullptr,
+				            entry.value_size);
+			return append_record();
+		} else
+			return 0;
+	}
+
+	// Wait until the records appended so far are synced. The first writer to wait leads the group: with group commit
+	// it waits up to group_commit_us for more records, or until group_commit_bytes are pending, then syncs them all
+	// at once. kSync syncs right away. Throws std::filesystem::filesystem_error if the log failed.
+	inline void SyncGroup() {
+		if constexpr (kConfig.mode == KVLogMode::kSync || kConfig.mode == KVLogMode::kGroupCommit) {
+			std::unique_lock lock{m_mutex};
+			uint64_t target_count = m_appended_count;
+			while (!m_error && m_synced_count < target_count) {
+				if (m_syncing) {
+					m_sync_cv.wait(lock);
+					continue;
+				}
+				m_syncing = true;
+				if constexpr (kConfig.mode == KVLogMode::kGroupCommit)
+					m_sync_cv.wait_for(lock, std::chrono::microseconds{kConfig.group_commit_us},
+					                   [this]() { return m_pending_bytes >= kConfig.group_commit_bytes; });
+				uint64_t group_count = m_appended_count;
+				m_pending_bytes = 0;
+				std::FILE *file = m_file;
+				// Writers keep appending while the group is synced, close() waits for it
+				lock.unlock();
+				std::error_code error = SyncFile(file) ? std::error_code{} : GetLastFileError();
+				lock.lock();
+				if (error && !m_error)
+					m_error = error;
+				else if (!error)
+					m_synced_count = std::max(m_synced_count, group_count);
+				m_syncing = false;
+				m_sync_cv.notify_all();
+			}
+			throw_if_error();
+		}
+	}
+
+	// Switch to a new log file, returns the path of the previous one
+	inline std::filesystem::path Rotate() {
+		if constexpr (kEnabled) {
+			std::unique_lock lock{m_mutex};
+			close(lock);
+			std::filesystem::path prev_path = get_log_path(m_seq++);
+			open();
+			return prev_path;
+		} else
+			return {};
+	}
+	// Close the log file, returns its path
+	inline std::filesystem::path Close() {
+		if constexpr (kEnabled) {
+			std::unique_lock lock{m_mutex};
+			close(lock);
+			return get_log_path(m_seq);
+		} else
+			return {};
+	}
+	// Reopen from the first log file after the directory is cleared
+	inline void Reset() {
+		if constexpr (kEnabled) {
+			std::unique_lock lock{m_mutex};
+			close(lock);
+			m_seq = 0;
+			m_error.clear();
+			open();
+		}
+	}
+
+	inline static void Remove(const std::filesystem::path &log_path) {
+		if (!log_path.empty())
+			std::filesystem::remove(log_path);
+	}
+};
+
+} // namespace lsm::detail
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <optional>
+#include <type_traits>
 #include <vector>
 
 #include "buf_stream.hpp"
 #include "kv_filesystem.hpp"
 #include "kv_table.hpp"
+#include "kv_write_batch.hpp"
 
 namespace lsm {
 
@@ -35,70 +38,165 @@ private:
 	using ValueIO = typename Trait::ValueIO;
 	using KeyOffset = KVKeyOffset<Key>;
 
-	constexpr static size_type kMaxFileSize = Trait::kMaxFileSize;
-	constexpr static size_type kInitialFileSize = sizeof(time_type) + Trait::KeyFile::GetHeaderSize();
+	// Concurrent containers take writers in parallel, the size is then reserved up front and returned if the write is
+	// dropped
+	constexpr static bool kConcurrent = Trait::Container::kConcurrent;
+	constexpr static size_type kValueLogThreshold = Trait::kValueLogThreshold;
+	static_assert(kValueLogThreshold == 0 || kValueLogThreshold >= sizeof(KVValuePointer));
 
+	KVTableSizeBound<Key, Trait> m_bound;
 	typename Trait::Container m_container;
-	size_type m_file_size{kInitialFileSize};
-
-	template <typename Table, typename PopFunc>
-	inline std::optional<Table> put(Key key, Value &&value, PopFunc &&pop_func) {
-		size_type value_size = ValueIO::GetSize(value);
-		if (m_container.Replace(key, [this, &value, value_size](KVMemValue<Value> *p_sl_value, bool exists) -> bool {
-			    size_type new_size = m_file_size;
-			    if (exists) {
-				    new_size -= p_sl_value->GetSize();
-				    new_size += value_size;
-			    } else
-				    new_size += sizeof(KeyOffset) + value_size;
-			    if (m_file_size != kInitialFileSize && new_size > kMaxFileSize)
-				    return false;
-			    *p_sl_value = {std::move(value), value_size};
-			    m_file_size = new_size;
-			    return true;
-		    }))
-			return std::nullopt;
-
-		Table ret = pop_func();
-		Reset();
-		m_file_size += sizeof(KeyOffset) + value_size;
-		m_container.Insert(key, {std::move(value), value_size});
-		return std::optional<Table>{std::move(ret)};
+	std::conditional_t<kConcurrent, std::atomic<size_type>, size_type> m_file_size;
+
+	inline bool reserve(size_type size) {
+		size_type file_size = m_file_size.load(std::memory_order_relaxed);
+		do {
+			if (file_size != m_bound.initial_file_size && file_size + size > m_bound.max_file_size)
+				return false;
+		} while (!m_file_size.compare_exchange_weak(file_size, file_size + size, std::memory_order_relaxed));
+		return true;
+	}
+	// A write numbered below the newest one of its key lost the race to the log and is dropped. The entries a write
+	// hides stay in the container until Reset(), so they stay charged to the table.
+	inline void insert(Key key, KVMemValue<Value> &&sl_value, uint64_t seq) {
+		size_type size = sl_value.GetSize();
+		const KVMemValue<Value> *p_hidden;
+		if (!m_container.Insert(key, std::move(sl_value), seq, &p_hidden))
+			m_file_size.fetch_sub(m_bound.key_size + size, std::memory_order_relaxed);
+	}
+	// Bytes of the live values, m_file_size of a concurrent container also counts the hidden ones
+	inline size_type get_value_size() const {
+		if constexpr (kConcurrent) {
+			size_type value_size = 0;
+			m_container.ForEach(
+			    [&value_size](const Key &, const KVMemValue<Value> &sl_value) { value_size += sl_value.GetSize(); });
+			return value_size;
+		} else
+			return m_file_size - m_bound.initial_file_size - m_container.GetSize() * m_bound.key_size;
 	}
 
-	template <typename Table, typename PopFunc> inline std::optional<Table> del(Key key, PopFunc &&pop_func) {
-		if (m_container.Replace(key, [this](KVMemValue<Value> *p_sl_value, bool exists) -> bool {
-			    size_type new_size = m_file_size;
-			    if (exists)
-				    new_size -= p_sl_value->GetSize();
-			    else
-				    new_size += sizeof(KeyOffset);
-			    if (m_file_size != kInitialFileSize && new_size > kMaxFileSize)
-				    return false;
-			    *p_sl_value = {};
-			    m_file_size = new_size;
-			    return true;
-		    }))
-			return std::nullopt;
-
-		Table ret = pop_func();
-		Reset();
-		m_file_size += sizeof(KeyOffset);
-		m_container.Insert(key, {});
-		return std::optional<Table>{std::move(ret)};
+	inline bool try_put(Key key, Value &&value, size_type value_size, uint64_t seq) {
+		if constexpr (kConcurrent) {
+			if (!reserve(m_bound.key_size + value_size))
+				return false;
+			insert(key, {std::move(value), value_size}, seq);
+			return true;
+		} else {
+			return m_container.Replace(key, [this, &value, value_size](KVMemValue<Value> *p_sl_value,
+			                                                           bool exists) -> bool {
+				size_type new_size = m_file_size;
+				if (exists) {
+					new_size -= p_sl_value->GetSize();
+					new_size += value_size;
+				} else
+					new_size += m_bound.key_size + value_size;
+				if (m_file_size != m_bound.initial_file_size && new_size > m_bound.max_file_size)
+					return false;
+				*p_sl_value = {std::move(value), value_size};
+				m_file_size = new_size;
+				return true;
+			});
+		}
+	}
+	inline bool try_del(Key key, uint64_t seq) {
+		if constexpr (kConcurrent) {
+			if (!reserve(m_bound.key_size))
+				return false;
+			insert(key, {}, seq);
+			return true;
+		} else {
+			return m_container.Replace(key, [this](KVMemValue<Value> *p_sl_value, bool exists) -> bool {
+				size_type new_size = m_file_size;
+				if (exists)
+					new_size -= p_sl_value->GetSize();
+				else
+					new_size += m_bound.key_size;
+				if (m_file_size != m_bound.initial_file_size && new_size > m_bound.max_file_size)
+					return false;
+				*p_sl_value = {};
+				m_file_size = new_size;
+				return true;
+			});
+		}
+	}
+
+	// Apply the batch, its size must already be accounted for as if every key were new
+	inline void write(KVWriteBatch<Key, Value, Trait> &&batch, uint64_t seq) {
+		for (auto &entry : batch.m_entries) {
+			KVMemValue<Value> sl_value = entry.opt_value.has_value()
+			                                 ? KVMemValue<Value>{std::move(entry.opt_value.value()), entry.value_size}
+			                                 : KVMemValue<Value>{};
+			if constexpr (kConcurrent)
+				insert(entry.key, std::move(sl_value), seq);
+			else
+				m_container.Replace(entry.key, [this, &sl_value](KVMemValue<Value> *p_sl_value, bool exists) -> bool {
+					if (exists)
+						m_file_size -= m_bound.key_size + p_sl_value->GetSize();
+					*p_sl_value = std::move(sl_value);
+					return true;
+				});
+		}
+	}
+
+	// Values are stored with a tag, the ones of at least kValueLogThreshold bytes go to the value log
+	inline BufferTable pop_separated_buffer(FileSystem *p_file_system) const {
+		auto key_buffer = std::unique_ptr<KVKeyOffset<Key>[]>(new KVKeyOffset<Key>[m_container.GetSize()]);
+
+		size_type value_size = 0;
+		m_container.ForEach([&value_size](const Key &, const KVMemValue<Value> &sl_value) {
+			if (!sl_value.IsDeleted())
+				value_size += sl_value.GetSize() >= kValueLogThreshold ? kValuePointerStoredSize : 1 + sl_value.GetSize();
+		});
+		auto value_buffer = std::unique_ptr<byte[]>(new byte[value_size]);
+		OBufStream value_stream{(char *)value_buffer.get(), 0};
+
+		KVValueLog<Trait> &value_log = p_file_system->GetValueLog();
+		KVValueLogRefs<Trait> log_refs;
+		std::vector<char> data;
+		uint64_t log_bytes = 0;
+		size_type key_id = 0;
+		m_container.ForEach([&](const Key &key, const KVMemValue<Value> &sl_value) {
+			key_buffer[key_id++] = KeyOffset{key, value_stream.pos, sl_value.IsDeleted()};
+			if (sl_value.IsDeleted())
+				return;
+			if (sl_value.GetSize() < kValueLogThreshold) {
+				KVValueTag tag = KVValueTag::kInline;
+				value_stream.write((const char *)&tag, 1);
+				ValueIO::Write(value_stream, sl_value.GetValue());
+				return;
+			}
+			data.resize(sl_value.GetSize());
+			OBufStream data_stream{data.data(), 0};
+			ValueIO::Write(data_stream, sl_value.GetValue());
+			KVValuePointer pointer = value_log.Append(key, data.data(), sl_value.GetSize(), &log_refs);
+			log_bytes += sl_value.GetSize();
+			KVValueTag tag = KVValueTag::kPointer;
+			value_stream.write((const char *)&tag, 1);
+			value_stream.write((const char *)&pointer, sizeof(KVValuePointer));
+		});
+		value_log.Flush();
+		p_file_system->GetRateLimiter().Request(log_bytes, KVIOPriority::kHigh);
+
+		return BufferTable{KVKeyBuffer<Key, Trait>{std::move(key_buffer), m_container.GetSize()},
+		                   KVValueBuffer<Value, Trait>{std::move(value_buffer), value_size, std::move(log_refs)}};
 	}
 
 public:
+	inline explicit KVMemContainer(const KVTableSizeBound<Key, Trait> &bound)
+	    : m_bound{bound}, m_file_size{bound.initial_file_size} {}
 	inline void Reset() {
 		m_container.Clear();
-		m_file_size = kInitialFileSize;
+		m_file_size = m_bound.initial_file_size;
 	}
-	inline BufferTable PopBuffer() {
+	inline BufferTable PopBuffer(FileSystem *p_file_system) const {
+		if constexpr (kValueLogThreshold > 0)
+			return pop_separated_buffer(p_file_system);
+
 		auto key_buffer = std::unique_ptr<KVKeyOffset<Key>[]>(new KVKeyOffset<Key>[m_container.GetSize()]);
 
-		size_type value_size = m_file_size - kInitialFileSize - m_container.GetSize() * sizeof(KeyOffset);
+		size_type value_size = get_value_size();
 		auto value_buffer = std::unique_ptr<byte[]>(new byte[value_size]);
-		OBufStream value_stream{(char *)value_buffer.get()};
+		OBufStream value_stream{(char *)value_buffer.get(), 0};
 
 		size_type key_id = 0;
 		m_container.ForEach([&key_buffer, &key_id, &value_stream](const Key &key, const KVMemValue<Value> &sl_value) {
@@ -110,10 +208,13 @@ public:
 		return BufferTable{KVKeyBuffer<Key, Trait>{std::move(key_buffer), m_container.GetSize()},
 		                   KVValueBuffer<Value, Trait>{std::move(value_buffer), value_size}};
 	}
-	inline FileTable PopFile(FileSystem *p_file_system, level_type level) {
+	inline FileTable PopFile(FileSystem *p_file_system, level_type level) const {
+		if constexpr (kValueLogThreshold > 0)
+			return FileTable{p_file_system, pop_separated_buffer(p_file_system), level};
+
 		auto key_buffer = std::unique_ptr<KVKeyOffset<Key>[]>(new KVKeyOffset<Key>[m_container.GetSize()]);
 
-		size_type value_size = m_file_size - kInitialFileSize - m_container.GetSize() * sizeof(KeyOffset);
+		size_type value_size = get_value_size();
 
 		{
 			size_type key_id = 0, value_pos = 0;
@@ -123,8 +224,8 @@ public:
 			});
 		}
 
-		const auto value_writer = [this](std::ofstream &stream) {
-			m_container.ForEach([&stream](const Key &key, const KVMemValue<Value> &sl_value) {
+		const auto value_writer = [this](auto &stream) {
+			m_container.ForEach([&stream](const Key &, const KVMemValue<Value> &sl_value) {
 				if (!sl_value.IsDeleted())
 					ValueIO::Write(stream, sl_value.GetValue());
 			});
@@ -133,24 +234,27 @@ public:
 		return FileTable{p_file_system, KVKeyBuffer<Key, Trait>{std::move(key_buffer), m_container.GetSize()},
 		                 value_writer, value_size, level};
 	}
-	inline std::optional<BufferTable> Put(Key key, Value &&value) {
-		return put<BufferTable>(key, std::move(value), [this]() { return PopBuffer(); });
-	}
-	inline std::optional<BufferTable> Put(Key key, const Value &value) { return Put(key, Value{value}); }
-
-	inline std::optional<FileTable> Put(Key key, Value &&value, FileSystem *p_file_system, level_type level) {
-		return put<FileTable>(key, std::move(value),
-		                      [this, p_file_system, level]() { return PopFile(p_file_system, level); });
-	}
-	inline std::optional<FileTable> Put(Key key, const Value &value, FileSystem *p_file_system, level_type level) {
-		return Put(key, Value(value), p_file_system, level);
-	}
-
-	inline std::optional<BufferTable> Delete(Key key) {
-		return del<BufferTable>(key, [this]() { return PopBuffer(); });
+	// Insert without popping, returns false (leaving value untouched) if the table is full.
+	// A concurrent container keeps the write with the highest sequence number seq of each key.
+	inline bool TryPut(Key key, Value &&value) { return try_put(key, std::move(value), ValueIO::GetSize(value), 0); }
+	inline bool TryPut(Key key, Value &&value, size_type value_size, uint64_t seq = 0) {
+		return try_put(key, std::move(value), value_size, seq);
 	}
-	inline std::optional<FileTable> Delete(Key key, FileSystem *p_file_system, level_type level) {
-		return del<FileTable>(key, [this, p_file_system, level]() { return PopFile(p_file_system, level); });
+	inline bool TryDelete(Key key, uint64_t seq = 0) { return try_del(key, seq); }
+	// Apply the whole batch or nothing, the check assumes every key is new so the batch never spans two tables.
+	// A batch larger than a table still goes into an empty one.
+	inline bool TryWrite(KVWriteBatch<Key, Value, Trait> &&batch, uint64_t seq = 0) {
+		size_type batch_size = batch.GetCount() * m_bound.key_size + batch.m_value_size;
+		if constexpr (kConcurrent) {
+			if (!reserve(batch_size))
+				return false;
+		} else {
+			if (m_file_size != m_bound.initial_file_size && m_file_size + batch_size > m_bound.max_file_size)
+				return false;
+			m_file_size += batch_size;
+		}
+		write(std::move(batch), seq);
+		return true;
 	}
 
 	template <typename Func> inline void Scan(Key min_key, Key max_key, Func &&func) const {
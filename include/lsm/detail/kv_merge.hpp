@@ -2,109 +2,217 @@
 
 #include "kv_appender.hpp"
 #include "kv_mem.hpp"
+#include "kv_pipeline.hpp"
 #include "kv_table.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <thread>
 #include <vector>
 
 namespace lsm::detail {
 
-template <typename Key, typename Value, typename Trait, level_type Level> class KVMerger {
+template <typename Key, typename Value, typename Trait> class KVMerger {
 private:
 	using FileSystem = KVFileSystem<Trait>;
 
 	using KeyCompare = typename Trait::Compare;
 
 	using FileTable = KVFileTable<Key, Value, Trait>;
+	using FileTablePtr = std::shared_ptr<const FileTable>;
 	using BufferTable = KVBufferTable<Key, Value, Trait>;
+	using Appender = KVAppender<Key, Value, Trait>;
+
+	constexpr static size_type kSubcompactions = Trait::kSubcompactions;
+	static_assert(kSubcompactions > 0);
+	// Input tables per key range below which a compaction is not split further
+	constexpr static size_type kMinSubcompactionTables = 4;
+	constexpr static bool kReadAhead = Trait::kCompactionReadAhead > 0;
+	constexpr static size_type kCompactionBufferSize = Trait::kCompactionBufferSize;
 
 	FileSystem *m_p_file_system;
+	const KVTableSizeBound<Key, Trait> *m_p_size_bound;
+	level_type m_level;
+	// Deleted keys are dropped when merging into the last level
+	bool m_is_last_level;
 
-	std::vector<FileTable> m_file_tables;
+	std::vector<FileTablePtr> m_file_tables;
 	std::vector<BufferTable> m_buffer_tables;
-	KVTableIteratorHeap<typename FileTable::Iterator> m_file_it_heap;
-	KVTableIteratorHeap<typename BufferTable::Iterator> m_buffer_it_heap;
-
-	KVAppender<Key, Value, Trait> m_mem_appender;
-
-	std::vector<BufferTable> m_result_tables;
-
-	size_type m_remain_file_count{};
-
-	template <bool Delete, typename Iterator, typename PostFileTableFunc>
-	inline void push_iterator(const Iterator &it, PostFileTableFunc &&post_file_table_func) {
-		if (m_remain_file_count == 0) {
-			std::optional<BufferTable> opt_buffer = m_mem_appender.template Append<Delete>(it);
-			if (opt_buffer.has_value())
-				m_result_tables.push_back(std::move(opt_buffer.value()));
-		} else {
-			std::optional<FileTable> opt_file = m_mem_appender.template Append<Delete>(it, m_p_file_system, Level);
-			if (opt_file.has_value()) {
-				post_file_table_func(std::move(opt_file.value()));
-				--m_remain_file_count;
-			}
+	KVValueLogRefs<Trait> m_input_log_refs;
+
+	// Tables merged from one key range, both in key order
+	struct RangeResult {
+		std::vector<FileTable> file_tables;
+		std::vector<BufferTable> buffer_tables;
+	};
+
+	// Split keys cut the input into ranges holding about the same number of table starts
+	inline std::vector<Key> get_split_keys() const {
+		size_type range_count =
+		    std::min(kSubcompactions, (size_type)(m_file_tables.size() + m_buffer_tables.size()) / kMinSubcompactionTables);
+		if (range_count <= 1)
+			return {};
+		std::vector<Key> min_keys;
+		for (const auto &table : m_file_tables)
+			min_keys.push_back(table->GetMinKey());
+		for (const auto &table : m_buffer_tables)
+			min_keys.push_back(table.GetMinKey());
+		std::sort(min_keys.begin(), min_keys.end(), KeyCompare{});
+
+		std::vector<Key> split_keys;
+		for (size_type i = 1; i < range_count; ++i) {
+			Key key = min_keys[i * min_keys.size() / range_count];
+			if (KeyCompare{}(min_keys.front(), key) && (split_keys.empty() || KeyCompare{}(split_keys.back(), key)))
+				split_keys.push_back(key);
 		}
+		return split_keys;
 	}
 
-public:
-	inline KVMerger(std::vector<FileTable> &&file_tables, std::vector<BufferTable> &&buffer_tables,
-	                FileSystem *p_file_system)
-	    : m_p_file_system{p_file_system}, m_file_tables{std::move(file_tables)},
-	      m_buffer_tables{std::move(buffer_tables)} {
+	// Iterators of the tables overlapping [min_key, max_key), where an empty bound is open
+	template <typename Table>
+	inline static void get_iterators(const Table &table, const std::optional<Key> &opt_min_key,
+	                                 const std::optional<Key> &opt_max_key, std::vector<typename Table::Iterator> &its) {
+		if (opt_max_key.has_value() && !KeyCompare{}(table.GetMinKey(), opt_max_key.value()))
+			return;
+		if (!opt_min_key.has_value())
+			its.push_back(table.GetBegin());
+		else if (!KeyCompare{}(table.GetMaxKey(), opt_min_key.value()))
+			its.push_back(table.GetLowerBound(opt_min_key.value()));
+	}
 
-		m_result_tables.reserve(m_file_tables.size() + m_buffer_tables.size());
+	// Take size out of the budget if it is large enough
+	inline static bool claim(std::atomic<size_type> *p_budget, size_type size) {
+		size_type budget = p_budget->load(std::memory_order_relaxed);
+		while (budget >= size && !p_budget->compare_exchange_weak(budget, budget - size, std::memory_order_relaxed))
+			;
+		return budget >= size;
+	}
 
-		std::vector<typename FileTable::Iterator> file_it_vec;
-		file_it_vec.reserve(file_it_vec.size());
+	// Merge the keys in [min_key, max_key). A table becomes a file while the file budget lasts, then a buffer while the
+	// buffer budget lasts, then a file again.
+	template <bool Delete>
+	inline RangeResult merge_range(const std::optional<Key> &opt_min_key, const std::optional<Key> &opt_max_key,
+	                               std::atomic<size_type> *p_file_budget,
+	                               std::atomic<size_type> *p_buffer_budget) const {
+		std::vector<typename FileTable::Iterator> file_its;
 		for (const auto &table : m_file_tables)
-			file_it_vec.push_back(table.GetBegin());
-		m_file_it_heap = KVTableIteratorHeap<typename FileTable::Iterator>{std::move(file_it_vec)};
-
-		std::vector<typename BufferTable::Iterator> buffer_it_vec;
-		buffer_it_vec.reserve(buffer_it_vec.size());
+			get_iterators(*table, opt_min_key, opt_max_key, file_its);
+		std::vector<typename BufferTable::Iterator> buffer_its;
 		for (const auto &table : m_buffer_tables)
-			buffer_it_vec.push_back(table.GetBegin());
-		m_buffer_it_heap = KVTableIteratorHeap<typename BufferTable::Iterator>{std::move(buffer_it_vec)};
-	}
-	template <typename PostFileTableFunc>
-	inline std::vector<BufferTable> Run(size_type file_count, PostFileTableFunc &&post_file_table_func) {
-		static constexpr level_type kLevels = sizeof(Trait::kLevelConfigs) / sizeof(KVLevelConfig);
-		static constexpr bool kDelete = Level == kLevels;
-
-		m_remain_file_count = file_count;
-
-		while (!m_file_it_heap.IsEmpty() && !m_buffer_it_heap.IsEmpty()) {
-			auto file_it = m_file_it_heap.GetTop();
-			auto buffer_it = m_buffer_it_heap.GetTop();
-			if (KeyCompare{}(file_it.GetKey(), buffer_it.GetKey())) {
-				push_iterator<kDelete>(file_it, post_file_table_func);
-				m_file_it_heap.Proceed();
-			} else if (KeyCompare{}(buffer_it.GetKey(), file_it.GetKey())) {
-				push_iterator<kDelete>(buffer_it, post_file_table_func);
-				m_buffer_it_heap.Proceed();
+			get_iterators(table, opt_min_key, opt_max_key, buffer_its);
+		// Values of the file tables are read ahead, merged tables are written behind
+		std::optional<KVReadAhead<Key, Value, Trait>> opt_read_ahead;
+		if constexpr (kReadAhead)
+			opt_read_ahead.emplace(file_its, opt_max_key, &m_p_file_system->GetRateLimiter());
+		KVTableIteratorTree<typename FileTable::Iterator> file_it_tree{std::move(file_its)};
+		KVTableIteratorTree<typename BufferTable::Iterator> buffer_it_tree{std::move(buffer_its)};
+		KVTableWriter<Key, Value, Trait> writer{m_p_file_system, m_level};
+
+		RangeResult result;
+		Appender appender{*m_p_size_bound, &m_input_log_refs};
+		// Values read in place are paid for once their table is cut
+		uint64_t read_bytes = 0;
+		const auto pop = [this, p_file_budget, p_buffer_budget, &writer, &result, &read_bytes](Appender &appender) {
+			if constexpr (!kReadAhead) {
+				m_p_file_system->GetRateLimiter().Request(read_bytes, KVIOPriority::kLow);
+				read_bytes = 0;
+			}
+			if (!claim(p_file_budget, 1) && claim(p_buffer_budget, appender.GetBufferSize()))
+				result.buffer_tables.push_back(appender.PopBuffer());
+			else
+				writer.Push(appender.PopBuffer());
+		};
+		const auto push_file = [&appender, &pop, &opt_read_ahead, &file_it_tree, &read_bytes]() {
+			if constexpr (kReadAhead)
+				appender.template Append<Delete>(
+				    opt_read_ahead->GetIterator(file_it_tree.GetTopIndex(), file_it_tree.GetTop()), pop);
+			else {
+				read_bytes += file_it_tree.GetTop().GetValueSize();
+				appender.template Append<Delete>(file_it_tree.GetTop(), pop);
+			}
+		};
+		const auto push_buffer = [&appender, &pop, &buffer_it_tree]() {
+			appender.template Append<Delete>(buffer_it_tree.GetTop(), pop);
+		};
+		const auto is_valid = [&opt_max_key](const auto &it_tree) {
+			return !it_tree.IsEmpty() &&
+			       (!opt_max_key.has_value() || KeyCompare{}(it_tree.GetTop().GetKey(), opt_max_key.value()));
+		};
+
+		while (is_valid(file_it_tree) && is_valid(buffer_it_tree)) {
+			Key file_key = file_it_tree.GetTop().GetKey(), buffer_key = buffer_it_tree.GetTop().GetKey();
+			if (KeyCompare{}(file_key, buffer_key)) {
+				push_file();
+				file_it_tree.Proceed();
+			} else if (KeyCompare{}(buffer_key, file_key)) {
+				push_buffer();
+				buffer_it_tree.Proceed();
 			} else {
-				push_iterator<kDelete>(buffer_it, post_file_table_func);
-				m_file_it_heap.Proceed();
-				m_buffer_it_heap.Proceed();
+				push_buffer();
+				file_it_tree.Proceed();
+				buffer_it_tree.Proceed();
 			}
 		}
-		while (!m_file_it_heap.IsEmpty()) {
-			push_iterator<kDelete>(m_file_it_heap.GetTop(), post_file_table_func);
-			m_file_it_heap.Proceed();
-		}
-		while (!m_buffer_it_heap.IsEmpty()) {
-			push_iterator<kDelete>(m_buffer_it_heap.GetTop(), post_file_table_func);
-			m_buffer_it_heap.Proceed();
+		for (; is_valid(file_it_tree); file_it_tree.Proceed())
+			push_file();
+		for (; is_valid(buffer_it_tree); buffer_it_tree.Proceed())
+			push_buffer();
+
+		if (!appender.IsEmpty())
+			pop(appender);
+		result.file_tables = writer.Finish();
+		return result;
+	}
+
+public:
+	inline KVMerger(std::vector<FileTablePtr> &&file_tables, std::vector<BufferTable> &&buffer_tables,
+	                FileSystem *p_file_system, const KVTableSizeBound<Key, Trait> *p_size_bound, level_type level)
+	    : m_p_file_system{p_file_system}, m_p_size_bound{p_size_bound}, m_level{level},
+	      m_is_last_level{level == p_file_system->GetLevelCount()}, m_file_tables{std::move(file_tables)},
+	      m_buffer_tables{std::move(buffer_tables)} {
+		if constexpr (Trait::kValueLogThreshold > 0) {
+			for (const auto &table : m_file_tables)
+				m_input_log_refs.Add(table->GetValueLogRefs());
+			for (const auto &table : m_buffer_tables)
+				m_input_log_refs.Add(table.GetValueLogRefs());
 		}
+	}
 
-		if (!m_mem_appender.IsEmpty()) {
-			if (m_remain_file_count == 0)
-				m_result_tables.push_back(m_mem_appender.PopBuffer());
-			else
-				post_file_table_func(m_mem_appender.PopFile(m_p_file_system, Level));
+	// Large merges are split into key ranges merged on their own threads. Up to file_count of the merged tables become
+	// files and are passed to post_file_table_func in key order, the rest are returned as buffers. Buffers take at most
+	// kCompactionBufferSize bytes, the tables beyond become files as well.
+	template <typename PostFileTableFunc>
+	inline std::vector<BufferTable> Run(size_type file_count, PostFileTableFunc &&post_file_table_func) {
+		std::atomic<size_type> file_budget{file_count}, buffer_budget{kCompactionBufferSize};
+		const auto merge = [this, &file_budget, &buffer_budget](const std::optional<Key> &opt_min_key,
+		                                                        const std::optional<Key> &opt_max_key) {
+			return m_is_last_level ? merge_range<true>(opt_min_key, opt_max_key, &file_budget, &buffer_budget)
+			                       : merge_range<false>(opt_min_key, opt_max_key, &file_budget, &buffer_budget);
+		};
+		std::vector<Key> split_keys = get_split_keys();
+		std::vector<RangeResult> results(split_keys.size() + 1);
+		{
+			std::vector<std::thread> threads;
+			for (size_type i = 1; i <= split_keys.size(); ++i)
+				threads.emplace_back([i, &merge, &split_keys, &results]() {
+					results[i] = merge(split_keys[i - 1],
+					                   i < split_keys.size() ? std::optional<Key>{split_keys[i]} : std::nullopt);
+				});
+			results[0] = merge(std::nullopt, split_keys.empty() ? std::nullopt : std::optional<Key>{split_keys[0]});
+			for (auto &thread : threads)
+				thread.join();
 		}
 
-		return std::move(m_result_tables);
+		std::vector<BufferTable> buffer_tables;
+		for (auto &result : results) {
+			for (auto &table : result.file_tables)
+				post_file_table_func(std::move(table));
+			std::move(result.buffer_tables.begin(), result.buffer_tables.end(), std::back_inserter(buffer_tables));
+		}
+		return buffer_tables;
 	}
 };
 
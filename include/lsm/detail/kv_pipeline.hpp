@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "kv_filesystem.hpp"
+#include "kv_table.hpp"
+
+namespace lsm::detail {
+
+// Reads the values of merge inputs on its own thread. Each input has two chunks, the merge copies values out of one
+// while the other is filled with the data that follows.
+template <typename Key, typename Value, typename Trait> class KVReadAhead {
+private:
+	using FileTable = KVFileTable<Key, Value, Trait>;
+	using TableIterator = typename FileTable::Iterator;
+
+	constexpr static size_type kChunkSize = Trait::kCompactionReadAhead;
+
+	struct Chunk {
+		std::unique_ptr<char[]> data;
+		size_type begin{}, size{};
+		bool ready{};
+	};
+	struct Input {
+		const FileTable *p_table{};
+		size_type end{};
+		Chunk chunks[2];
+		size_type cur{};
+	};
+	// Never resized once the reader runs
+	std::vector<Input> m_inputs;
+	KVRateLimiter *m_p_rate_limiter;
+
+	std::mutex m_mutex;
+	std::condition_variable m_job_cv, m_ready_cv;
+	std::deque<std::pair<const Input *, Chunk *>> m_jobs;
+	bool m_stop{false};
+	std::thread m_thread;
+
+	// Called with m_mutex held
+	inline void schedule(Input &input, Chunk &chunk, size_type begin) {
+		chunk.begin = begin;
+		chunk.size = begin < input.end ? std::min(kChunkSize, input.end - begin) : 0;
+		chunk.ready = chunk.size == 0;
+		if (!chunk.ready) {
+			m_jobs.emplace_back(&input, &chunk);
+			m_job_cv.notify_one();
+		}
+	}
+	inline void wait_ready(const Chunk &chunk) {
+		std::unique_lock lock{m_mutex};
+		m_ready_cv.wait(lock, [&chunk]() { return chunk.ready; });
+	}
+	inline void reader_loop() {
+		std::unique_lock lock{m_mutex};
+		while (true) {
+			m_job_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+			if (m_stop)
+				return;
+			auto [p_input, p_chunk] = m_jobs.front();
+			m_jobs.pop_front();
+			lock.unlock();
+			m_p_rate_limiter->Request(p_chunk->size, KVIOPriority::kLow);
+			p_input->p_table->CopyValueData(p_chunk->begin, p_chunk->size, p_chunk->data.get(), KVCacheAccess::kScan);
+			lock.lock();
+			p_chunk->ready = true;
+			m_ready_cv.notify_all();
+		}
+	}
+
+	// Reads of an input never go backwards
+	inline void copy_value_data(size_type id, size_type begin, size_type len, char *dst) {
+		Input &input = m_inputs[id];
+		while (len) {
+			Chunk &chunk = input.chunks[input.cur];
+			if (begin < chunk.begin || chunk.size == 0) {
+				m_p_rate_limiter->Request(len, KVIOPriority::kLow);
+				input.p_table->CopyValueData(begin, len, dst, KVCacheAccess::kScan);
+				return;
+			}
+			wait_ready(chunk);
+			if (begin >= chunk.begin + chunk.size) {
+				// Refill the chunk with the data after the other one and move on
+				const Chunk &next = input.chunks[input.cur ^ 1];
+				std::scoped_lock lock{m_mutex};
+				schedule(input, chunk, next.begin + next.size);
+				input.cur ^= 1;
+				continue;
+			}
+			size_type copy_len = std::min(len, chunk.begin + chunk.size - begin);
+			const char *src = chunk.data.get() + (begin - chunk.begin);
+			std::copy(src, src + copy_len, dst);
+			begin += copy_len;
+			dst += copy_len;
+			len -= copy_len;
+		}
+	}
+
+public:
+	// Table iterator whose values come from the read-ahead chunks
+	class Iterator {
+	private:
+		const TableIterator *m_p_it;
+		KVReadAhead *m_p_read_ahead;
+		size_type m_id, m_value_size;
+
+	public:
+		inline Iterator(const TableIterator *p_it, KVReadAhead *p_read_ahead, size_type id)
+		    : m_p_it{p_it}, m_p_read_ahead{p_read_ahead}, m_id{id}, m_value_size{p_it->GetValueSize()} {}
+		inline Key GetKey() const { return m_p_it->GetKey(); }
+		inline bool IsKeyDeleted() const { return m_p_it->IsKeyDeleted(); }
+		inline size_type GetValueSize() const { return m_value_size; }
+		// The chunks are read as a scan
+		inline void CopyValueData(char *dst, KVCacheAccess) const {
+			m_p_read_ahead->copy_value_data(m_id, m_p_it->GetValueOffset(), m_value_size, dst);
+		}
+	};
+
+	// Input i starts at the value of its[i] and ends before the value of the first key not less than the max key, a
+	// subcompaction reads no further than its own range
+	inline KVReadAhead(const std::vector<TableIterator> &its, const std::optional<Key> &opt_max_key,
+	                   KVRateLimiter *p_rate_limiter)
+	    : m_inputs(its.size()), m_p_rate_limiter{p_rate_limiter} {
+		for (size_type i = 0; i < its.size(); ++i) {
+			Input &input = m_inputs[i];
+			input.p_table = &its[i].GetTable();
+			input.end = input.p_table->GetValueDataSize();
+			if (opt_max_key.has_value()) {
+				auto end_it = input.p_table->GetLowerBound(opt_max_key.value());
+				if (end_it.IsValid())
+					input.end = end_it.GetValueOffset();
+			}
+			size_type begin = its[i].IsValid() ? its[i].GetValueOffset() : input.end;
+			for (Chunk &chunk : input.chunks)
+				chunk.data = std::unique_ptr<char[]>(new char[std::min(kChunkSize, input.end - begin)]);
+			schedule(input, input.chunks[0], begin);
+			schedule(input, input.chunks[1], begin + input.chunks[0].size);
+		}
+		if (!m_jobs.empty())
+			m_thread = std::thread{&KVReadAhead::reader_loop, this};
+	}
+	inline KVReadAhead(const KVReadAhead &) = delete;
+	inline KVReadAhead &operator=(const KVReadAhead &) = delete;
+	inline ~KVReadAhead() {
+		if (!m_thread.joinable())
+			return;
+		{
+			std::scoped_lock lock{m_mutex};
+			m_stop = true;
+		}
+		m_job_cv.notify_one();
+		m_thread.join();
+	}
+
+	inline Iterator GetIterator(size_type id, const TableIterator &it) { return Iterator{&it, this, id}; }
+};
+
+// Writes merged tables out on its own thread while the merge fills the next one, at most one table waits in line
+template <typename Key, typename Value, typename Trait> class KVTableWriter {
+private:
+	using FileSystem = KVFileSystem<Trait>;
+	using FileTable = KVFileTable<Key, Value, Trait>;
+	using BufferTable = KVBufferTable<Key, Value, Trait>;
+
+	FileSystem *m_p_file_system;
+	level_type m_level;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::optional<BufferTable> m_opt_pending;
+	bool m_finish{false};
+	std::vector<FileTable> m_file_tables;
+	std::thread m_thread;
+
+	inline void writer_loop() {
+		std::unique_lock lock{m_mutex};
+		while (true) {
+			m_cv.wait(lock, [this]() { return m_finish || m_opt_pending.has_value(); });
+			if (!m_opt_pending.has_value())
+				return;
+			BufferTable buffer_table = std::move(m_opt_pending.value());
+			m_opt_pending.reset();
+			m_cv.notify_all();
+			lock.unlock();
+			FileTable file_table{m_p_file_system, std::move(buffer_table), m_level};
+			lock.lock();
+			m_file_tables.push_back(std::move(file_table));
+		}
+	}
+
+public:
+	inline KVTableWriter(FileSystem *p_file_system, level_type level) : m_p_file_system{p_file_system}, m_level{level} {}
+	inline KVTableWriter(const KVTableWriter &) = delete;
+	inline KVTableWriter &operator=(const KVTableWriter &) = delete;
+	inline ~KVTableWriter() { Finish(); }
+
+	inline void Push(BufferTable &&buffer_table) {
+		if (!m_thread.joinable())
+			m_thread = std::thread{&KVTableWriter::writer_loop, this};
+		std::unique_lock lock{m_mutex};
+		m_cv.wait(lock, [this]() { return !m_opt_pending.has_value(); });
+		m_opt_pending = std::move(buffer_table);
+		m_cv.notify_all();
+	}
+	// Wait for the writes, tables come in the order they were pushed
+	inline std::vector<FileTable> Finish() {
+		if (m_thread.joinable()) {
+			{
+				std::scoped_lock lock{m_mutex};
+				m_finish = true;
+			}
+			m_cv.notify_all();
+			m_thread.join();
+		}
+		return std::move(m_file_tables);
+	}
+};
+
+} // namespace lsm::detail
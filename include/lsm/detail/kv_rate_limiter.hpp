@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+
+#include "../type.hpp"
+
+namespace lsm::detail {
+
+// Flushes run ahead of compactions, which only take tokens while no flush is waiting
+enum class KVIOPriority { kHigh, kLow };
+
+// Token bucket shared by the background I/O. A request larger than the tokens at hand leaves the bucket in debt, the
+// requests after it wait until the debt is paid back. Tokens are refilled by the time of Clock, waits still take real
+// time.
+template <typename Clock> class KVBasicRateLimiter {
+private:
+	// Tokens saved up while idle are capped at this much time of the rate
+	constexpr static double kBurstSeconds = 0.1;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	// 0 lets every request through
+	std::atomic<uint64_t> m_bytes_per_sec;
+	double m_tokens{};
+	typename Clock::time_point m_last_refill{Clock::now()};
+	size_type m_high_waiters{};
+	std::atomic<uint64_t> m_requested_bytes{0};
+
+	// Called with m_mutex held
+	inline void refill() {
+		auto now = Clock::now();
+		double seconds = std::chrono::duration<double>(now - m_last_refill).count();
+		double rate = (double)m_bytes_per_sec.load(std::memory_order_relaxed);
+		m_tokens = std::min(m_tokens + seconds * rate, rate * kBurstSeconds);
+		m_last_refill = now;
+	}
+
+public:
+	inline explicit KVBasicRateLimiter(uint64_t bytes_per_sec) : m_bytes_per_sec{bytes_per_sec} {}
+
+	inline uint64_t GetBytesPerSecond() const { return m_bytes_per_sec.load(std::memory_order_relaxed); }
+	// Bytes let through so far, limited or not
+	inline uint64_t GetRequestedBytes() const { return m_requested_bytes.load(std::memory_order_relaxed); }
+	inline void SetBytesPerSecond(uint64_t bytes_per_sec) {
+		{
+			std::scoped_lock lock{m_mutex};
+			refill();
+			m_bytes_per_sec.store(bytes_per_sec, std::memory_order_relaxed);
+		}
+		m_cv.notify_all();
+	}
+
+	// Block until bytes may be read or written
+	inline void Request(uint64_t bytes, KVIOPriority priority) {
+		m_requested_bytes.fetch_add(bytes, std::memory_order_relaxed);
+		if (m_bytes_per_sec.load(std::memory_order_relaxed) == 0)
+			return;
+		bool high = priority == KVIOPriority::kHigh;
+		std::unique_lock lock{m_mutex};
+		if (high)
+			++m_high_waiters;
+		while (true) {
+			refill();
+			uint64_t rate = m_bytes_per_sec.load(std::memory_order_relaxed);
+			if (rate == 0)
+				break;
+			if (m_tokens > 0 && (high || m_high_waiters == 0)) {
+				m_tokens -= (double)bytes;
+				break;
+			}
+			// Wake up once the debt is paid, or earlier when the rate changes or a flush is done
+			double seconds = std::max(-m_tokens, 1.0) / (double)rate;
+			m_cv.wait_for(lock, std::chrono::duration<double>(seconds));
+		}
+		if (high && --m_high_waiters == 0) {
+			lock.unlock();
+			m_cv.notify_all();
+		}
+	}
+};
+
+using KVRateLimiter = KVBasicRateLimiter<std::chrono::steady_clock>;
+
+// File written by a flush or compaction, each chunk is paid for once it is written so that a table does not go out
+// in one burst
+class KVRateLimitedOStream {
+private:
+	constexpr static size_type kChunkSize = 64 * 1024;
+
+	std::ofstream m_fout;
+	KVRateLimiter *m_p_rate_limiter;
+	KVIOPriority m_priority;
+	// Bytes written since the last request
+	size_type m_chunk_size{};
+
+public:
+	inline KVRateLimitedOStream(const std::filesystem::path &file_path, KVRateLimiter *p_rate_limiter,
+	                            KVIOPriority priority)
+	    : m_fout{file_path, std::ios::binary}, m_p_rate_limiter{p_rate_limiter}, m_priority{priority} {}
+	inline KVRateLimitedOStream(const KVRateLimitedOStream &) = delete;
+	inline KVRateLimitedOStream &operator=(const KVRateLimitedOStream &) = delete;
+	inline ~KVRateLimitedOStream() { Close(); }
+
+	inline void write(const char *src, size_type len) {
+		while (len) {
+			size_type count = std::min(len, kChunkSize - m_chunk_size);
+			m_fout.write(src, count);
+			src += count, len -= count;
+			if ((m_chunk_size += count) == kChunkSize) {
+				m_p_rate_limiter->Request(kChunkSize, m_priority);
+				m_chunk_size = 0;
+			}
+		}
+	}
+	// Pay for the last chunk and close the file
+	inline void Close() {
+		if (m_chunk_size) {
+			m_p_rate_limiter->Request(m_chunk_size, m_priority);
+			m_chunk_size = 0;
+		}
+		if (m_fout.is_open())
+			m_fout.close();
+	}
+};
+
+} // namespace lsm::detail
@@ -4,6 +4,7 @@
 #include <filesystem>
 #include <fstream>
 #include <utility>
+#include <vector>
 
 #include "kv_filesystem.hpp"
 #include "kv_key_table.hpp"
@@ -16,63 +17,108 @@ private:
 	using KeyIndex = typename decltype(((const Table *)0)->m_keys)::Index;
 	const Table *m_p_table;
 	KeyIndex m_key_index;
+	// Loaded once per position, tables themselves hold no per-reader state
+	KVKeyOffset<Key> m_key_offset;
 
 	inline KVKeyOffset<Key> get_key_offset(KeyIndex index) const { return m_p_table->m_keys.GetKeyOffset(index); }
-	inline KVKeyOffset<Key> cur_key_offset() const { return get_key_offset(m_key_index); }
+	inline void load_key_offset() {
+		if (IsValid())
+			m_key_offset = get_key_offset(m_key_index);
+	}
 
 public:
-	inline KVTableIterator(const Table *p_table, KeyIndex key_index) : m_p_table{p_table}, m_key_index{key_index} {}
+	inline KVTableIterator(const Table *p_table, KeyIndex key_index) : m_p_table{p_table}, m_key_index{key_index} {
+		load_key_offset();
+	}
 	inline const Table &GetTable() const { return *m_p_table; }
 	inline bool IsValid() const { return m_key_index != m_p_table->m_keys.GetEnd(); }
-	inline bool IsKeyDeleted() const { return cur_key_offset().IsDeleted(); }
-	inline Key GetKey() const { return cur_key_offset().GetKey(); }
+	inline bool IsKeyDeleted() const { return m_key_offset.IsDeleted(); }
+	inline Key GetKey() const { return m_key_offset.GetKey(); }
+	inline size_type GetValueOffset() const { return m_key_offset.GetOffset(); }
 	inline size_type GetValueSize() const {
 		KeyIndex nxt = m_key_index + 1;
 		return (nxt == m_p_table->m_keys.GetEnd() ? m_p_table->m_values.GetSize() : get_key_offset(nxt).GetOffset()) -
-		       cur_key_offset().GetOffset();
+		       m_key_offset.GetOffset();
 	}
-	inline Value ReadValue() const { return m_p_table->m_values.Read(cur_key_offset().GetOffset(), GetValueSize()); }
-	inline void CopyValueData(char *dst) const {
-		m_p_table->m_values.CopyData(cur_key_offset().GetOffset(), GetValueSize(), dst);
+	inline Value ReadValue(KVCacheAccess access) const {
+		return m_p_table->m_values.Read(m_key_offset.GetOffset(), GetValueSize(), access);
+	}
+	inline void CopyValueData(char *dst, KVCacheAccess access) const {
+		m_p_table->m_values.CopyData(m_key_offset.GetOffset(), GetValueSize(), dst, access);
+	}
+	inline void Proceed() {
+		++m_key_index;
+		load_key_offset();
 	}
-	inline void Proceed() { ++m_key_index; }
 };
 
-template <typename Iterator> class KVTableIteratorHeap;
+template <typename Iterator> class KVTableIteratorTree;
+// Loser tree over table iterators, a step replays one leaf-to-root path with about log2(k) comparisons.
+// Inner nodes keep the loser of their match and m_tree[0] the overall winner, exhausted iterators lose every match.
 template <typename Key, typename Value, typename Trait, typename Table>
-class KVTableIteratorHeap<KVTableIterator<Key, Value, Trait, Table>> {
+class KVTableIteratorTree<KVTableIterator<Key, Value, Trait, Table>> {
 private:
 	using Iterator = KVTableIterator<Key, Value, Trait, Table>;
 	using KeyCompare = typename Trait::Compare;
-	struct Compare {
-		inline bool operator()(const Iterator &l, const Iterator &r) const {
-			return KeyCompare{}(l.GetKey(), r.GetKey()) ||
-			       (!KeyCompare{}(r.GetKey(), l.GetKey()) && l.GetTable().IsPrior(r.GetTable()));
+
+	std::vector<Iterator> m_its;
+	std::vector<size_type> m_tree;
+	size_type m_valid_count{};
+
+	inline bool is_before(size_type l, size_type r) const {
+		const Iterator &l_it = m_its[l], &r_it = m_its[r];
+		if (!r_it.IsValid())
+			return l_it.IsValid();
+		if (!l_it.IsValid())
+			return false;
+		return KeyCompare{}(l_it.GetKey(), r_it.GetKey()) ||
+		       (!KeyCompare{}(r_it.GetKey(), l_it.GetKey()) && l_it.GetTable().IsPrior(r_it.GetTable()));
+	}
+	inline void build() {
+		size_type k = m_its.size();
+		m_tree.assign(k, 0);
+		m_valid_count = std::count_if(m_its.begin(), m_its.end(), [](const Iterator &it) { return it.IsValid(); });
+		if (k == 0)
+			return;
+		// Winners of the matches, leaf i sits at node k + i
+		std::vector<size_type> winners(k);
+		const auto get_winner = [k, &winners](size_type node) { return node >= k ? node - k : winners[node]; };
+		for (size_type node = k - 1; node; --node) {
+			size_type l = get_winner(node << 1), r = get_winner(node << 1 | 1);
+			bool l_wins = is_before(l, r) || !is_before(r, l);
+			winners[node] = l_wins ? l : r;
+			m_tree[node] = l_wins ? r : l;
 		}
-	};
-	struct RevCompare {
-		inline bool operator()(const Iterator &l, const Iterator &r) const { return Compare{}(r, l); }
-	};
-	std::vector<Iterator> m_vec;
+		m_tree[0] = k == 1 ? 0 : winners[1];
+	}
+	inline void replay(size_type leaf) {
+		size_type winner = leaf;
+		for (size_type node = (m_its.size() + leaf) >> 1; node; node >>= 1)
+			if (is_before(m_tree[node], winner))
+				std::swap(m_tree[node], winner);
+		m_tree[0] = winner;
+	}
 
 public:
-	inline KVTableIteratorHeap() = default;
-	inline explicit KVTableIteratorHeap(std::vector<Iterator> &&vec) : m_vec{std::move(vec)} {
-		std::make_heap(m_vec.begin(), m_vec.end(), RevCompare{});
-	}
-	inline bool IsEmpty() const { return m_vec.empty(); }
-	inline Iterator GetTop() const { return m_vec.front(); }
-	inline void Proceed() {
-		Key key = m_vec.front().GetKey();
+	inline KVTableIteratorTree() = default;
+	inline explicit KVTableIteratorTree(std::vector<Iterator> &&vec) : m_its{std::move(vec)} { build(); }
+	inline bool IsEmpty() const { return m_valid_count == 0; }
+	inline const Iterator &GetTop() const { return m_its[m_tree[0]]; }
+	// Position of the top iterator in the input vector
+	inline size_type GetTopIndex() const { return m_tree[0]; }
+	// Move past the top key in every iterator. An iterator running out is passed to next_func(leaf, p_it), which may
+	// replace it with one continuing after its last key and returns whether it did, the leaf then keeps its slot.
+	template <typename NextFunc> inline void Proceed(NextFunc &&next_func) {
+		Key key = GetTop().GetKey();
 		do {
-			std::pop_heap(m_vec.begin(), m_vec.end(), RevCompare{});
-			m_vec.back().Proceed();
-			if (m_vec.back().IsValid())
-				std::push_heap(m_vec.begin(), m_vec.end(), RevCompare{});
-			else
-				m_vec.pop_back();
-		} while (!m_vec.empty() && !KeyCompare{}(key, m_vec.front().GetKey()));
+			size_type leaf = m_tree[0];
+			m_its[leaf].Proceed();
+			if (!m_its[leaf].IsValid() && !next_func(leaf, &m_its[leaf]))
+				--m_valid_count;
+			replay(leaf);
+		} while (m_valid_count && !KeyCompare{}(key, GetTop().GetKey()));
 	}
+	inline void Proceed() { Proceed([](size_type, Iterator *) { return false; }); }
 };
 
 template <typename DerivedTable, typename Key, typename Value, typename Trait, typename KeyTable, typename ValueTable>
@@ -92,10 +138,31 @@ public:
 	inline Key GetMinKey() const { return m_keys.GetMin(); }
 	inline Key GetMaxKey() const { return m_keys.GetMax(); }
 	inline size_type GetKeyCount() const { return m_keys.GetCount(); }
+	inline size_type GetValueDataSize() const { return m_values.GetSize(); }
+	inline void CopyValueData(size_type begin, size_type len, char *dst, KVCacheAccess access) const {
+		m_values.CopyData(begin, len, dst, access);
+	}
+	inline const KVValueLogRefs<Trait> &GetValueLogRefs() const { return m_values.GetLogRefs(); }
 	inline Iterator Find(Key key) const { return Iterator{derived_this(), m_keys.Find(key)}; }
 	inline Iterator GetBegin() const { return Iterator{derived_this(), m_keys.GetBegin()}; }
 	inline Iterator GetLowerBound(Key key) const { return Iterator{derived_this(), m_keys.GetLowerBound(key)}; }
 
+	// Read the values of iterators in key order, values less than a block apart are read at once
+	template <typename Func> inline void ReadValues(const std::vector<Iterator> &its, Func &&func) const {
+		std::vector<char> buffer;
+		for (size_type i = 0, j; i < its.size(); i = j) {
+			size_type begin = its[i].GetValueOffset(), end = begin + its[i].GetValueSize();
+			for (j = i + 1; j < its.size() && its[j].GetValueOffset() <= end + Trait::kBlockSize; ++j)
+				end = std::max(end, its[j].GetValueOffset() + its[j].GetValueSize());
+			buffer.resize(end - begin);
+			m_values.CopyData(begin, end - begin, buffer.data(), KVCacheAccess::kPoint);
+			for (size_type k = i; k < j; ++k) {
+				IBufStream bin{buffer.data(), its[k].GetValueOffset() - begin};
+				func(k, m_values.ReadFrom(bin, its[k].GetValueSize()));
+			}
+		}
+	}
+
 	inline bool IsOverlap(Key min_key, Key max_key) const {
 		using Compare = typename Trait::Compare;
 		return !(Compare{}(GetMaxKey(), min_key) || Compare{}(max_key, GetMinKey()));
@@ -133,36 +200,115 @@ private:
 
 	time_type m_time_stamp{};
 	level_type m_level{};
+	// Only touched by the last owner, see MarkObsolete()
+	mutable bool m_obsolete{false};
+
+	inline KVValueLogRefs<Trait> read_log_refs(FileSystem *p_file_system) const {
+		KVValueLogRefs<Trait> log_refs;
+		std::unique_ptr<char[]> data{new char[this->m_values.GetSize()]};
+		this->m_values.CopyData(0, this->m_values.GetSize(), data.get(), KVCacheAccess::kScan);
+		for (auto it = this->GetBegin(); it.IsValid(); it.Proceed()) {
+			auto opt_pointer = get_value_pointer(data.get() + it.GetValueOffset(), it.GetValueSize());
+			if (!opt_pointer.has_value())
+				continue;
+			if (auto file = p_file_system->GetValueLog().GetFile(opt_pointer.value().file_id))
+				log_refs.Add(file);
+		}
+		return log_refs;
+	}
 
 public:
-	// inline time_type GetTimeStamp() const { return m_time_stamp; }
+	inline KVFileTable(KVFileTable &&) = default;
+	inline KVFileTable &operator=(KVFileTable &&) = default;
+	inline ~KVFileTable() {
+		if (m_obsolete)
+			std::filesystem::remove(GetFilePath());
+	}
+	// Remove the file once the table is destroyed, must be called before the caller drops its reference
+	inline void MarkObsolete() const { m_obsolete = true; }
+
+	inline time_type GetTimeStamp() const { return m_time_stamp; }
 	inline bool IsPrior(const KVFileTable &r) const {
 		return m_level < r.m_level || (m_level == r.m_level && m_time_stamp > r.m_time_stamp);
 	}
 	template <typename ValueWriter>
 	inline KVFileTable(FileSystem *p_file_system, KVKeyBuffer<Key, Trait> &&key_buffer, ValueWriter &&value_writer,
 	                   size_type value_size, level_type level)
-	    : m_level{level}, m_time_stamp{p_file_system->GetTimeStamp()} {
-		p_file_system->CreateFile(level, [this, p_file_system, value_size, &key_buffer,
-		                                  &value_writer](std::ofstream &fout, const std::filesystem::path &file_path) {
-			this->m_keys = KeyFile{fout, std::move(key_buffer), p_file_system, file_path};
-			value_writer(fout);
-			this->m_values =
-			    ValueFile{p_file_system, file_path, (size_type)sizeof(time_type) + this->m_keys.GetSize(), value_size};
+	    : m_level{level} {
+		std::shared_ptr<typename FileSystem::FileReader> file;
+		m_time_stamp = p_file_system->CreateFile(level, [this, p_file_system, level, value_size, &key_buffer,
+		                                                 &value_writer, &file](KVRateLimitedOStream &fout,
+		                                                                       const std::filesystem::path &file_path) {
+			file = p_file_system->NewFileReader(file_path);
+			this->m_keys = KeyFile{fout, std::move(key_buffer), file, p_file_system->GetBloomBitsPerKey(level)};
+			size_type value_offset = (size_type)sizeof(time_type) + this->m_keys.GetSize();
+			if constexpr (Trait::kBlockCompression) {
+				KVValueBlockWriter<Trait> block_writer{fout, p_file_system->GetCompression(level)};
+				value_writer(block_writer);
+				this->m_values = ValueFile{file, value_offset, block_writer.Finish(), p_file_system->GetBlockCache(),
+				                           p_file_system->NewBlockCacheID()};
+			} else {
+				value_writer(fout);
+				this->m_values = ValueFile{file, value_offset, value_size};
+			}
 		});
+		file->Open();
 	}
-	inline explicit KVFileTable(FileSystem *p_file_system, const std::filesystem::path &file_path, level_type level)
+	// The value log files the table points into are found by reading its values, unless they are given
+	inline explicit KVFileTable(FileSystem *p_file_system, const std::filesystem::path &file_path, level_type level,
+	                            const KVValueLogRefs<Trait> *p_log_refs = nullptr)
 	    : m_level{level} {
-		std::ifstream &fin = p_file_system->GetFileStream(file_path, 0);
-		m_time_stamp = IO<time_type>::Read(fin);
-		this->m_keys = KeyFile{fin, p_file_system, file_path};
+		auto file = p_file_system->NewFileReader(file_path);
+		file->Open();
+		{
+			auto fin = file->GetStream(0);
+			m_time_stamp = IO<time_type>::Read(fin);
+			this->m_keys = KeyFile{fin, file};
+		}
 		size_type value_offset = this->m_keys.GetSize() + (size_type)sizeof(time_type);
-		size_type value_size = std::filesystem::file_size(file_path) - value_offset;
-		this->m_values = ValueFile{p_file_system, file_path, value_offset, value_size};
+		size_type file_size = std::filesystem::file_size(file_path);
+		if constexpr (Trait::kBlockCompression) {
+			auto block_index = KVValueBlockIndex::Read(*file, file_size);
+			this->m_values = ValueFile{std::move(file), value_offset, std::move(block_index),
+			                           p_file_system->GetBlockCache(), p_file_system->NewBlockCacheID()};
+		} else
+			this->m_values = ValueFile{std::move(file), value_offset, file_size - value_offset};
+		if constexpr (Trait::kValueLogThreshold > 0)
+			this->m_values.SetLogRefs(p_log_refs ? KVValueLogRefs<Trait>{*p_log_refs} : read_log_refs(p_file_system));
 
 		p_file_system->MaintainTimeStamp(m_time_stamp);
 	}
+	// Write a merged buffer out as a table of the level
+	inline KVFileTable(FileSystem *p_file_system, KVBufferTable<Key, Value, Trait> &&buffer_table, level_type level)
+	    : KVFileTable(
+	          p_file_system, std::move(buffer_table.m_keys),
+	          [&buffer_table](auto &fout) {
+		          fout.write((const char *)buffer_table.m_values.GetData(), buffer_table.m_values.GetSize());
+	          },
+	          buffer_table.m_values.GetSize(), level) {
+		this->m_values.SetLogRefs(KVValueLogRefs<Trait>{buffer_table.m_values.GetLogRefs()});
+	}
+	// Same table in another level, the old one is expected to be marked obsolete
+	inline KVFileTable(FileSystem *p_file_system, const KVFileTable &table, level_type level)
+	    : KVFileTable(p_file_system, p_file_system->LinkFile(table.GetFilePath(), level), level,
+	                  &table.GetValueLogRefs()) {}
 	inline const std::filesystem::path &GetFilePath() const { return this->m_values.GetFilePath(); }
+	inline size_type GetFileSize() const {
+		return (size_type)sizeof(time_type) + this->m_keys.GetSize() + this->m_values.GetStoredSize();
+	}
+	inline size_type GetStoredValueDataSize() const { return this->m_values.GetStoredDataSize(); }
+};
+
+// Upper bounds used to cut tables before their level is known, filters may grow with the key count
+template <typename Key, typename Trait> struct KVTableSizeBound {
+	size_type max_file_size, initial_file_size, key_size;
+
+	inline explicit KVTableSizeBound(const KVOptions &options)
+	    : max_file_size{options.max_file_size},
+	      initial_file_size{(size_type)sizeof(time_type) + Trait::KeyFile::GetBaseHeaderSize(options)},
+	      key_size{(size_type)sizeof(KVKeyOffset<Key>) + Trait::KeyFile::GetHeaderSizePerKey(options) +
+	               // The tag of a value that may be separated
+	               (Trait::kValueLogThreshold > 0 ? 1 : 0)} {}
 };
 
 } // namespace lsm::detail
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../kv_level.hpp"
+#include "../type.hpp"
+#include "kv_rate_limiter.hpp"
+
+namespace lsm::detail {
+
+// Compressor of the default trait, every block is stored as it is
+struct KVNoCompressor {
+	// Returns false if the codec is not supported
+	inline static bool Compress(KVCompression, const char *, size_type, std::string *) { return false; }
+	inline static void Uncompress(KVCompression, const char *, size_type, char *, size_type) {}
+};
+
+#pragma pack(push, 1)
+struct KVValueBlock {
+	// End of the stored block in the value section
+	size_type end;
+	KVCompression compression;
+};
+#pragma pack(pop)
+
+// Value sections of tables with block compression end with [blocks][raw size][block count]. Block i holds the raw
+// bytes [i * kBlockSize, (i + 1) * kBlockSize), a section written without a codec has no blocks and is stored as is.
+struct KVValueBlockIndex {
+	constexpr static size_type kTrailerSize = 2 * sizeof(size_type);
+
+	std::vector<KVValueBlock> blocks;
+	size_type raw_size{};
+
+	inline bool IsCompressed() const { return !blocks.empty(); }
+	// Bytes of the blocks on disk
+	inline size_type GetStoredDataSize() const { return blocks.empty() ? raw_size : blocks.back().end; }
+	// Bytes of the section on disk
+	inline size_type GetStoredSize() const {
+		return GetStoredDataSize() + (size_type)(blocks.size() * sizeof(KVValueBlock)) + kTrailerSize;
+	}
+	inline size_type GetStoredBegin(size_type block) const { return block ? blocks[block - 1].end : 0; }
+
+	// Read the index of a section ending at section_end
+	template <typename Reader> inline static KVValueBlockIndex Read(const Reader &reader, size_type section_end) {
+		KVValueBlockIndex index;
+		size_type trailer[2];
+		reader.Read(section_end - kTrailerSize, (char *)trailer, kTrailerSize);
+		index.raw_size = trailer[0];
+		index.blocks.resize(trailer[1]);
+		size_type blocks_size = trailer[1] * sizeof(KVValueBlock);
+		reader.Read(section_end - kTrailerSize - blocks_size, (char *)index.blocks.data(), blocks_size);
+		return index;
+	}
+};
+
+// Writes the value section of a table, compressing it block by block when a codec is given
+template <typename Trait> class KVValueBlockWriter {
+private:
+	using Compressor = typename Trait::Compressor;
+	constexpr static size_type kBlockSize = Trait::kBlockSize;
+	// A block is only stored compressed if that saves an eighth of it
+	constexpr static size_type kMinSavingDivisor = 8;
+
+	KVRateLimitedOStream *m_p_fout;
+	KVCompression m_compression;
+	KVValueBlockIndex m_index;
+	std::unique_ptr<char[]> m_block;
+	size_type m_block_size{};
+	std::string m_compressed;
+
+	inline void write_block() {
+		size_type stored_end = m_index.GetStoredBegin(m_index.blocks.size());
+		if (Compressor::Compress(m_compression, m_block.get(), m_block_size, &m_compressed) &&
+		    m_compressed.size() < m_block_size - m_block_size / kMinSavingDivisor) {
+			m_p_fout->write(m_compressed.data(), m_compressed.size());
+			m_index.blocks.push_back({stored_end + (size_type)m_compressed.size(), m_compression});
+		} else {
+			m_p_fout->write(m_block.get(), m_block_size);
+			m_index.blocks.push_back({stored_end + m_block_size, KVCompression::kNone});
+		}
+		m_block_size = 0;
+	}
+
+public:
+	inline KVValueBlockWriter(KVRateLimitedOStream &fout, KVCompression compression)
+	    : m_p_fout{&fout}, m_compression{compression} {
+		if (m_compression != KVCompression::kNone)
+			m_block = std::unique_ptr<char[]>(new char[kBlockSize]);
+	}
+
+	inline KVValueBlockWriter &write(const char *src, size_type len) {
+		m_index.raw_size += len;
+		if (m_compression == KVCompression::kNone) {
+			m_p_fout->write(src, len);
+			return *this;
+		}
+		while (len) {
+			size_type count = std::min(len, kBlockSize - m_block_size);
+			std::copy(src, src + count, m_block.get() + m_block_size);
+			m_block_size += count;
+			src += count, len -= count;
+			if (m_block_size == kBlockSize)
+				write_block();
+		}
+		return *this;
+	}
+	// Write the last block and the index
+	inline KVValueBlockIndex Finish() {
+		if (m_block_size)
+			write_block();
+		m_p_fout->write((const char *)m_index.blocks.data(), m_index.blocks.size() * sizeof(KVValueBlock));
+		size_type trailer[2] = {m_index.raw_size, (size_type)m_index.blocks.size()};
+		m_p_fout->write((const char *)trailer, KVValueBlockIndex::kTrailerSize);
+		return std::move(m_index);
+	}
+};
+
+} // namespace lsm::detail
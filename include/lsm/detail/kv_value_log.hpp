@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "../kv_log.hpp"
+#include "../type.hpp"
+#include "buf_stream.hpp"
+#include "sys_io.hpp"
+
+namespace lsm::detail {
+
+#pragma pack(push, 1)
+struct KVValuePointer {
+	uint64_t file_id;
+	size_type offset, size;
+
+	inline bool operator==(const KVValuePointer &r) const {
+		return file_id == r.file_id && offset == r.offset && size == r.size;
+	}
+};
+#pragma pack(pop)
+
+// Stored values lead with a tag once they may be separated, a separated value is stored as its pointer
+enum class KVValueTag : byte { kInline, kPointer };
+constexpr size_type kValuePointerStoredSize = 1 + sizeof(KVValuePointer);
+
+inline std::optional<KVValuePointer> get_value_pointer(const char *data, size_type size) {
+	if (size != kValuePointerStoredSize || (KVValueTag)data[0] != KVValueTag::kPointer)
+		return std::nullopt;
+	KVValuePointer pointer;
+	std::copy(data + 1, data + kValuePointerStoredSize, (char *)&pointer);
+	return pointer;
+}
+
+// An append-only file of (key, size, value) records, removed once the last table pointing into it is gone
+class KVValueLogFile {
+private:
+	uint64_t m_id;
+	std::filesystem::path m_file_path;
+	FileDescriptor m_fd;
+	// Only touched by the last owner, see MarkObsolete()
+	mutable bool m_obsolete{false};
+
+public:
+	inline KVValueLogFile(uint64_t id, std::filesystem::path file_path)
+	    : m_id{id}, m_file_path{std::move(file_path)}, m_fd{OpenReadOnlyFile(m_file_path)} {}
+	inline KVValueLogFile(const KVValueLogFile &) = delete;
+	inline KVValueLogFile &operator=(const KVValueLogFile &) = delete;
+	inline ~KVValueLogFile() {
+		if (m_fd != kInvalidFileDescriptor)
+			CloseFile(m_fd);
+		if (m_obsolete)
+			std::filesystem::remove(m_file_path);
+	}
+	inline void MarkObsolete() const { m_obsolete = true; }
+
+	inline uint64_t GetID() const { return m_id; }
+	inline const std::filesystem::path &GetFilePath() const { return m_file_path; }
+	// Bytes on disk, values appended since the last KVValueLog::Flush() may be missing. Throws
+	// std::filesystem::filesystem_error on failure.
+	inline uint64_t GetSize() const {
+		uint64_t size;
+		if (!GetFileSize(m_fd, &size))
+			throw std::filesystem::filesystem_error{"fstat", m_file_path, GetLastFileError()};
+		return size;
+	}
+	// Throws std::filesystem::filesystem_error on a failed or short read
+	inline void Read(uint64_t pos, char *dst, size_type len) const {
+		if (!PReadFile(m_fd, dst, len, pos))
+			throw std::filesystem::filesystem_error{"pread", m_file_path, GetLastFileError()};
+	}
+
+	// Visit the records in order, a torn record at the end is ignored
+	template <typename Key, typename Func> inline void ForEachRecord(Func &&func) const {
+		constexpr size_type kHeaderSize = sizeof(Key) + sizeof(size_type);
+		uint64_t file_size = std::filesystem::file_size(m_file_path);
+		std::unique_ptr<char[]> data{new char[file_size]};
+		Read(0, data.get(), file_size);
+		for (uint64_t pos = 0; pos + kHeaderSize <= file_size;) {
+			Key key;
+			size_type size;
+			std::copy(data.get() + pos, data.get() + pos + sizeof(Key), (char *)&key);
+			std::copy(data.get() + pos + sizeof(Key), data.get() + pos + kHeaderSize, (char *)&size);
+			pos += kHeaderSize;
+			if (pos + size > file_size)
+				return;
+			func(key, KVValuePointer{m_id, (size_type)pos, size}, data.get() + pos);
+			pos += size;
+		}
+	}
+};
+using KVValueLogFilePtr = std::shared_ptr<const KVValueLogFile>;
+
+// Value log files a table points into, sorted by id. Reading a stored value goes through them.
+template <typename Trait> class KVValueLogRefs {
+private:
+	constexpr static bool kEnabled = Trait::kValueLogThreshold > 0;
+
+	std::vector<KVValueLogFilePtr> m_files;
+
+	inline auto lower_bound(uint64_t id) const {
+		return std::lower_bound(m_files.begin(), m_files.end(), id,
+		                        [](const KVValueLogFilePtr &file, uint64_t id) { return file->GetID() < id; });
+	}
+
+public:
+	inline const std::vector<KVValueLogFilePtr> &GetFiles() const { return m_files; }
+	inline const KVValueLogFilePtr *Find(uint64_t id) const {
+		auto it = lower_bound(id);
+		return it != m_files.end() && (*it)->GetID() == id ? &*it : nullptr;
+	}
+	inline void Add(const KVValueLogFilePtr &file) {
+		if (!m_files.empty() && m_files.back()->GetID() == file->GetID())
+			return;
+		auto it = lower_bound(file->GetID());
+		if (it == m_files.end() || (*it)->GetID() != file->GetID())
+			m_files.insert(it, file);
+	}
+	inline void Add(const KVValueLogRefs &refs) {
+		for (const auto &file : refs.m_files)
+			Add(file);
+	}
+	// Reference the file of a stored value if it is a pointer, the file is looked up in from
+	inline void AddStored(const char *data, size_type size, const KVValueLogRefs &from) {
+		auto opt_pointer = get_value_pointer(data, size);
+		if (!opt_pointer.has_value() ||
+		    (!m_files.empty() && m_files.back()->GetID() == opt_pointer.value().file_id))
+			return;
+		if (const KVValueLogFilePtr *p_file = from.Find(opt_pointer.value().file_id))
+			Add(*p_file);
+	}
+
+	template <typename Value, typename Stream> inline Value Read(Stream &istr, size_type len) const {
+		using ValueIO = typename Trait::ValueIO;
+		if constexpr (!kEnabled)
+			return ValueIO::Read(istr, len);
+		else {
+			KVValueTag tag;
+			istr.read((char *)&tag, 1);
+			if (tag == KVValueTag::kInline)
+				return ValueIO::Read(istr, len - 1);
+			KVValuePointer pointer;
+			istr.read((char *)&pointer, sizeof(KVValuePointer));
+			// A pointer into a file the table does not reference, or past its end, is corrupt
+			const KVValueLogFilePtr *p_file = Find(pointer.file_id);
+			if (!p_file)
+				throw std::filesystem::filesystem_error{
+				    "value log file " + std::to_string(pointer.file_id) + " not referenced",
+				    std::make_error_code(std::errc::no_such_file_or_directory)};
+			if ((uint64_t)pointer.offset + pointer.size > (*p_file)->GetSize())
+				throw std::filesystem::filesystem_error{"value pointer past the end", (*p_file)->GetFilePath(),
+				                                        std::make_error_code(std::errc::invalid_argument)};
+			std::unique_ptr<char[]> data{new char[pointer.size]};
+			(*p_file)->Read(pointer.offset, data.get(), pointer.size);
+			IBufStream bin{data.get(), 0};
+			return ValueIO::Read(bin, pointer.size);
+		}
+	}
+};
+
+// Values separated from the tables are appended to the newest log file, a file is sealed once it reaches
+// kValueLogFileSize. Sealed files are collected by KV::CollectValueLog().
+template <typename Trait> class KVValueLog {
+private:
+	constexpr static bool kEnabled = Trait::kValueLogThreshold > 0;
+	constexpr static size_type kFileSize = Trait::kValueLogFileSize;
+	// Values must be durable before the tables pointing at them
+	constexpr static bool kSyncFiles =
+	    Trait::kLogConfig.mode == KVLogMode::kGroupCommit || Trait::kLogConfig.mode == KVLogMode::kSync;
+
+	std::filesystem::path m_directory;
+	mutable std::mutex m_mutex;
+	std::map<uint64_t, KVValueLogFilePtr> m_files;
+	std::ofstream m_fout;
+	KVValueLogFilePtr m_active_file;
+	uint64_t m_active_size{}, m_next_id{};
+	// Id of the file picked last, none at first
+	uint64_t m_collect_cursor{std::numeric_limits<uint64_t>::max()};
+	std::atomic<uint64_t> m_sealed_count{0};
+
+	inline std::filesystem::path get_file_path(uint64_t id) const {
+		return m_directory / (std::to_string(id) + ".vlog");
+	}
+	// Called with m_mutex held
+	inline void open_file() {
+		if (m_active_file) {
+			m_fout.close();
+			m_sealed_count.fetch_add(1, std::memory_order_relaxed);
+		}
+		uint64_t id = m_next_id++;
+		m_fout.open(get_file_path(id), std::ios::binary);
+		m_active_file = std::make_shared<const KVValueLogFile>(id, get_file_path(id));
+		m_active_size = 0;
+		m_files[id] = m_active_file;
+	}
+
+public:
+	inline explicit KVValueLog(std::filesystem::path directory) : m_directory{std::move(directory)} {}
+	// Create the directory or load the files in it, appends always go to a new file
+	inline void Init() {
+		if constexpr (!kEnabled)
+			return;
+		if (!std::filesystem::exists(m_directory))
+			std::filesystem::create_directory(m_directory);
+		for (const auto &file : std::filesystem::directory_iterator(m_directory)) {
+			if (!file.is_regular_file() || file.path().extension() != ".vlog")
+				continue;
+			uint64_t id = std::stoull(file.path().stem().string());
+			m_files[id] = std::make_shared<const KVValueLogFile>(id, file.path());
+			m_next_id = std::max(m_next_id, id + 1);
+		}
+	}
+
+	// The file is added to refs right away, so that it cannot be removed before the table pointing into it exists
+	template <typename Key>
+	inline KVValuePointer Append(const Key &key, const char *data, size_type size, KVValueLogRefs<Trait> *p_refs) {
+		std::scoped_lock lock{m_mutex};
+		if (!m_active_file || (m_active_size && m_active_size + sizeof(Key) + sizeof(size_type) + size > kFileSize))
+			open_file();
+		m_fout.write((const char *)&key, sizeof(Key));
+		m_fout.write((const char *)&size, sizeof(size_type));
+		m_fout.write(data, size);
+		m_active_size += sizeof(Key) + sizeof(size_type);
+		KVValuePointer pointer{m_active_file->GetID(), (size_type)m_active_size, size};
+		m_active_size += size;
+		p_refs->Add(m_active_file);
+		return pointer;
+	}
+	// Make the appended values readable, and durable if the tables are
+	inline void Flush() {
+		std::scoped_lock lock{m_mutex};
+		if (!m_active_file)
+			return;
+		m_fout.flush();
+		if constexpr (kSyncFiles)
+			SyncFile(m_active_file->GetFilePath());
+	}
+	inline KVValueLogFilePtr GetFile(uint64_t id) const {
+		std::scoped_lock lock{m_mutex};
+		auto it = m_files.find(id);
+		return it == m_files.end() ? nullptr : it->second;
+	}
+	inline uint64_t GetSealedCount() const { return m_sealed_count.load(std::memory_order_relaxed); }
+
+	// The sealed file after the one picked last time, starting over from the oldest
+	inline KVValueLogFilePtr PickFileToCollect() {
+		std::scoped_lock lock{m_mutex};
+		uint64_t active_id = m_active_file ? m_active_file->GetID() : m_next_id;
+		auto it = m_files.upper_bound(m_collect_cursor);
+		if (it == m_files.end() || it->first >= active_id)
+			it = m_files.begin();
+		if (it == m_files.end() || it->first >= active_id)
+			return nullptr;
+		m_collect_cursor = it->first;
+		return it->second;
+	}
+	// The file is removed once no table points into it any more
+	inline void Retire(uint64_t id) {
+		std::scoped_lock lock{m_mutex};
+		auto it = m_files.find(id);
+		if (it == m_files.end() || it->second == m_active_file)
+			return;
+		it->second->MarkObsolete();
+		m_files.erase(it);
+	}
+
+	// Called before the directory is removed
+	inline void Reset() {
+		if constexpr (!kEnabled)
+			return;
+		std::scoped_lock lock{m_mutex};
+		if (m_active_file)
+			m_fout.close();
+		m_active_file = nullptr;
+		m_files.clear();
+		m_active_size = m_next_id = 0;
+		m_collect_cursor = std::numeric_limits<uint64_t>::max();
+	}
+};
+
+} // namespace lsm::detail
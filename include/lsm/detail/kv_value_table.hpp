@@ -1,31 +1,42 @@
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <utility>
 
 #include "../type.hpp"
 #include "buf_stream.hpp"
 #include "io.hpp"
+#include "kv_block_cache.hpp"
+#include "kv_file_reader.hpp"
+#include "kv_value_block.hpp"
+#include "kv_value_log.hpp"
 #include "lru_cache.hpp"
 
 namespace lsm::detail {
 
 template <typename Value, typename Trait> class KVValueBuffer {
 private:
-	using ValueIO = typename Trait::ValueIO;
-
 	std::unique_ptr<byte[]> m_bytes;
 	size_type m_size{};
+	KVValueLogRefs<Trait> m_log_refs;
 
 public:
 	inline KVValueBuffer() = default;
-	inline KVValueBuffer(std::unique_ptr<byte[]> &&bytes, size_type size) : m_bytes{std::move(bytes)}, m_size{size} {}
+	inline KVValueBuffer(std::unique_ptr<byte[]> &&bytes, size_type size, KVValueLogRefs<Trait> &&log_refs = {})
+	    : m_bytes{std::move(bytes)}, m_size{size}, m_log_refs{std::move(log_refs)} {}
 
 	inline size_type GetSize() const { return m_size; }
-	inline Value Read(size_type begin, size_type len) const {
+	inline const KVValueLogRefs<Trait> &GetLogRefs() const { return m_log_refs; }
+	template <typename Stream> inline Value ReadFrom(Stream &istr, size_type len) const {
+		return m_log_refs.template Read<Value>(istr, len);
+	}
+	// Buffers are in memory, the cache access is ignored
+	inline Value Read(size_type begin, size_type len, KVCacheAccess) const {
 		IBufStream bin{(const char *)m_bytes.get(), begin};
-		return ValueIO::Read(bin, len);
+		return ReadFrom(bin, len);
 	}
-	inline void CopyData(size_type begin, size_type len, char *dst) const {
+	inline void CopyData(size_type begin, size_type len, char *dst, KVCacheAccess) const {
 		auto src = (const char *)m_bytes.get();
 		std::copy(src + begin, src + begin + len, dst);
 	}
@@ -34,26 +45,105 @@ public:
 
 template <typename Value, typename Trait> class KVValueFile {
 private:
-	using FileSystem = KVFileSystem<Trait>;
-	using ValueIO = typename Trait::ValueIO;
+	using Compressor = typename Trait::Compressor;
+	constexpr static size_type kBlockSize = Trait::kBlockSize;
 
-	FileSystem *m_p_file_system{};
-	std::filesystem::path m_file_path;
+	KVFileReaderPtr<Trait> m_file;
 	size_type m_offset{}, m_size{};
+	KVValueLogRefs<Trait> m_log_refs;
+	KVValueBlockIndex m_block_index;
+	// Holds uncompressed blocks, none for uncached readers
+	KVBlockCache *m_p_block_cache{};
+	uint64_t m_block_cache_id{};
+
+	inline void read_stored(size_type begin, char *dst, size_type len) const {
+		if constexpr (kKVBlockCached<Trait>)
+			m_file->ReadUncached(m_offset + begin, dst, len);
+		else
+			m_file->Read(m_offset + begin, dst, len);
+	}
+	// Returns the raw size of the block
+	inline size_type load_block(size_type block, char *dst) const {
+		const KVValueBlock &stored = m_block_index.blocks[block];
+		size_type stored_begin = m_block_index.GetStoredBegin(block), stored_size = stored.end - stored_begin;
+		size_type raw_size = std::min(kBlockSize, m_size - block * kBlockSize);
+		if (stored.compression == KVCompression::kNone) {
+			read_stored(stored_begin, dst, raw_size);
+			return raw_size;
+		}
+		std::unique_ptr<char[]> data{new char[stored_size]};
+		read_stored(stored_begin, data.get(), stored_size);
+		Compressor::Uncompress(stored.compression, data.get(), stored_size, dst, raw_size);
+		return raw_size;
+	}
+	inline void copy_blocks(size_type begin, size_type len, char *dst, KVCacheAccess access) const {
+		std::unique_ptr<char[]> data;
+		while (len) {
+			size_type block = begin / kBlockSize, block_begin = begin % kBlockSize;
+			size_type count = std::min(len, kBlockSize - block_begin);
+			if (m_p_block_cache)
+				m_p_block_cache->Read(m_block_cache_id, block, block_begin, count, dst, access,
+				                      [this, block](char *block_data) { return load_block(block, block_data); });
+			else {
+				if (!data)
+					data = std::unique_ptr<char[]>(new char[kBlockSize]);
+				load_block(block, data.get());
+				std::copy(data.get() + block_begin, data.get() + block_begin + count, dst);
+			}
+			begin += count, dst += count, len -= count;
+		}
+	}
 
 public:
 	inline KVValueFile() = default;
-	inline KVValueFile(FileSystem *p_file_system, std::filesystem::path file_path, size_type offset, size_type size)
-	    : m_p_file_system{p_file_system}, m_file_path{std::move(file_path)}, m_offset{offset}, m_size{size} {}
+	inline KVValueFile(KVFileReaderPtr<Trait> file, size_type offset, size_type size)
+	    : m_file{std::move(file)}, m_offset{offset}, m_size{size} {}
+	inline KVValueFile(KVFileReaderPtr<Trait> file, size_type offset, KVValueBlockIndex &&block_index,
+	                   KVBlockCache *p_block_cache, uint64_t block_cache_id)
+	    : m_file{std::move(file)}, m_offset{offset}, m_size{block_index.raw_size},
+	      m_block_index{std::move(block_index)}, m_p_block_cache{p_block_cache}, m_block_cache_id{block_cache_id} {}
 
-	inline const std::filesystem::path &GetFilePath() const { return m_file_path; }
+	inline const std::filesystem::path &GetFilePath() const { return m_file->GetFilePath(); }
 
 	inline size_type GetSize() const { return m_size; }
-	inline Value Read(size_type begin, size_type len) const {
-		return ValueIO::Read(m_p_file_system->GetFileStream(m_file_path, m_offset + begin), len);
+	// Bytes of the value section on disk
+	inline size_type GetStoredSize() const {
+		if constexpr (Trait::kBlockCompression)
+			return m_block_index.GetStoredSize();
+		else
+			return m_size;
+	}
+	// Bytes of the values on disk, without the block index
+	inline size_type GetStoredDataSize() const {
+		return m_block_index.IsCompressed() ? m_block_index.GetStoredDataSize() : m_size;
+	}
+	inline const KVValueLogRefs<Trait> &GetLogRefs() const { return m_log_refs; }
+	inline void SetLogRefs(KVValueLogRefs<Trait> &&log_refs) { m_log_refs = std::move(log_refs); }
+	template <typename Stream> inline Value ReadFrom(Stream &istr, size_type len) const {
+		return m_log_refs.template Read<Value>(istr, len);
+	}
+	inline Value Read(size_type begin, size_type len, KVCacheAccess access) const {
+		if (m_block_index.IsCompressed()) {
+			std::unique_ptr<char[]> data{new char[len]};
+			copy_blocks(begin, len, data.get(), access);
+			IBufStream bin{data.get(), 0};
+			return ReadFrom(bin, len);
+		}
+		if constexpr (kKVBlockCached<Trait>) {
+			auto fin = m_file->GetStream(m_offset + begin, access);
+			return ReadFrom(fin, len);
+		} else {
+			auto fin = m_file->GetStream(m_offset + begin);
+			return ReadFrom(fin, len);
+		}
 	}
-	inline void CopyData(size_type begin, size_type len, char *dst) const {
-		m_p_file_system->GetFileStream(m_file_path, m_offset + begin).read(dst, len);
+	inline void CopyData(size_type begin, size_type len, char *dst, KVCacheAccess access) const {
+		if (m_block_index.IsCompressed())
+			copy_blocks(begin, len, dst, access);
+		else if constexpr (kKVBlockCached<Trait>)
+			m_file->Read(m_offset + begin, dst, len, access);
+		else
+			m_file->Read(m_offset + begin, dst, len);
 	}
 };
 
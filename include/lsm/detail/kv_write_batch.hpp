@@ -0,0 +1,52 @@
+#pragma once
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "../type.hpp"
+
+namespace lsm::detail {
+
+template <typename, typename, typename> class KVMemContainer;
+template <typename, typename, typename> class KVLog;
+
+// Puts and Deletes applied by KV::Write() as a whole, later entries win over earlier ones with the same key
+template <typename Key, typename Value, typename Trait> class KVWriteBatch {
+private:
+	using ValueIO = typename Trait::ValueIO;
+
+	struct Entry {
+		Key key;
+		std::optional<Value> opt_value;
+		size_type value_size;
+	};
+	std::vector<Entry> m_entries;
+	size_type m_value_size{};
+
+	template <typename, typename, typename> friend class KVMemContainer;
+	template <typename, typename, typename> friend class KVLog;
+
+	inline void put(Key key, Value &&value, size_type value_size) {
+		m_value_size += value_size;
+		m_entries.push_back({key, std::move(value), value_size});
+	}
+
+public:
+	inline void Put(Key key, Value &&value) {
+		size_type value_size = ValueIO::GetSize(value);
+		put(key, std::move(value), value_size);
+	}
+	inline void Put(Key key, const Value &value) { Put(key, Value{value}); }
+	// Unlike KV::Delete(), the key is not looked up first
+	inline void Delete(Key key) { m_entries.push_back({key, std::nullopt, 0}); }
+
+	inline size_type GetCount() const { return m_entries.size(); }
+	inline bool IsEmpty() const { return m_entries.empty(); }
+	inline void Clear() {
+		m_entries.clear();
+		m_value_size = 0;
+	}
+};
+
+} // namespace lsm::detail
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../type.hpp"
+
+namespace lsm::detail {
+
+// Returns false if the buffered data could not be written or synced
+inline bool SyncFile(std::FILE *file) {
+	if (std::fflush(file))
+		return false;
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+inline void SyncFile(const std::filesystem::path &file_path) {
+	std::FILE *file = std::fopen(file_path.string().c_str(), "rb+");
+	if (!file)
+		return;
+	SyncFile(file);
+	std::fclose(file);
+}
+
+// Make the files created in a directory durable, Windows has no way to sync a directory and persists them anyway
+inline void SyncDirectory(const std::filesystem::path &dir_path) {
+#ifndef _WIN32
+	int fd = open(dir_path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return;
+	fsync(fd);
+	close(fd);
+#endif
+}
+
+// Error of the last failed call below, taken before anything else may overwrite it
+inline std::error_code GetLastFileError() {
+#ifdef _WIN32
+	DWORD error = GetLastError();
+	return error ? std::error_code{(int)error, std::system_category()} : std::error_code{errno, std::generic_category()};
+#else
+	return std::error_code{errno, std::generic_category()};
+#endif
+}
+
+using FileDescriptor = int;
+constexpr FileDescriptor kInvalidFileDescriptor = -1;
+
+inline FileDescriptor OpenReadOnlyFile(const std::filesystem::path &file_path) {
+#ifdef _WIN32
+	return _wopen(file_path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+	return open(file_path.c_str(), O_RDONLY);
+#endif
+}
+
+inline void CloseFile(FileDescriptor fd) {
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+
+// Returns false if the size could not be taken
+inline bool GetFileSize(FileDescriptor fd, uint64_t *p_size) {
+#ifdef _WIN32
+	__int64 size = _filelengthi64(fd);
+	if (size < 0)
+		return false;
+	*p_size = (uint64_t)size;
+#else
+	struct stat st {};
+	if (fstat(fd, &st))
+		return false;
+	*p_size = (uint64_t)st.st_size;
+#endif
+	return true;
+}
+
+// Read at an explicit offset without touching any shared file position, returns false on an error or a short read.
+// A short read is reported as an I/O error.
+inline bool PReadFile(FileDescriptor fd, char *dst, size_type len, uint64_t offset) {
+#ifdef _WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(fd);
+	while (len) {
+		OVERLAPPED overlapped{};
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32u);
+		DWORD bytes;
+		if (!ReadFile(handle, dst, len, &bytes, &overlapped))
+			return false;
+		if (bytes == 0) {
+			SetLastError(ERROR_HANDLE_EOF);
+			return false;
+		}
+		dst += bytes, len -= bytes, offset += bytes;
+	}
+#else
+	while (len) {
+		ssize_t bytes = pread(fd, dst, len, (off_t)offset);
+		if (bytes < 0)
+			return false;
+		if (bytes == 0) {
+			errno = EIO;
+			return false;
+		}
+		dst += bytes, len -= bytes, offset += bytes;
+	}
+#endif
+	return true;
+}
+
+// Map a whole file read-only, returns nullptr on failure. An empty file cannot be mapped.
+inline const char *MapFile(FileDescriptor fd, size_type *p_size) {
+#ifdef _WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(fd);
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size))
+		return nullptr;
+	if (size.QuadPart == 0) {
+		SetLastError(ERROR_FILE_INVALID);
+		return nullptr;
+	}
+	HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+		return nullptr;
+	// The view keeps the mapping object alive
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	*p_size = (size_type)size.QuadPart;
+	return (const char *)data;
+#else
+	struct stat st {};
+	if (fstat(fd, &st))
+		return nullptr;
+	if (st.st_size == 0) {
+		errno = EINVAL;
+		return nullptr;
+	}
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return nullptr;
+	*p_size = (size_type)st.st_size;
+	return (const char *)data;
+#endif
+}
+
+inline void UnmapFile(const char *data, size_type size) {
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void *)data, size);
+#endif
+}
+
+} // namespace lsm::detail
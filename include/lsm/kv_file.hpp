@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace lsm {
+
+// How table files are read: through a shared cache of std::ifstream, with positional reads on a descriptor per table,
+// or straight from a read-only mapping of each table
+enum class KVFileBackend { kStream, kPRead, kMMap };
+
+struct KVCacheStats {
+	uint64_t hits, misses;
+};
+
+// Value bytes of tables before and after block compression
+struct KVCompressionStats {
+	uint64_t raw_bytes, stored_bytes;
+};
+
+} // namespace lsm
@@ -5,9 +5,17 @@
 namespace lsm {
 
 enum class KVLevelType { kTiering, kLeveling };
+// Codecs of value blocks, implemented by the trait's Compressor
+enum class KVCompression : byte { kNone, kLZ4, kSnappy };
 struct KVLevelConfig {
 	size_type max_files;
 	KVLevelType type;
+	// Bloom filter bits per key for tables of this level, 0 keeps the filter's fixed size
+	size_type bloom_bits_per_key = 0;
+	// Target size in bytes, replaces max_files when set
+	uint64_t max_bytes = 0;
+	// Codec of the value blocks of tables written to this level, tables moved down keep theirs
+	KVCompression compression = KVCompression::kNone;
 };
 
 } // namespace lsm
\ No newline at end of file
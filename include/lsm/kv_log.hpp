@@ -0,0 +1,17 @@
+#pragma once
+
+#include "type.hpp"
+
+namespace lsm {
+
+enum class KVLogMode { kDisabled, kNoSync, kGroupCommit, kSync };
+struct KVLogConfig {
+	KVLogMode mode;
+	// Group commit writers wait for a sync covering their record, the first one syncs for all of them. It waits up to
+	// group_commit_us for more records first, or until group_commit_bytes are pending. Writers arriving during a sync
+	// form the next group, so no delay is needed for the syncs to be shared. kSync is the same without the wait.
+	size_type group_commit_bytes;
+	uint32_t group_commit_us;
+};
+
+} // namespace lsm
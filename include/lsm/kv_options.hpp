@@ -0,0 +1,32 @@
+#pragma once
+
+#include <iterator>
+#include <vector>
+
+#include "kv_level.hpp"
+#include "type.hpp"
+
+namespace lsm {
+
+struct KVRateLimitConfig {
+	// Bytes per second that flushes and compactions may write and compactions may read, 0 disables the limit
+	uint64_t bytes_per_sec;
+	// Raise the limit while memtables wait to enter level 0
+	bool auto_tune;
+};
+
+// Settings that may change between runs without recompiling, the trait provides the defaults
+struct KVOptions {
+	size_type max_file_size;
+	// The first level must be tiering, one more sorted level without a target follows the last one
+	std::vector<KVLevelConfig> level_configs;
+	KVRateLimitConfig rate_limit;
+
+	template <typename Trait> inline static KVOptions FromTrait() {
+		return {Trait::kMaxFileSize,
+		        std::vector<KVLevelConfig>(std::begin(Trait::kLevelConfigs), std::end(Trait::kLevelConfigs)),
+		        Trait::kRateLimit};
+	}
+};
+
+} // namespace lsm
@@ -2,30 +2,81 @@
 
 #include <optional>
 
+#include "arena_skiplist.hpp"
 #include "bloom.hpp"
+#include "concurrent_skiplist.hpp"
 #include "detail/io.hpp"
+#include "detail/kv_value_block.hpp"
+#include "kv_file.hpp"
+#include "kv_level.hpp"
+#include "kv_log.hpp"
+#include "kv_options.hpp"
 #include "skiplist.hpp"
 #include "type.hpp"
 
 namespace lsm {
 
-template <typename Key, typename Trait> using KVUncachedKeyFile = detail::KVUncachedKeyFile<Key, Trait>;
+template <typename Key, typename Trait> using KVUncachedKeyFile = detail::KVUncachedKeyFile<Key, Trait, 0>;
 template <typename Key, typename Trait, typename Bloom>
-using KVUncachedBloomKeyFile = detail::KVUncachedBloomKeyFile<Key, Trait, Bloom>;
+using KVUncachedBloomKeyFile = detail::KVUncachedBloomKeyFile<Key, Trait, Bloom, 0>;
+// Uncached key files that keep every FenceInterval-th key in memory
+template <typename Key, typename Trait, size_type FenceInterval = 128>
+using KVFencedKeyFile = detail::KVUncachedKeyFile<Key, Trait, FenceInterval>;
+template <typename Key, typename Trait, typename Bloom, size_type FenceInterval = 128>
+using KVFencedBloomKeyFile = detail::KVUncachedBloomKeyFile<Key, Trait, Bloom, FenceInterval>;
 template <typename Key, typename Trait> using KVCachedKeyFile = detail::KVCachedKeyFile<Key, Trait>;
 template <typename Key, typename Trait, typename Bloom>
 using KVCachedBloomKeyFile = detail::KVCachedBloomKeyFile<Key, Trait, Bloom>;
 
 template <typename Key, typename Value, typename CompareType = std::less<Key>> struct KVDefaultTrait {
 	using Compare = CompareType;
+	// lsm::ArenaSkipList allocates nodes from an arena, lsm::ConcurrentSkipList lets writers run in parallel instead of
+	// taking the memtable lock in turn
 	using Container = lsm::SkipList<Key, KVMemValue<Value>, Compare, std::default_random_engine, 1, 2, 64>;
 	using KeyFile = lsm::KVCachedBloomKeyFile<Key, KVDefaultTrait, Bloom<Key, 10240 * 8>>;
 	using ValueIO = detail::IO<Value>;
 	constexpr static size_type kMaxFileSize = 2 * 1024 * 1024;
+	// kStream shares a bounded LRU of std::ifstream, kPRead keeps a descriptor per table and reads without locking
+	constexpr static KVFileBackend kFileBackend = KVFileBackend::kStream;
+	// Byte budget of the block cache under table reads (0 disables it), unused by kMMap
+	constexpr static size_type kBlockCacheSize = 0;
+	constexpr static size_type kBlockSize = 4096;
+	// Store the values of tables in blocks of kBlockSize bytes, compressed by Compressor with the codec of their level
+	constexpr static bool kBlockCompression = false;
+	using Compressor = detail::KVNoCompressor;
 
+	// Flush full memtables and run compactions on a background thread
+	constexpr static bool kBackgroundCompaction = false;
+	// Writes stall once this many immutable memtables wait to be flushed. This takes the place of a limit on level 0
+	// tables: the worker compacts every level back within its target before it publishes a flush, so level 0 never
+	// piles up and the waiting memtables are the only backlog writes can outrun.
+	constexpr static size_type kImmTableStallLimit = 4;
+	// Large compactions are split into up to this many key ranges, each merged on its own thread (1 merges on the
+	// compacting thread)
+	constexpr static size_type kSubcompactions = 1;
+	// Bytes of each input table a compaction reads ahead of its merge on a reader thread (0 reads values in place)
+	constexpr static size_type kCompactionReadAhead = 0;
+	// Bytes of merged tables a compaction passes down in memory, the tables beyond are written to the next level.
+	// A compaction holds about 2 * kCompactionBufferSize + kSubcompactions * 3 * kMaxFileSize bytes of tables, plus
+	// 2 * kCompactionReadAhead per input table.
+	constexpr static size_type kCompactionBufferSize = 32 * 1024 * 1024;
+	// Disk bandwidth given to background I/O, so that it does not starve reads. Flushes go ahead of compactions.
+	constexpr static KVRateLimitConfig kRateLimit = {0, false};
+
+	// Values of at least this many bytes are moved to a value log on flush, tables only keep a pointer to them, so that
+	// compactions do not rewrite them (0 keeps every value in the tables). Must not be less than a pointer (16 bytes).
+	constexpr static size_type kValueLogThreshold = 0;
+	constexpr static size_type kValueLogFileSize = 64 * 1024 * 1024;
+	// KV::CollectValueLog() rewrites a value log file once this share of it is dead
+	constexpr static size_type kValueLogGCPercent = 50;
+
+	// Write-ahead log for Put() and Delete(), replayed when the KV is opened
+	constexpr static KVLogConfig kLogConfig = {KVLogMode::kDisabled, 256 * 1024, 0};
+
+	// Deeper levels hold most of the data but are probed last, so they get fewer bloom bits per key (Monkey)
 	constexpr static KVLevelConfig kLevelConfigs[] = {
-	    {2, KVLevelType::kTiering},   {4, KVLevelType::kLeveling},  {8, KVLevelType::kLeveling},
-	    {16, KVLevelType::kLeveling}, {32, KVLevelType::kLeveling},
+	    {2, KVLevelType::kTiering, 14},   {4, KVLevelType::kLeveling, 12}, {8, KVLevelType::kLeveling, 11},
+	    {16, KVLevelType::kLeveling, 10}, {32, KVLevelType::kLeveling, 8},
 	};
 };
 
@@ -143,6 +143,8 @@ private:
 	}
 
 public:
+	constexpr static bool kConcurrent = false;
+
 	inline explicit SkipList(typename RandomGenerator::result_type seed = 0)
 	    : m_rand_gen{seed}, m_head{MaxLevel}, m_level{0}, m_size{0} {}
 	inline ~SkipList() = default;
@@ -1,40 +1,96 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <list>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "test.hpp"
 
-class CorrectnessTest : public Test {
+// Clock of the rate limit test, time only passes when the test advances it
+struct ManualClock {
+	using duration = std::chrono::steady_clock::duration;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<ManualClock>;
+	constexpr static bool is_steady = true;
+
+	inline static std::atomic<rep> ticks{0};
+
+	static time_point now() { return time_point{duration{ticks.load()}}; }
+	static void Advance(double seconds) {
+		ticks += std::chrono::duration_cast<duration>(std::chrono::duration<double>(seconds)).count();
+	}
+};
+
+template <typename Trait> class CorrectnessTest : public Test<Trait> {
 private:
+	using Base = Test<Trait>;
+	using Base::phase;
+	using Base::report;
+	using Base::store;
+
+	std::string name;
+
 	const uint64_t SIMPLE_TEST_MAX = 512;
 	const uint64_t LARGE_TEST_MAX = 1024 * 64;
+	const uint64_t COMPRESSION_TEST_MAX = 1024 * 16;
+	const uint64_t BLOCK_CACHE_TEST_MAX = 1024 * 8, BLOCK_CACHE_WORKING_SET = 64;
+	const uint64_t VALUE_LOG_TEST_MAX = 1024 * 4;
+	const uint64_t LOG_TEST_MAX = 1024;
+	const uint64_t RATE_LIMIT_BYTES_PER_SEC = 4 * 1024 * 1024;
+	const uint64_t CONCURRENT_TEST_MAX = 1024 * 16, CONCURRENT_TEST_THREADS = 4;
+	const uint64_t CONCURRENT_LOG_TEST_KEYS = 256, CONCURRENT_LOG_TEST_ROUNDS = 64;
+	const uint64_t CONCURRENT_OVERWRITE_TEST_MAX = 1024 * 8;
+	const uint64_t SUBCOMPACTION_TEST_MAX = 1024 * 16, SUBCOMPACTION_TEST_ROUNDS = 3;
+	const uint64_t LOWER_BOUND_TEST_MAX = 1024 * 16;
+	const uint64_t TRIVIAL_MOVE_TEST_MAX = 1024 * 32;
+	const uint64_t LEVEL_BYTES_TEST_MAX = 1024 * 48, LEVEL_BYTES_TEST_CHECKS = 16;
 
 	void regular_test(uint64_t max) {
 		uint64_t i;
 
-		store.Reset();
+		store->Reset();
 
 		// Test a single key
-		EXPECT(std::optional<std::string>{}, store.Get(1));
-		store.Put(1, "SE");
-		EXPECT(std::string{"SE"}, store.Get(1));
-		EXPECT(true, store.Delete(1));
-		EXPECT(std::optional<std::string>{}, store.Get(1));
-		EXPECT(false, store.Delete(1));
+		EXPECT(std::optional<std::string>{}, store->Get(1));
+		store->Put(1, "SE");
+		EXPECT(std::string{"SE"}, store->Get(1));
+		EXPECT(true, store->Delete(1));
+		EXPECT(std::optional<std::string>{}, store->Get(1));
+		EXPECT(false, store->Delete(1));
+
+		// Test a write batch
+		typename Base::KV::WriteBatch batch;
+		batch.Put(1, "SE");
+		batch.Put(2, "LSM");
+		batch.Delete(1);
+		store->Write(std::move(batch));
+		EXPECT(std::optional<std::string>{}, store->Get(1));
+		EXPECT(std::string{"LSM"}, store->Get(2));
+		store->BlindDelete(2);
+		EXPECT(std::optional<std::string>{}, store->Get(2));
+		EXPECT(false, store->Delete(2));
 
 		phase();
 
 		// Test multiple key-value pairs
 		for (i = 0; i < max; ++i) {
-			store.Put(i, std::string(i + 1, 's'));
-			EXPECT(std::string(i + 1, 's'), store.Get(i));
+			store->Put(i, std::string(i + 1, 's'));
+			EXPECT(std::string(i + 1, 's'), store->Get(i));
 		}
 		phase();
 
 		// Test after all insertions
 		for (i = 0; i < max; ++i)
-			EXPECT(std::string(i + 1, 's'), store.Get(i));
+			EXPECT(std::string(i + 1, 's'), store->Get(i));
 		phase();
 
 		// Test scan
@@ -44,7 +100,7 @@ private:
 		for (i = 0; i < max / 2; ++i)
 			list_ans.emplace_back(i, std::string(i + 1, 's'));
 
-		store.Scan(0, max / 2 - 1,
+		store->Scan(0, max / 2 - 1,
 		           [&list_stu](uint64_t key, std::string str) { list_stu.emplace_back(key, std::move(str)); });
 		EXPECT(list_ans.size(), list_stu.size());
 
@@ -61,37 +117,565 @@ private:
 
 		// Test deletions
 		for (i = 0; i < max; i += 2)
-			EXPECT(true, store.Delete(i));
+			EXPECT(true, store->Delete(i));
 
 		for (i = 0; i < max; ++i)
-			EXPECT((i & 1) ? std::make_optional(std::string(i + 1, 's')) : std::nullopt, store.Get(i));
+			EXPECT((i & 1) ? std::make_optional(std::string(i + 1, 's')) : std::nullopt, store->Get(i));
+
+		std::vector<uint64_t> keys;
+		for (i = max + 1; i--;)
+			keys.push_back(i);
+		auto values = store->MultiGet(keys.data(), keys.size());
+		for (i = 0; i < keys.size(); ++i)
+			EXPECT((keys[i] & 1) && keys[i] < max ? std::make_optional(std::string(keys[i] + 1, 's')) : std::nullopt,
+			       values[i]);
+
+		// Test iterator, only odd keys are left
+		auto it = store->GetIterator();
+		for (it.Seek(max / 2), i = max / 2 + 1; it.IsValid() && i < max / 2 + 32; it.Proceed(), i += 2) {
+			EXPECT(i, it.GetKey());
+			EXPECT(std::string(i + 1, 's'), it.ReadValue());
+		}
+		EXPECT(max / 2 + 33, i);
+		for (it.SeekToFirst(), i = 1; it.IsValid(); it.Proceed(), i += 2)
+			EXPECT(i, it.GetKey());
+		EXPECT(max + 1, i);
+
+		// The iterator pins the memtable, its entries stay readable once the memtable is rotated and flushed
+		it.Seek(max / 2);
+		for (i = max; i < max + 4096; ++i)
+			store->Put(i, std::string(1024, 'r'));
+		for (i = max / 2 + 1; it.IsValid(); it.Proceed(), i += 2)
+			EXPECT(std::string(i + 1, 's'), it.ReadValue());
+		EXPECT(max + 1, i);
+		for (i = max; i < max + 4096; ++i)
+			store->BlindDelete(i);
 
 		for (i = 1; i < max; ++i)
-			EXPECT(bool(i & 1), store.Delete(i));
+			EXPECT(bool(i & 1), store->Delete(i));
+
+		phase();
+
+		report();
+	}
+
+	// Each thread writes its own keys while reading all the others, every third key ends up deleted
+	void concurrent_test(uint64_t max, uint64_t threads) {
+		uint64_t i;
+
+		store->Reset();
+
+		const auto value_of = [](uint64_t key) { return std::string(key % 512 + 1, 'a' + key % 26); };
+		std::atomic<uint64_t> mismatches{0};
+		std::vector<std::thread> workers;
+		for (uint64_t t = 0; t < threads; ++t)
+			workers.emplace_back([this, t, max, threads, &value_of, &mismatches]() {
+				uint64_t local_mismatches = 0;
+				for (uint64_t key = t; key < max; key += threads) {
+					store->Put(key, value_of(key));
+					local_mismatches += store->Get(key) != value_of(key);
+					// Keys of other threads are either absent, deleted or hold their value
+					auto opt_value = store->Get(key ^ 1u);
+					local_mismatches += opt_value.has_value() && opt_value.value() != value_of(key ^ 1u);
+					if (key % 3 == 0) {
+						local_mismatches += !store->Delete(key);
+						local_mismatches += store->Get(key).has_value();
+					}
+				}
+				mismatches.fetch_add(local_mismatches);
+			});
+		for (auto &worker : workers)
+			worker.join();
+		EXPECT(uint64_t{0}, mismatches.load());
+		phase();
+
+		this->reopen();
+		for (i = 0; i < max; ++i) {
+			if (i % 3 == 0)
+				EXPECT(std::optional<std::string>{}, store->Get(i));
+			else
+				EXPECT(value_of(i), store->Get(i));
+		}
+		phase();
+
+		report();
+	}
+
+	// Overwritten values stay in the memtable until it is flushed, so overwriting one key fills it as well
+	void concurrent_overwrite_test(uint64_t max, uint64_t threads) {
+		store->Reset();
+
+		uint64_t io_bytes = store->GetBackgroundIOBytes();
+		std::vector<std::thread> workers;
+		for (uint64_t t = 0; t < threads; ++t)
+			workers.emplace_back([this, t, max, threads]() {
+				for (uint64_t i = t; i < max; i += threads)
+					store->Put(0, std::string(1024, 'a' + i % 26));
+			});
+		for (auto &worker : workers)
+			worker.join();
+		// The overwrites add up to several memtables
+		EXPECT(true, store->GetBackgroundIOBytes() > io_bytes);
+		auto opt_value = store->Get(0);
+		EXPECT(true, opt_value.has_value() && opt_value.value().size() == 1024);
+		phase();
+
+		report();
+	}
+
+	// Writers race on the same keys, the log has to replay to the values the memtable kept
+	void concurrent_log_test(uint64_t keys, uint64_t rounds, uint64_t threads) {
+		uint64_t i;
+
+		store->Reset();
+
+		// The keys fit in the memtable, so every record stays in the first log
+		std::vector<std::thread> workers;
+		for (uint64_t t = 0; t < threads; ++t)
+			workers.emplace_back([this, t, keys, rounds]() {
+				for (uint64_t round = 0; round < rounds; ++round)
+					for (uint64_t key = 0; key < keys; ++key) {
+						if ((key + round + t) % 7 == 0)
+							store->BlindDelete(key);
+						else
+							store->Put(key, std::to_string(t) + ":" + std::to_string(round));
+					}
+			});
+		for (auto &worker : workers)
+			worker.join();
+		std::vector<std::optional<std::string>> values;
+		for (i = 0; i < keys; ++i)
+			values.push_back(store->Get(i));
+
+		// Replay the log alone, as after a crash
+		std::string log_path = this->dir + "/0.log";
+		std::string log_data(std::filesystem::file_size(log_path), '\0');
+		std::ifstream{log_path, std::ios::binary}.read(log_data.data(), (std::streamsize)log_data.size());
+		store->Reset();
+		store.reset();
+		std::ofstream{log_path, std::ios::binary}.write(log_data.data(), (std::streamsize)log_data.size());
+		store = std::make_unique<typename Base::KV>(this->dir);
+		for (i = 0; i < keys; ++i)
+			EXPECT(values[i], store->Get(i));
+		phase();
+
+		report();
+	}
+
+	// Every round overwrites or deletes all the keys, so the key ranges of a split compaction meet each key in several
+	// input tables and cut through tables at their bounds
+	void subcompaction_test(uint64_t max, uint64_t rounds) {
+		uint64_t i;
+
+		store->Reset();
+
+		const auto is_deleted = [](uint64_t key, uint64_t round) { return (key + round) % 5 == 0; };
+		const auto value_of = [](uint64_t key, uint64_t round) { return std::string(1024, 'a' + (key + round) % 26); };
+		for (uint64_t round = 0; round < rounds; ++round)
+			for (i = 0; i < max; ++i) {
+				if (is_deleted(i, round))
+					store->BlindDelete(i);
+				else
+					store->Put(i, value_of(i, round));
+			}
+		const auto check = [this, max, rounds, &is_deleted, &value_of]() {
+			for (uint64_t key = 0; key < max; ++key) {
+				if (is_deleted(key, rounds - 1))
+					EXPECT(std::optional<std::string>{}, store->Get(key));
+				else
+					EXPECT(value_of(key, rounds - 1), store->Get(key));
+			}
+			uint64_t next_key = 0;
+			store->Scan(0, max - 1, [this, rounds, &is_deleted, &value_of, &next_key](uint64_t key, std::string value) {
+				while (is_deleted(next_key, rounds - 1))
+					++next_key;
+				EXPECT(next_key, key);
+				EXPECT(value_of(next_key, rounds - 1), value);
+				next_key = key + 1;
+			});
+			while (next_key < max && is_deleted(next_key, rounds - 1))
+				++next_key;
+			EXPECT(max, next_key);
+		};
+		check();
+		phase();
+
+		this->reopen();
+		check();
+		phase();
+
+		report();
+	}
+
+	// Only even keys are stored, so that every lookup, including those at the first and last key of a run between two
+	// fences, is checked both as a hit and as a miss
+	void lower_bound_test(uint64_t max) {
+		uint64_t i;
+
+		store->Reset();
+
+		for (i = 0; i < max; ++i)
+			store->Put(2 * i + 2, std::string(256, 'a' + i % 26));
+		const auto check = [this, max]() {
+			auto it = store->GetIterator();
+			for (uint64_t key = 0; key <= 2 * max + 2; ++key) {
+				uint64_t next_key = key % 2 ? key + 1 : std::max(key, (uint64_t)2);
+				if (key % 2 || key == 0 || key > 2 * max)
+					EXPECT(std::optional<std::string>{}, store->Get(key));
+				else
+					EXPECT(std::string(256, 'a' + (key / 2 - 1) % 26), store->Get(key));
+				it.Seek(key);
+				EXPECT(next_key <= 2 * max, it.IsValid());
+				if (it.IsValid())
+					EXPECT(next_key, it.GetKey());
+			}
+		};
+		check();
+		phase();
+
+		this->reopen();
+		check();
+		phase();
+
+		report();
+	}
+
+	// Sequential keys give tables that overlap nothing below them, so they are moved down the levels instead of being
+	// rewritten. The background I/O then stays close to writing the data once.
+	void trivial_move_test(uint64_t max) {
+		uint64_t i;
+
+		store->Reset();
+
+		const uint64_t value_size = 1024;
+		uint64_t start_io_bytes = store->GetBackgroundIOBytes();
+		for (i = 0; i < max; ++i)
+			store->Put(i, std::string(value_size, 'a' + i % 26));
+		uint64_t io_bytes = store->GetBackgroundIOBytes() - start_io_bytes;
+		EXPECT(true, io_bytes < max * value_size * 3 / 2);
+		phase();
+
+		this->reopen();
+		for (i = 0; i < max; ++i)
+			EXPECT(std::string(value_size, 'a' + i % 26), store->Get(i));
+		phase();
+
+		report();
+	}
+
+	// Levels with byte targets are compacted back within them, every level holds no more bytes than its target
+	void level_bytes_test(uint64_t max, uint64_t checks) {
+		uint64_t i;
+
+		store->Reset();
 
+		const auto level_bytes = [this](lsm::level_type level) {
+			uint64_t bytes = 0;
+			for (const auto &file :
+			     std::filesystem::directory_iterator(this->dir + "/level-" + std::to_string(level)))
+				bytes += file.file_size();
+			return bytes;
+		};
+		const auto check_levels = [this, &level_bytes]() {
+			for (lsm::level_type level = 1; level < std::size(Trait::kLevelConfigs); ++level)
+				EXPECT(true, level_bytes(level) <= Trait::kLevelConfigs[level].max_bytes);
+		};
+		// Keys are spread over the whole range from the start, so that the tables of a level overlap
+		const auto key_of = [max](uint64_t i) { return i * 7919 % max; };
+		for (i = 0; i < max; ++i) {
+			store->Put(key_of(i), std::string(1024, 'a' + i % 26));
+			if ((i + 1) % (max / checks) == 0)
+				check_levels();
+		}
+		phase();
+
+		for (i = 0; i < max; ++i)
+			EXPECT(std::string(1024, 'a' + i % 26), store->Get(key_of(i)));
+		phase();
+
+		report();
+	}
+
+	// Replay stops at a record failing its CRC, the records after it are dropped as well
+	void log_test(uint64_t max) {
+		uint64_t i;
+
+		store->Reset();
+
+		// The records fit in the memtable, so they all stay in the first log. Keep it as a crash would.
+		for (i = 0; i < max; ++i)
+			store->Put(i, std::string(16, 'a' + i % 26));
+		std::string log_path = this->dir + "/0.log";
+		std::string log_data(std::filesystem::file_size(log_path), '\0');
+		std::ifstream{log_path, std::ios::binary}.read(log_data.data(), (std::streamsize)log_data.size());
+		store->Reset();
+		store.reset();
+
+		log_data[log_data.size() / 2] ^= 1;
+		std::ofstream{log_path, std::ios::binary}.write(log_data.data(), (std::streamsize)log_data.size());
+		store = std::make_unique<typename Base::KV>(this->dir);
+		uint64_t recovered = 0;
+		while (recovered < max && store->Get(recovered).has_value())
+			++recovered;
+		EXPECT(true, recovered > 0 && recovered < max);
+		for (i = 0; i < max; ++i) {
+			if (i < recovered)
+				EXPECT(std::string(16, 'a' + i % 26), store->Get(i));
+			else
+				EXPECT(std::optional<std::string>{}, store->Get(i));
+		}
+		phase();
+
+		report();
+	}
+
+	// Background I/O is let through by the tokens of the limiter's clock, which only moves when the test says so, so the
+	// results do not depend on how fast the machine is
+	void rate_limit_test(uint64_t bytes_per_sec) {
+		lsm::detail::KVBasicRateLimiter<ManualClock> limiter{bytes_per_sec};
+		std::atomic<bool> done;
+		const auto request = [&limiter, &done](uint64_t bytes) {
+			done = false;
+			return std::thread{[&limiter, &done, bytes]() {
+				limiter.Request(bytes, lsm::detail::KVIOPriority::kLow);
+				done = true;
+			}};
+		};
+		// The clock stands still, so a request without tokens must still wait a while later
+		const auto is_waiting = [&done]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			return !done;
+		};
+
+		// Nothing is saved up at first, a request waits for the first tokens and may then take more than them
+		std::thread thread = request(bytes_per_sec / 10);
+		EXPECT(true, is_waiting());
+		ManualClock::Advance(0.001);
+		thread.join();
+		// The debt of 0.099 s is paid back before the next request goes
+		thread = request(1);
+		ManualClock::Advance(0.05);
+		EXPECT(true, is_waiting());
+		ManualClock::Advance(0.05);
+		thread.join();
+		phase();
+
+		// Tokens saved up while idle are capped at 0.1 s, a request of 1 s leaves a debt of 0.9 s
+		ManualClock::Advance(10);
+		thread = request(bytes_per_sec);
+		thread.join();
+		thread = request(1);
+		ManualClock::Advance(0.5);
+		EXPECT(true, is_waiting());
+		ManualClock::Advance(0.5);
+		thread.join();
+		EXPECT(bytes_per_sec / 10 + bytes_per_sec + 2, limiter.GetRequestedBytes());
+		phase();
+
+		report();
+	}
+
+	// Large values live in the value log, small ones stay in the tables. Overwriting the first half of the keys leaves
+	// the oldest value log files dead enough to be collected.
+	void value_log_test(uint64_t max) {
+		uint64_t i;
+
+		store->Reset();
+
+		const auto value_of = [](uint64_t key, uint64_t round) {
+			return key % 2 ? std::string(16, 'a' + key % 26) : std::string(2048 + round, 'a' + (key + round) % 26);
+		};
+		for (i = 0; i < max; ++i)
+			store->Put(i, value_of(i, 0));
+		for (i = 0; i < max / 2; ++i)
+			store->Put(i, value_of(i, 1));
+		for (i = 0; i < max; ++i)
+			EXPECT(value_of(i, i < max / 2), store->Get(i));
+		phase();
+
+		uint64_t file_count = 0, collected = 0;
+		for (const auto &file : std::filesystem::directory_iterator(this->dir + "/vlog"))
+			file_count += file.path().extension() == ".vlog";
+		for (i = 0; i < file_count; ++i)
+			collected += store->CollectValueLog();
+		EXPECT(true, collected > 0);
+		for (i = 0; i < max; ++i)
+			EXPECT(value_of(i, i < max / 2), store->Get(i));
+		phase();
+
+		this->reopen();
+		for (i = 0; i < max; ++i)
+			EXPECT(value_of(i, i < max / 2), store->Get(i));
+		phase();
+
+		// A value log file removed while a table still points into it, the pointer must not read as a value
+		store->Reset();
+		for (i = 0; i < max; ++i)
+			store->Put(i, std::string(2048, 'a' + i % 26));
+		store.reset();
+		std::filesystem::remove(this->dir + "/vlog/0.vlog");
+		store = std::make_unique<typename Base::KV>(this->dir);
+		bool thrown = false;
+		try {
+			store->Get(0);
+		} catch (const std::filesystem::filesystem_error &) {
+			thrown = true;
+		}
+		EXPECT(true, thrown);
+		EXPECT(std::string(2048, 'a' + (max - 1) % 26), store->Get(max - 1));
+		phase();
+
+		report();
+	}
+
+	// Values read twice stay cached, a scan over more than the cache does not evict them
+	void block_cache_test(uint64_t max, uint64_t working_set) {
+		uint64_t i;
+
+		store->Reset();
+
+		for (i = 0; i < max; ++i)
+			store->Put(i, std::string(1024, 'a' + i % 26));
+		this->reopen();
+
+		for (i = 0; i < working_set; ++i)
+			EXPECT(std::string(1024, 'a' + i % 26), store->Get(i));
+		lsm::KVCacheStats stats = store->GetBlockCacheStats();
+		for (i = 0; i < working_set; ++i)
+			EXPECT(std::string(1024, 'a' + i % 26), store->Get(i));
+		lsm::KVCacheStats hit_stats = store->GetBlockCacheStats();
+		EXPECT(true, hit_stats.hits >= stats.hits + working_set);
+		EXPECT(stats.misses, hit_stats.misses);
+		phase();
+
+		uint64_t count = 0;
+		store->Scan(0, max - 1, [&count](uint64_t, const std::string &) { ++count; });
+		EXPECT(max, count);
+		stats = store->GetBlockCacheStats();
+		EXPECT(true, stats.misses > hit_stats.misses);
+		for (i = 0; i < working_set; ++i)
+			EXPECT(std::string(1024, 'a' + i % 26), store->Get(i));
+		EXPECT(stats.misses, store->GetBlockCacheStats().misses);
+		phase();
+
+		// A block read twice by point reads is protected from a scan of many other blocks, one read twice by a scan is
+		// not. Each shard holds four blocks.
+		const lsm::size_type block_size = 4096;
+		lsm::detail::KVBlockCache cache{16 * 4 * block_size, block_size};
+		uint64_t loads = 0;
+		char data[1];
+		const auto read = [&cache, &loads, &data](uint64_t block, lsm::detail::KVCacheAccess access) {
+			cache.Read(0, block, 0, 1, data, access, [&loads](char *) {
+				++loads;
+				return block_size;
+			});
+		};
+		read(0, lsm::detail::KVCacheAccess::kPoint);
+		read(0, lsm::detail::KVCacheAccess::kPoint);
+		read(1, lsm::detail::KVCacheAccess::kScan);
+		read(1, lsm::detail::KVCacheAccess::kScan);
+		for (i = 2; i < 2 + 1024; ++i)
+			read(i, lsm::detail::KVCacheAccess::kScan);
+		loads = 0;
+		read(0, lsm::detail::KVCacheAccess::kPoint);
+		EXPECT((uint64_t)0, loads);
+		read(1, lsm::detail::KVCacheAccess::kPoint);
+		EXPECT((uint64_t)1, loads);
+		phase();
+
+		report();
+	}
+
+	// Levels with a codec store their values in fewer bytes, the others in as many
+	void compression_test(uint64_t max) {
+		uint64_t i;
+
+		store->Reset();
+
+		for (i = 0; i < max; ++i)
+			store->Put(i, std::string(1024, 'a' + i % 26));
+		this->reopen();
+		for (i = 0; i < max; ++i)
+			EXPECT(std::string(1024, 'a' + i % 26), store->Get(i));
+		phase();
+
+		const auto &configs = Trait::kLevelConfigs;
+		constexpr std::size_t config_count = std::size(Trait::kLevelConfigs);
+		auto stats = store->GetCompressionStats();
+		uint64_t raw_bytes = 0, stored_bytes = 0;
+		for (std::size_t level = 0; level < stats.size(); ++level) {
+			if (configs[std::min(level, config_count - 1)].compression == lsm::KVCompression::kNone)
+				EXPECT(stats[level].raw_bytes, stats[level].stored_bytes);
+			else
+				EXPECT(true, stats[level].raw_bytes >= stats[level].stored_bytes);
+			raw_bytes += stats[level].raw_bytes;
+			stored_bytes += stats[level].stored_bytes;
+		}
+		EXPECT(true, stored_bytes < raw_bytes);
 		phase();
 
 		report();
 	}
 
 public:
-	explicit CorrectnessTest(const std::string &dir, bool v = true) : Test(dir, v) {}
+	CorrectnessTest(const std::string &name, const std::string &dir, bool v = true) : Base(dir, v), name(name) {}
 
-	void start_test(void *args = NULL) override {
-		std::cout << "KVStore Correctness Test" << std::endl;
+	void start_test(void * = NULL) override {
+		std::cout << "KVStore Correctness Test (" << name << ")" << std::endl;
 
-		store.Reset();
+		store->Reset();
 
 		std::cout << "[Simple Test]" << std::endl;
 		regular_test(SIMPLE_TEST_MAX);
 
-		store.Reset();
+		store->Reset();
 
 		std::cout << "[Large Test]" << std::endl;
 		regular_test(LARGE_TEST_MAX);
+
+		// Tests of single features, each runs when the trait enables its feature
+		const struct {
+			const char *name;
+			bool enabled;
+			std::function<void()> run;
+		} feature_tests[] = {
+		    {"Lower Bound Test", true, [this]() { lower_bound_test(LOWER_BOUND_TEST_MAX); }},
+		    {"Trivial Move Test", true, [this]() { trivial_move_test(TRIVIAL_MOVE_TEST_MAX); }},
+		    {"Concurrent Test", Trait::Container::kConcurrent,
+		     [this]() { concurrent_test(CONCURRENT_TEST_MAX, CONCURRENT_TEST_THREADS); }},
+		    {"Concurrent Overwrite Test", Trait::Container::kConcurrent,
+		     [this]() { concurrent_overwrite_test(CONCURRENT_OVERWRITE_TEST_MAX, CONCURRENT_TEST_THREADS); }},
+		    {"Concurrent Log Test",
+		     Trait::Container::kConcurrent && Trait::kLogConfig.mode != lsm::KVLogMode::kDisabled,
+		     [this]() {
+			     concurrent_log_test(CONCURRENT_LOG_TEST_KEYS, CONCURRENT_LOG_TEST_ROUNDS, CONCURRENT_TEST_THREADS);
+		     }},
+		    {"Subcompaction Test", Trait::kSubcompactions > 1,
+		     [this]() { subcompaction_test(SUBCOMPACTION_TEST_MAX, SUBCOMPACTION_TEST_ROUNDS); }},
+		    {"Level Bytes Test", Trait::kLevelConfigs[1].max_bytes != 0,
+		     [this]() { level_bytes_test(LEVEL_BYTES_TEST_MAX, LEVEL_BYTES_TEST_CHECKS); }},
+		    {"Log Test", Trait::kLogConfig.mode != lsm::KVLogMode::kDisabled, [this]() { log_test(LOG_TEST_MAX); }},
+		    {"Rate Limit Test", Trait::kBackgroundCompaction, [this]() { rate_limit_test(RATE_LIMIT_BYTES_PER_SEC); }},
+		    {"Value Log Test", Trait::kValueLogThreshold != 0, [this]() { value_log_test(VALUE_LOG_TEST_MAX); }},
+		    {"Block Cache Test", Trait::kBlockCacheSize != 0,
+		     [this]() { block_cache_test(BLOCK_CACHE_TEST_MAX, BLOCK_CACHE_WORKING_SET); }},
+		    {"Compression Test", Trait::kBlockCompression, [this]() { compression_test(COMPRESSION_TEST_MAX); }},
+		};
+		for (const auto &test : feature_tests) {
+			if (!test.enabled)
+				continue;
+			std::cout << "[" << test.name << "]" << std::endl;
+			test.run();
+		}
 	}
 };
 
+// Each trait gets a directory of its own, table formats differ between traits
+template <typename Trait> void run_test(const std::string &name, bool verbose) {
+	CorrectnessTest<Trait> test(name, "./data/" + name, verbose);
+	test.start_test();
+}
+
 int main(int argc, char *argv[]) {
 	bool verbose = (argc == 2 && std::string(argv[1]) == "-v");
 
@@ -101,9 +685,20 @@ int main(int argc, char *argv[]) {
 	std::cout << std::endl;
 	std::cout.flush();
 
-	CorrectnessTest test("./data", verbose);
-
-	test.start_test();
+	std::filesystem::create_directories("./data");
+	run_test<MyStringTrait<uint64_t>>("default", verbose);
+	run_test<ArenaStringTrait<uint64_t>>("arena", verbose);
+	run_test<ConcurrentStringTrait<uint64_t>>("concurrent", verbose);
+	run_test<BackgroundStringTrait<uint64_t>>("background", verbose);
+	run_test<SubcompactionStringTrait<uint64_t>>("subcompaction", verbose);
+	run_test<LevelBytesStringTrait<uint64_t>>("level-bytes", verbose);
+	run_test<PReadStringTrait<uint64_t>>("pread", verbose);
+	run_test<MMapStringTrait<uint64_t>>("mmap", verbose);
+	run_test<FencedStringTrait<uint64_t>>("fenced", verbose);
+	run_test<BlockCacheStringTrait<uint64_t>>("block-cache", verbose);
+	run_test<BlockedBloomStringTrait<uint64_t>>("blocked-bloom", verbose);
+	run_test<ValueLogStringTrait<uint64_t>>("value-log", verbose);
+	run_test<CompressedStringTrait<uint64_t>>("compressed", verbose);
 
 	return 0;
 }
@@ -5,47 +5,47 @@
 
 #include "test.hpp"
 
-class PersistenceTest : public Test {
+class PersistenceTest : public Test<> {
 private:
 	const uint64_t TEST_MAX = 1024 * 32;
 	void prepare(uint64_t max) {
 		uint64_t i;
 
 		// Clean up
-		store.Reset();
+		store->Reset();
 
 		// Test multiple key-value pairs
 		for (i = 0; i < max; ++i) {
-			store.Put(i, std::string(i + 1, 's'));
-			EXPECT(std::string(i + 1, 's'), store.Get(i));
+			store->Put(i, std::string(i + 1, 's'));
+			EXPECT(std::string(i + 1, 's'), store->Get(i));
 		}
 		phase();
 
 		// Test after all insertions
 		for (i = 0; i < max; ++i)
-			EXPECT(std::string(i + 1, 's'), store.Get(i));
+			EXPECT(std::string(i + 1, 's'), store->Get(i));
 		phase();
 
 		// Test deletions
 		for (i = 0; i < max; i += 2)
-			EXPECT(true, store.Delete(i));
+			EXPECT(true, store->Delete(i));
 
 		// Prepare data for Test Mode
 		for (i = 0; i < max; ++i) {
 			switch (i & 3) {
 			case 0:
-				EXPECT(std::optional<std::string>{}, store.Get(i));
-				store.Put(i, std::string(i + 1, 't'));
+				EXPECT(std::optional<std::string>{}, store->Get(i));
+				store->Put(i, std::string(i + 1, 't'));
 				break;
 			case 1:
-				EXPECT(std::string(i + 1, 's'), store.Get(i));
-				store.Put(i, std::string(i + 1, 't'));
+				EXPECT(std::string(i + 1, 's'), store->Get(i));
+				store->Put(i, std::string(i + 1, 't'));
 				break;
 			case 2:
-				EXPECT(std::optional<std::string>{}, store.Get(i));
+				EXPECT(std::optional<std::string>{}, store->Get(i));
 				break;
 			case 3:
-				EXPECT(std::string(i + 1, 's'), store.Get(i));
+				EXPECT(std::string(i + 1, 's'), store->Get(i));
 				break;
 			default:
 				assert(0);
@@ -60,7 +60,7 @@ private:
 		 * Write 10MB data to drain previous data out of memory.
 		 */
 		for (i = 0; i <= 10240; ++i)
-			store.Put(max + i, std::string(1024, 'x'));
+			store->Put(max + i, std::string(1024, 'x'));
 
 		std::cout << "Data is ready, please press ctrl-c/ctrl-d to"
 		             " terminate this program!"
@@ -74,17 +74,17 @@ private:
 				for (int j = 0; j <= 1000; ++j)
 					dummy = j;
 
-				store.Delete(max + i);
+				store->Delete(max + i);
 
 				for (int j = 0; j <= 1000; ++j)
 					dummy = j;
 
-				store.Put(max + i, std::string(1024, '.'));
+				store->Put(max + i, std::string(1024, '.'));
 
 				for (int j = 0; j <= 1000; ++j)
 					dummy = j;
 
-				store.Put(max + i, std::string(512, 'x'));
+				store->Put(max + i, std::string(512, 'x'));
 			}
 		}
 	}
@@ -95,16 +95,16 @@ private:
 		for (i = 0; i < max; ++i) {
 			switch (i & 3) {
 			case 0:
-				EXPECT(std::string(i + 1, 't'), store.Get(i));
+				EXPECT(std::string(i + 1, 't'), store->Get(i));
 				break;
 			case 1:
-				EXPECT(std::string(i + 1, 't'), store.Get(i));
+				EXPECT(std::string(i + 1, 't'), store->Get(i));
 				break;
 			case 2:
-				EXPECT(std::optional<std::string>{}, store.Get(i));
+				EXPECT(std::optional<std::string>{}, store->Get(i));
 				break;
 			case 3:
-				EXPECT(std::string(i + 1, 's'), store.Get(i));
+				EXPECT(std::string(i + 1, 's'), store->Get(i));
 				break;
 			default:
 				assert(0);
@@ -117,7 +117,7 @@ private:
 	}
 
 public:
-	PersistenceTest(const std::string &dir, bool v = true) : Test(dir, v) {}
+	PersistenceTest(const std::string &dir, bool v = true) : Test<>(dir, v) {}
 
 	void start_test(void *args = NULL) override {
 		bool testmode = (args && *static_cast<bool *>(args));
@@ -6,18 +6,18 @@
 #include <chrono>
 
 template <typename Key> struct Murmur3BloomHasher {
-	template <std::size_t Bits, typename Array> inline static void Insert(Array &array, const Key &key) {
+	template <typename Array> inline static void Insert(Array &array, lsm::size_type bits, const Key &key) {
 		uint32_t hashes[4];
 		MurmurHash3_x64_128(&key, sizeof(Key), 1, hashes);
-		array[hashes[0] % Bits] = true;
-		array[hashes[1] % Bits] = true;
-		array[hashes[2] % Bits] = true;
-		array[hashes[3] % Bits] = true;
+		array[hashes[0] % bits] = true;
+		array[hashes[1] % bits] = true;
+		array[hashes[2] % bits] = true;
+		array[hashes[3] % bits] = true;
 	}
-	template <std::size_t Bits, typename Array> inline static bool Exist(const Array &array, const Key &key) {
+	template <typename Array> inline static bool Exist(const Array &array, lsm::size_type bits, const Key &key) {
 		uint32_t hashes[4];
 		MurmurHash3_x64_128(&key, sizeof(Key), 1, hashes);
-		return array[hashes[0] % Bits] && array[hashes[1] % Bits] && array[hashes[2] % Bits] && array[hashes[3] % Bits];
+		return array[hashes[0] % bits] && array[hashes[1] % bits] && array[hashes[2] % bits] && array[hashes[3] % bits];
 	}
 };
 
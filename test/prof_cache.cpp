@@ -4,23 +4,53 @@
 
 #include <matplot/matplot.h>
 
-template <typename Key> struct UncachedTrait : public StandardTrait<Key> {
+template <typename Key, lsm::KVFileBackend Backend> struct UncachedTrait : public StandardTrait<Key> {
 	using KeyFile = lsm::KVUncachedKeyFile<Key, UncachedTrait>;
 	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
+	constexpr static lsm::KVFileBackend kFileBackend = Backend;
 };
-using UncachedKV = lsm::KV<uint64_t, std::string, UncachedTrait<uint64_t>>;
+template <lsm::KVFileBackend Backend>
+using UncachedKV = lsm::KV<uint64_t, std::string, UncachedTrait<uint64_t, Backend>>;
 
-template <typename Key> struct UncachedBloomTrait : public StandardTrait<Key> {
+template <typename Key, lsm::KVFileBackend Backend> struct UncachedBloomTrait : public StandardTrait<Key> {
 	using KeyFile = lsm::KVUncachedBloomKeyFile<Key, UncachedBloomTrait, StandardBloom<Key>>;
 	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
+	constexpr static lsm::KVFileBackend kFileBackend = Backend;
 };
-using UncachedBloomKV = lsm::KV<uint64_t, std::string, UncachedBloomTrait<uint64_t>>;
+template <lsm::KVFileBackend Backend>
+using UncachedBloomKV = lsm::KV<uint64_t, std::string, UncachedBloomTrait<uint64_t, Backend>>;
 
-template <typename Key> struct CachedTrait : public StandardTrait<Key> {
+template <typename Key, lsm::KVFileBackend Backend> struct FencedBloomTrait : public StandardTrait<Key> {
+	using KeyFile = lsm::KVFencedBloomKeyFile<Key, FencedBloomTrait, StandardBloom<Key>>;
+	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
+	constexpr static lsm::KVFileBackend kFileBackend = Backend;
+};
+template <lsm::KVFileBackend Backend>
+using FencedBloomKV = lsm::KV<uint64_t, std::string, FencedBloomTrait<uint64_t, Backend>>;
+
+template <typename Key, lsm::KVFileBackend Backend> struct CachedTrait : public StandardTrait<Key> {
 	using KeyFile = lsm::KVCachedKeyFile<Key, CachedTrait>;
 	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
+	constexpr static lsm::KVFileBackend kFileBackend = Backend;
+};
+template <lsm::KVFileBackend Backend>
+using CachedKV = lsm::KV<uint64_t, std::string, CachedTrait<uint64_t, Backend>>;
+
+template <typename Key, lsm::KVFileBackend Backend> struct CachedBloomTrait : public StandardTrait<Key> {
+	using KeyFile = lsm::KVCachedBloomKeyFile<Key, CachedBloomTrait, StandardBloom<Key>>;
+	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
+	constexpr static lsm::KVFileBackend kFileBackend = Backend;
+};
+template <lsm::KVFileBackend Backend>
+using CachedBloomKV = lsm::KV<uint64_t, std::string, CachedBloomTrait<uint64_t, Backend>>;
+
+template <typename Key, lsm::KVFileBackend Backend> struct CachedBlockedBloomTrait : public StandardTrait<Key> {
+	using KeyFile = lsm::KVCachedBloomKeyFile<Key, CachedBlockedBloomTrait, lsm::BlockedBloom<Key, 10240 * 8>>;
+	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
+	constexpr static lsm::KVFileBackend kFileBackend = Backend;
 };
-using CachedKV = lsm::KV<uint64_t, std::string, CachedTrait<uint64_t>>;
+template <lsm::KVFileBackend Backend>
+using CachedBlockedBloomKV = lsm::KV<uint64_t, std::string, CachedBlockedBloomTrait<uint64_t, Backend>>;
 
 constexpr lsm::size_type kDataSize = 2 * 1024, kCount = 64 * 1024 * 1024 / kDataSize;
 const std::string kValue(kDataSize, 's');
@@ -50,53 +80,83 @@ template <typename KV> inline ProfResult prof_get_us() {
 	return ret;
 }
 
-void plot(const std::vector<double> &get_us_vec, unsigned hit_rate) {
-	auto x = std::vector{1, 2, 3, 4};
-	auto bar = matplot::bar(x, get_us_vec);
+template <lsm::KVFileBackend Backend> inline std::vector<ProfResult> prof_backend() {
+	return {
+	    prof_get_us<UncachedKV<Backend>>(),
+	    prof_get_us<UncachedBloomKV<Backend>>(),
+	    prof_get_us<FencedBloomKV<Backend>>(),
+	    prof_get_us<CachedKV<Backend>>(),
+	    prof_get_us<CachedBloomKV<Backend>>(),
+	    prof_get_us<CachedBlockedBloomKV<Backend>>(),
+	};
+}
+
+// False positive rate and cost of a probe for absent keys, at 10 bits per key
+template <typename Filter> inline void prof_filter(const std::string &name) {
+	constexpr lsm::size_type kKeyCount = 1024 * 1024, kBitsPerKey = 10;
+	Filter filter{kKeyCount * kBitsPerKey};
+	for (uint64_t i = 0; i < kKeyCount; ++i)
+		filter.Insert(i << 1u);
+	uint64_t false_positives = 0;
+	double probe_ns = prof_sec([&filter, &false_positives] {
+		                  for (uint64_t i = 0; i < kKeyCount; ++i)
+			                  false_positives += filter.Exist(i << 1u | 1u);
+	                  }) *
+	                  1e9 / (double)kKeyCount;
+	std::cout << name << " false positive rate: " << (double)false_positives / (double)kKeyCount
+	          << " probe (ns): " << probe_ns << std::endl;
+}
+
+void plot(const std::vector<std::vector<double>> &get_us_vecs, unsigned hit_rate) {
+	auto x = std::vector<double>{1, 2, 3, 4, 5, 6};
+	auto bar = matplot::bar(x, get_us_vecs);
 	matplot::title("Hit Rate: " + std::to_string(hit_rate) + "%");
 	matplot::ylabel("Latency (μs)");
 	matplot::gca()->x_axis().ticklabels({
 	    "None",
 	    "Bloom",
+	    "Fenced+Bloom",
 	    "Cached",
 	    "Cached+Bloom",
+	    "Cached+Blocked",
 	});
 
 	std::vector<double> label_x;
 	std::vector<double> label_y;
 	std::vector<std::string> labels;
-	for (size_t i = 0; i < x.size(); ++i) {
-		label_x.emplace_back(bar->x_end_point(0, i) - 0.1);
-		label_y.emplace_back(get_us_vec[i] + 0.5);
-		labels.emplace_back(matplot::num2str(get_us_vec[i], "%.3f"));
-	}
+	for (size_t j = 0; j < get_us_vecs.size(); ++j)
+		for (size_t i = 0; i < x.size(); ++i) {
+			label_x.emplace_back(bar->x_end_point(j, i) - 0.1);
+			label_y.emplace_back(get_us_vecs[j][i] + 0.5);
+			labels.emplace_back(matplot::num2str(get_us_vecs[j][i], "%.3f"));
+		}
 	matplot::hold(true);
 	matplot::text(label_x, label_y, labels);
+	matplot::legend({"ifstream", "pread", "mmap"});
 	matplot::show();
 
 	matplot::hold(false);
 }
 
 int main() {
-	std::vector prof_vec = {
-	    prof_get_us<UncachedKV>(),
-	    prof_get_us<UncachedBloomKV>(),
-	    prof_get_us<CachedKV>(),
-	    prof_get_us<StandardKV>(),
+	prof_filter<StandardBloom<uint64_t>>("Bloom (Murmur3)");
+	prof_filter<lsm::Bloom<uint64_t, 0>>("Bloom");
+	prof_filter<lsm::BlockedBloom<uint64_t, 0>>("BlockedBloom");
+
+	std::vector prof_vecs = {
+	    prof_backend<lsm::KVFileBackend::kStream>(),
+	    prof_backend<lsm::KVFileBackend::kPRead>(),
+	    prof_backend<lsm::KVFileBackend::kMMap>(),
 	};
 
-	{
-		std::vector<double> get_us_vec;
-		get_us_vec.reserve(prof_vec.size());
-		for (const auto &i : prof_vec)
-			get_us_vec.push_back(i.hit100_us);
-		plot(get_us_vec, 100);
-	}
-	{
-		std::vector<double> get_us_vec;
-		get_us_vec.reserve(prof_vec.size());
-		for (const auto &i : prof_vec)
-			get_us_vec.push_back(i.hit50_us);
-		plot(get_us_vec, 50);
+	for (unsigned hit_rate : {100u, 50u}) {
+		std::vector<std::vector<double>> get_us_vecs;
+		for (const auto &prof_vec : prof_vecs) {
+			auto &get_us_vec = get_us_vecs.emplace_back();
+			get_us_vec.reserve(prof_vec.size());
+			for (const auto &i : prof_vec)
+				get_us_vec.push_back(hit_rate == 100 ? i.hit100_us : i.hit50_us);
+		}
+		plot(get_us_vecs, hit_rate);
 	}
 }
@@ -3,20 +3,23 @@
 #include <deque>
 #include <matplot/matplot.h>
 
+template <typename Key> struct BackgroundTrait : public StandardTrait<Key> {
+	using KeyFile = lsm::KVCachedBloomKeyFile<Key, BackgroundTrait, StandardBloom<Key>>;
+	constexpr static bool kBackgroundCompaction = true;
+};
+using BackgroundKV = lsm::KV<uint64_t, std::string, BackgroundTrait<uint64_t>>;
+
 constexpr lsm::size_type kDataSize = 8192, kCount = 128 * 1024 * 1024 / kDataSize, kWindowSize = 2048;
 const std::string kValue(kDataSize, 's');
 
-int main() {
-	std::vector<double> x(kCount);
-	for (unsigned i = 0; i < kCount; ++i)
-		x[i] = (i + 1) * kDataSize / 1024.0 / 1024.0;
+template <typename KV> std::vector<double> prof_put_throughput() {
 	std::vector<double> y;
 	y.reserve(kCount);
 
 	std::deque<long double> window;
 
 	long double sum = 0.0;
-	StandardKV kv{"data"};
+	KV kv{"data"};
 	kv.Reset();
 	for (int i = 0; i < kCount; ++i) {
 		double sec = prof_sec([&kv, i]() { kv.Put(i, kValue); });
@@ -29,9 +32,20 @@ int main() {
 		y.push_back(double((long double)window.size() / sum));
 		printf("%d\n", i);
 	}
+	return y;
+}
+
+int main() {
+	std::vector<double> x(kCount);
+	for (unsigned i = 0; i < kCount; ++i)
+		x[i] = (i + 1) * kDataSize / 1024.0 / 1024.0;
+
+	std::vector<double> y = prof_put_throughput<StandardKV>();
+	std::vector<double> bg_y = prof_put_throughput<BackgroundKV>();
 
-	matplot::plot(x, y);
+	matplot::plot(x, y, x, bg_y);
+	matplot::legend({"Foreground", "Background"});
 	matplot::xlabel("Total Data Size (MiB)");
 	matplot::ylabel("Throughput (Put()/sec)");
 	matplot::show();
-}
\ No newline at end of file
+}
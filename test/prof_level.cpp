@@ -4,18 +4,6 @@
 
 #include <matplot/matplot.h>
 
-template <typename Key, lsm::size_type TieringSize, lsm::size_type SizeRatio>
-struct LevelTrait : public StandardTrait<Key> {
-	using KeyFile = lsm::KVCachedBloomKeyFile<Key, LevelTrait, lsm::Bloom<Key, 10240 * 8, Murmur3BloomHasher<Key>>>;
-	inline constexpr static lsm::KVLevelConfig kLevelConfigs[] = {
-	    {TieringSize, lsm::KVLevelType::kTiering},
-	    {TieringSize * SizeRatio, lsm::KVLevelType::kLeveling},
-	    {TieringSize * SizeRatio * SizeRatio, lsm::KVLevelType::kLeveling},
-	    {TieringSize * SizeRatio * SizeRatio * SizeRatio, lsm::KVLevelType::kLeveling},
-	    {TieringSize * SizeRatio * SizeRatio * SizeRatio * SizeRatio, lsm::KVLevelType::kLeveling},
-	};
-};
-
 constexpr lsm::size_type kDataSize = 8 * 1024, kCount = 128 * 1024 * 1024 / kDataSize;
 const std::string kValue(kDataSize, 's');
 
@@ -23,10 +11,13 @@ struct ProfResult {
 	double put_us, get_us;
 };
 
-template <lsm::size_type TieringSize, lsm::size_type SizeRatio> ProfResult prof_level_config() {
-	printf("TS = %d, Ratio = %d\n", TieringSize, SizeRatio);
-	using KV = lsm::KV<uint64_t, std::string, LevelTrait<uint64_t, TieringSize, SizeRatio>>;
-	KV kv{"data"};
+ProfResult prof_level_config(lsm::size_type tiering_size, lsm::size_type size_ratio) {
+	printf("TS = %d, Ratio = %d\n", tiering_size, size_ratio);
+	auto options = lsm::KVOptions::FromTrait<StandardTrait<uint64_t>>();
+	options.level_configs = {{tiering_size, lsm::KVLevelType::kTiering}};
+	for (lsm::size_type i = 1, max_files = tiering_size; i < 5; ++i)
+		options.level_configs.push_back({max_files *= size_ratio, lsm::KVLevelType::kLeveling});
+	StandardKV kv{"data", options};
 	kv.Reset();
 
 	ProfResult ret = {};
@@ -46,20 +37,12 @@ template <lsm::size_type TieringSize, lsm::size_type SizeRatio> ProfResult prof_
 	return ret;
 }
 
-template <lsm::size_type MaxTieringSize, lsm::size_type MaxSizeRatio, lsm::size_type TieringSize = 1,
-          lsm::size_type SizeRatio = 1>
-void fill_prof_results(ProfResult results[MaxTieringSize + 1][MaxSizeRatio + 1]) {
-	results[TieringSize][SizeRatio] = prof_level_config<TieringSize, SizeRatio>();
-	if constexpr (TieringSize < MaxTieringSize)
-		fill_prof_results<MaxTieringSize, MaxSizeRatio, TieringSize + 1, SizeRatio>(results);
-	else if constexpr (SizeRatio < MaxSizeRatio)
-		fill_prof_results<MaxTieringSize, MaxSizeRatio, 1, SizeRatio + 1>(results);
-}
-
 int main() {
 	constexpr lsm::size_type kMaxTieringSize = 5, kMaxSizeRatio = 5;
 	ProfResult prof_results[kMaxTieringSize + 1][kMaxSizeRatio + 1]{};
-	fill_prof_results<kMaxTieringSize, kMaxSizeRatio>(prof_results);
+	for (lsm::size_type j = 1; j <= kMaxSizeRatio; ++j)
+		for (lsm::size_type i = 1; i <= kMaxTieringSize; ++i)
+			prof_results[i][j] = prof_level_config(i, j);
 
 	std::vector<std::vector<double>> put_map(kMaxTieringSize), get_map(kMaxTieringSize), del_map(kMaxTieringSize);
 	for (auto i = 0; i < kMaxTieringSize; ++i) {
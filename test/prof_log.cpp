@@ -0,0 +1,55 @@
+#include <iostream>
+
+#include "prof.hpp"
+
+#include <matplot/matplot.h>
+
+template <typename Key, lsm::KVLogMode Mode> struct LogTrait : public StandardTrait<Key> {
+	using KeyFile = lsm::KVCachedBloomKeyFile<Key, LogTrait, StandardBloom<Key>>;
+	constexpr static lsm::KVLogConfig kLogConfig = {Mode, 256 * 1024, 0};
+};
+
+constexpr lsm::size_type kDataSize[] = {2 * 1024, 4 * 1024, 6 * 1024, 8 * 1024};
+constexpr lsm::size_type kTotalSize = 32 * 1024 * 1024;
+
+template <lsm::KVLogMode Mode> std::vector<double> prof_put_us() {
+	using KV = lsm::KV<uint64_t, std::string, LogTrait<uint64_t, Mode>>;
+	std::vector<double> put_us_vec;
+
+	KV kv{"data"};
+	for (lsm::size_type sz : kDataSize) {
+		kv.Reset();
+
+		std::string value(sz, 's');
+		lsm::size_type count = kTotalSize / sz;
+		double put_us = prof_us([count, &kv, &value]() {
+			                for (auto i = 0; i < count; ++i)
+				                kv.Put(i, value);
+		                }) /
+		                (double)count;
+		printf("MODE = %d, SZ = %u, PUT: %.6lf us\n", (int)Mode, sz, put_us);
+		put_us_vec.push_back(put_us);
+	}
+	return put_us_vec;
+}
+
+int main() {
+	std::vector<std::vector<double>> us_y = {
+	    prof_put_us<lsm::KVLogMode::kDisabled>(),
+	    prof_put_us<lsm::KVLogMode::kNoSync>(),
+	    prof_put_us<lsm::KVLogMode::kGroupCommit>(),
+	    prof_put_us<lsm::KVLogMode::kSync>(),
+	};
+
+	std::vector<double> x(std::size(kDataSize));
+	for (int i = 0; i < std::size(kDataSize); ++i)
+		x[i] = kDataSize[i] / 1024.0;
+
+	matplot::bar(x, us_y);
+	matplot::legend({"No Log", "No Sync", "Group Commit", "Sync"});
+	matplot::xlabel("Data Size (KiB)");
+	matplot::ylabel("Put() Latency (μs)");
+	matplot::show();
+
+	return 0;
+}
@@ -7,8 +7,8 @@
 int main() {
 	constexpr lsm::size_type kDataSize[] = {2 * 1024, 4 * 1024, 6 * 1024, 8 * 1024};
 
-	std::vector<double> put_us_vec, get_seq_us_vec, get_rnd_us_vec, del_us_vec;
-	std::vector<double> put_tp_vec, get_seq_tp_vec, get_rnd_tp_vec, del_tp_vec;
+	std::vector<double> put_us_vec, get_seq_us_vec, get_rnd_us_vec, del_us_vec, blind_del_us_vec;
+	std::vector<double> put_tp_vec, get_seq_tp_vec, get_rnd_tp_vec, del_tp_vec, blind_del_tp_vec;
 
 	StandardKV kv{"data"};
 	for (lsm::size_type sz : kDataSize) {
@@ -68,22 +68,33 @@ int main() {
 			del_us_vec.push_back(del_avg_sec * 1000000.0);
 			del_tp_vec.push_back(1.0 / del_avg_sec);
 		}
+		{
+			double blind_del_avg_sec = prof_sec([count, &kv]() {
+				                           for (auto i = 0; i < count; ++i) {
+					                           kv.BlindDelete(i);
+				                           }
+			                           }) /
+			                           (double)count;
+			printf("DEL(BLIND): %.20lf sec\n", blind_del_avg_sec);
+			blind_del_us_vec.push_back(blind_del_avg_sec * 1000000.0);
+			blind_del_tp_vec.push_back(1.0 / blind_del_avg_sec);
+		}
 	}
 
 	std::vector<double> x(std::size(kDataSize));
 	for (int i = 0; i < std::size(kDataSize); ++i)
 		x[i] = kDataSize[i] / 1024.0;
-	std::vector<std::vector<double>> us_y = {put_us_vec, get_seq_us_vec, get_rnd_us_vec, del_us_vec};
-	std::vector<std::vector<double>> tp_y = {put_tp_vec, get_seq_tp_vec, get_rnd_tp_vec, del_tp_vec};
+	std::vector<std::vector<double>> us_y = {put_us_vec, get_seq_us_vec, get_rnd_us_vec, del_us_vec, blind_del_us_vec};
+	std::vector<std::vector<double>> tp_y = {put_tp_vec, get_seq_tp_vec, get_rnd_tp_vec, del_tp_vec, blind_del_tp_vec};
 
 	matplot::bar(x, us_y);
-	matplot::legend({"Put", "Get (SEQ)", "Get (RAND)", "Delete"});
+	matplot::legend({"Put", "Get (SEQ)", "Get (RAND)", "Delete", "Delete (Blind)"});
 	matplot::xlabel("Data Size (KiB)");
 	matplot::ylabel("Latency (μs)");
 	matplot::show();
 
 	matplot::bar(x, tp_y);
-	matplot::legend({"Put", "Get (SEQ)", "Get (RAND)", "Delete"});
+	matplot::legend({"Put", "Get (SEQ)", "Get (RAND)", "Delete", "Delete (Blind)"});
 	matplot::xlabel("Data Size (KiB)");
 	matplot::ylabel("Throughput (call/sec)");
 	matplot::show();
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
 
 #include <lsm/kv.hpp>
@@ -11,18 +12,18 @@
 #include <snappy.h>
 
 template <typename Key> struct Murmur3BloomHasher {
-	template <std::size_t Bits, typename Array> inline static void Insert(Array &array, const Key &key) {
+	template <typename Array> inline static void Insert(Array &array, lsm::size_type bits, const Key &key) {
 		uint32_t hashes[4];
 		MurmurHash3_x64_128(&key, sizeof(Key), 1, hashes);
-		array[hashes[0] % Bits] = true;
-		array[hashes[1] % Bits] = true;
-		array[hashes[2] % Bits] = true;
-		array[hashes[3] % Bits] = true;
+		array[hashes[0] % bits] = true;
+		array[hashes[1] % bits] = true;
+		array[hashes[2] % bits] = true;
+		array[hashes[3] % bits] = true;
 	}
-	template <std::size_t Bits, typename Array> inline static bool Exist(const Array &array, const Key &key) {
+	template <typename Array> inline static bool Exist(const Array &array, lsm::size_type bits, const Key &key) {
 		uint32_t hashes[4];
 		MurmurHash3_x64_128(&key, sizeof(Key), 1, hashes);
-		return array[hashes[0] % Bits] && array[hashes[1] % Bits] && array[hashes[2] % Bits] && array[hashes[3] % Bits];
+		return array[hashes[0] % bits] && array[hashes[1] % bits] && array[hashes[2] % bits] && array[hashes[3] % bits];
 	}
 };
 
@@ -74,11 +75,39 @@ template <int Acceleration> struct LZ4StringIO {
 	}
 };
 
-template <typename Key> struct MyStringTrait : public lsm::KVDefaultTrait<Key, std::string> {
+// Block codecs for KVCompression::kLZ4 and kSnappy
+struct LZ4SnappyCompressor {
+	inline static bool Compress(lsm::KVCompression compression, const char *src, lsm::size_type size,
+	                            std::string *dst) {
+		if (compression == lsm::KVCompression::kSnappy) {
+			snappy::Compress(src, size, dst);
+			return true;
+		}
+		if (compression == lsm::KVCompression::kLZ4) {
+			dst->resize(LZ4_compressBound((int)size));
+			int compressed_size = LZ4_compress_default(src, dst->data(), (int)size, (int)dst->size());
+			dst->resize(compressed_size);
+			return compressed_size > 0;
+		}
+		return false;
+	}
+	inline static void Uncompress(lsm::KVCompression compression, const char *src, lsm::size_type size, char *dst,
+	                              lsm::size_type raw_size) {
+		if (compression == lsm::KVCompression::kSnappy)
+			snappy::RawUncompress(src, size, dst);
+		else if (compression == lsm::KVCompression::kLZ4)
+			LZ4_decompress_safe(src, dst, (int)size, (int)raw_size);
+	}
+};
+
+template <typename Key> using MyStringBloom = lsm::Bloom<Key, 10240 * 8, Murmur3BloomHasher<Key>>;
+
+// Settings shared by the test traits, Derived is the trait the key files are built for
+template <typename Key, typename Derived> struct MyStringTraitBase : public lsm::KVDefaultTrait<Key, std::string> {
 	using Compare = std::less<Key>;
 	using Container = lsm::SkipList<Key, lsm::KVMemValue<std::string>, Compare, std::default_random_engine, 1, 2, 32>;
-	using KeyFile = lsm::KVCachedBloomKeyFile<Key, MyStringTrait, lsm::Bloom<Key, 10240 * 8, Murmur3BloomHasher<Key>>>;
-	// using KeyFile = lsm::KVUncachedKeyFile<Key, MyStringTrait>;
+	using KeyFile = lsm::KVCachedBloomKeyFile<Key, Derived, MyStringBloom<Key>>;
+	// using KeyFile = lsm::KVUncachedKeyFile<Key, Derived>;
 	// using ValueIO = SnappyStringIO; // LZ4StringIO<4000>;
 	constexpr static lsm::size_type kMaxFileSize = 2 * 1024 * 1024;
 
@@ -88,14 +117,104 @@ template <typename Key> struct MyStringTrait : public lsm::KVDefaultTrait<Key, s
 	};
 };
 
-class Test {
+template <typename Key> struct MyStringTrait : public MyStringTraitBase<Key, MyStringTrait<Key>> {};
+
+// The memtable of MyStringTrait on an arena
+template <typename Key> struct ArenaStringTrait : public MyStringTraitBase<Key, ArenaStringTrait<Key>> {
+	using Container = lsm::ArenaSkipList<Key, lsm::KVMemValue<std::string>, std::less<Key>>;
+};
+
+// Writers insert into the memtable in parallel and share the syncs of the log
+template <typename Key> struct ConcurrentStringTrait : public MyStringTraitBase<Key, ConcurrentStringTrait<Key>> {
+	using Container = lsm::ConcurrentSkipList<Key, lsm::KVMemValue<std::string>, std::less<Key>>;
+	constexpr static lsm::KVLogConfig kLogConfig = {lsm::KVLogMode::kGroupCommit, 256 * 1024, 0};
+};
+
+// Flushes and compactions on the worker thread
+template <typename Key> struct BackgroundStringTrait : public MyStringTraitBase<Key, BackgroundStringTrait<Key>> {
+	constexpr static bool kBackgroundCompaction = true;
+};
+
+// Large compactions merged in several key ranges at once, level 0 holds enough tables for them to be split. Read-ahead
+// chunks hold a few values, so that the ranges end inside them.
+template <typename Key>
+struct SubcompactionStringTrait : public MyStringTraitBase<Key, SubcompactionStringTrait<Key>> {
+	constexpr static lsm::size_type kSubcompactions = 4;
+	constexpr static lsm::size_type kCompactionReadAhead = 4 * 1024 + 512;
+
+	constexpr static lsm::KVLevelConfig kLevelConfigs[] = {
+	    {8, lsm::KVLevelType::kTiering},
+	    {8, lsm::KVLevelType::kLeveling},
+	    {16, lsm::KVLevelType::kLeveling},
+	    {32, lsm::KVLevelType::kLeveling},
+	};
+};
+
+// Sorted levels sized by bytes instead of files
+template <typename Key> struct LevelBytesStringTrait : public MyStringTraitBase<Key, LevelBytesStringTrait<Key>> {
+	constexpr static lsm::KVLevelConfig kLevelConfigs[] = {
+	    {2, lsm::KVLevelType::kTiering},
+	    {0, lsm::KVLevelType::kLeveling, 0, 6 * 1024 * 1024},
+	    {0, lsm::KVLevelType::kLeveling, 0, 16 * 1024 * 1024},
+	    {0, lsm::KVLevelType::kLeveling, 0, 48 * 1024 * 1024},
+	};
+};
+
+// Key files that keep a few keys in memory and read the run between two of them for a lookup
+template <typename Key> struct FencedStringTrait : public MyStringTraitBase<Key, FencedStringTrait<Key>> {
+	using KeyFile = lsm::KVFencedBloomKeyFile<Key, FencedStringTrait, MyStringBloom<Key>, 16>;
+};
+
+// Tables read with positional reads on a descriptor each
+template <typename Key> struct PReadStringTrait : public MyStringTraitBase<Key, PReadStringTrait<Key>> {
+	constexpr static lsm::KVFileBackend kFileBackend = lsm::KVFileBackend::kPRead;
+};
+
+// Tables read straight from their mappings
+template <typename Key> struct MMapStringTrait : public MyStringTraitBase<Key, MMapStringTrait<Key>> {
+	constexpr static lsm::KVFileBackend kFileBackend = lsm::KVFileBackend::kMMap;
+};
+
+// Table reads through a block cache smaller than the tables
+template <typename Key> struct BlockCacheStringTrait : public MyStringTraitBase<Key, BlockCacheStringTrait<Key>> {
+	constexpr static lsm::size_type kBlockCacheSize = 2 * 1024 * 1024;
+};
+
+// Filters with all probes of a key in one cache line
+template <typename Key> struct BlockedBloomStringTrait : public MyStringTraitBase<Key, BlockedBloomStringTrait<Key>> {
+	using KeyFile = lsm::KVCachedBloomKeyFile<Key, BlockedBloomStringTrait, lsm::BlockedBloom<Key, 10240 * 8>>;
+};
+
+// Large values are separated into value log files small enough to be collected during the test
+template <typename Key> struct ValueLogStringTrait : public MyStringTraitBase<Key, ValueLogStringTrait<Key>> {
+	constexpr static lsm::size_type kValueLogThreshold = 256;
+	constexpr static lsm::size_type kValueLogFileSize = 1024 * 1024;
+};
+
+// Compressed value blocks, level 0 is rewritten soon so only the levels below compress
+template <typename Key> struct CompressedStringTrait : public MyStringTraitBase<Key, CompressedStringTrait<Key>> {
+	constexpr static bool kBlockCompression = true;
+	using Compressor = LZ4SnappyCompressor;
+
+	constexpr static lsm::KVLevelConfig kLevelConfigs[] = {
+	    {2, lsm::KVLevelType::kTiering},
+	    {4, lsm::KVLevelType::kLeveling, 0, 0, lsm::KVCompression::kLZ4},
+	    {8, lsm::KVLevelType::kLeveling, 0, 0, lsm::KVCompression::kLZ4},
+	    {16, lsm::KVLevelType::kLeveling, 0, 0, lsm::KVCompression::kSnappy},
+	    {32, lsm::KVLevelType::kLeveling, 0, 0, lsm::KVCompression::kSnappy},
+	};
+};
+
+template <typename Trait = MyStringTrait<uint64_t>> class Test {
 protected:
+	using KV = lsm::KV<uint64_t, std::string, Trait>;
+
 	uint64_t nr_tests;
 	uint64_t nr_passed_tests;
 	uint64_t nr_phases;
 	uint64_t nr_passed_phases;
 
-#define EXPECT(exp, got) expect(exp, got, __FILE__, __LINE__)
+#define EXPECT(exp, got) this->expect(exp, got, __FILE__, __LINE__)
 	template <typename T>
 	void expect(const std::optional<T> &exp, const std::optional<T> &got, const std::string &file, int line) {
 		++nr_tests;
@@ -177,16 +296,23 @@ protected:
 		nr_passed_phases = 0;
 	}
 
-	lsm::KV<uint64_t, std::string, MyStringTrait<uint64_t>> store;
+	std::string dir;
+	std::unique_ptr<KV> store;
 	bool verbose;
 
+	// Close the store and open it again from its files
+	void reopen() {
+		store.reset();
+		store = std::make_unique<KV>(dir);
+	}
+
 public:
-	explicit Test(const std::string &dir, bool v = true) : store(dir), verbose(v) {
+	explicit Test(const std::string &dir, bool v = true) : dir(dir), store(std::make_unique<KV>(dir)), verbose(v) {
 		nr_tests = 0;
 		nr_passed_tests = 0;
 		nr_phases = 0;
 		nr_passed_phases = 0;
 	}
 
-	virtual void start_test(void *args = NULL) { std::cout << "No test is implemented." << std::endl; }
+	virtual void start_test(void * = NULL) { std::cout << "No test is implemented." << std::endl; }
 };